@@ -1,7 +1,8 @@
 /**
  * A format program to init diskimg.
- * i.e. write its super block and bitmap blocks data.
- * 
+ * i.e. write its super block, bitmap blocks and chain table.
+ *
+ * usage: diskimg_init [-b block_size] [-v version] [-i 0|1] [-d 0|1] [diskimg]
  */
 
 #include <stdio.h>
@@ -10,24 +11,34 @@
 #include <unistd.h>
 #include <sys/stat.h>
 
-#define BLOCK_SIZE 512
-#define NUM_SUPER_BLOCK 1
-#define NUM_BITMAP_BLOCK 1280
-#define MAX_DATA_IN_BLOCK (BLOCK_SIZE - sizeof(long) - sizeof(size_t))
+#define BLOCK_SIZE_MIN 512
+#define BLOCK_SIZE_MAX (64 << 10)
+#define BLOCK_SIZE_DEFAULT 4096
+#define U_FS_MAGIC 0x55465331L //"1SFU"，老格式的diskimg这里是0
+#define U_FS_VERSION_CHAIN 2  //files are chains in the chain table
+#define U_FS_VERSION_EXTENT 3 //files are extent lists, directories are still chains
+#define U_FS_FEATURE_DIR_INDEX 1L //directories larger than a block get a hashed index
+#define U_FS_DIRENT_PACKED 1 //directory blocks hold 32-byte little-endian entries with a name hash
 #define MAX_FILENAME 8
 #define MAX_EXTENSION 3
 #define NO_NEXT -1
 
-#define BIT_TO_BYTE(b) ((b)/8)
 typedef unsigned char BYTE;
 
 static size_t get_file_size(const char* filepath);
 static void print_binary(BYTE byte, int size); //将n二进制输出
 
-struct sb {//24bytes
+struct sb { //80bytes
     long fs_size; //size of file system, in blocks
     long first_blk; //first block of root directory
     long bitmap; //size of bitmap, in blocks
+    long magic; //U_FS_MAGIC
+    long version; //U_FS_VERSION_CHAIN or U_FS_VERSION_EXTENT
+    long block_size; //size of a block, in bytes, power of 2
+    long chain_blk; //first block of chain table
+    long chain_size; //size of chain table, in blocks
+    long features; //U_FS_FEATURE_* bits
+    long dir_version; //directory entry format, 0 for 40-byte struct u_fs_file_directory
 };
 
 struct u_fs_file_directory { //40bytes
@@ -38,25 +49,70 @@ struct u_fs_file_directory { //40bytes
     int flag; //indicate type of file. 0:for unused; 1:for file; 2:for directory
 };
 
-struct u_fs_disk_block { //512bytes
-    size_t size; // how many bytes are being used in this block
-    long nNextBlock; //The next disk block, if needed. 
-                     //This is the next pointer in the linked allocation list
-    char data[MAX_DATA_IN_BLOCK]; //And all the rest of the space in the block...
-                                  //can be used for actual data storage.
+struct u_fs_chain { //16bytes, chain table entry of a block
+    long next; //the next disk block, -1 for the end of the chain
+    long used; //how many bytes are being used in a directory block
 };
 
-int main()
+int main(int argc, char *argv[])
 {
-
     // the path should be like /home/zzy/Desktop/OS/.../diskimg
     const char* diskimg_path = "/home/zzy/Desktop/OS/diskimg";
+    long block_size = BLOCK_SIZE_DEFAULT;
+    long version = U_FS_VERSION_EXTENT;
+    long dir_index = 1;
+    long dir_version = U_FS_DIRENT_PACKED;
+    int opt;
+    while((opt = getopt(argc, argv, "b:v:i:d:")) != -1){
+        if(opt == 'b'){
+            block_size = strtol(optarg, NULL, 0);
+        }
+        else if(opt == 'v'){
+            version = strtol(optarg, NULL, 0);
+        }
+        else if(opt == 'i'){
+            dir_index = strtol(optarg, NULL, 0);
+        }
+        else if(opt == 'd'){
+            dir_version = strtol(optarg, NULL, 0) ? U_FS_DIRENT_PACKED : 0;
+        }
+        else{
+            printf("usage: %s [-b block_size] [-v version] [-i 0|1] [-d 0|1] [diskimg]\n", argv[0]);
+            return 1;
+        }
+    }
+    if(optind < argc){
+        diskimg_path = argv[optind];
+    }
+    if(block_size < BLOCK_SIZE_MIN || block_size > BLOCK_SIZE_MAX
+    || (block_size & (block_size - 1)) != 0){
+        printf("block size must be a power of 2 between %d and %d\n", BLOCK_SIZE_MIN, BLOCK_SIZE_MAX);
+        return 1;
+    }
+    if(version != U_FS_VERSION_CHAIN && version != U_FS_VERSION_EXTENT){
+        printf("version must be %d (block chains) or %d (extents)\n", U_FS_VERSION_CHAIN, U_FS_VERSION_EXTENT);
+        return 1;
+    }
     if(access(diskimg_path, F_OK) != 0) { //diskimg_path is not existed
         printf("diskimg path is not existed\n");
         return -1;
     }
     const size_t diskimg_size = get_file_size(diskimg_path);
 
+    /**
+     * 0. layout
+     * | super block | bitmap | chain table | root directory | data ...
+     * each block has a bit in bitmap and a u_fs_chain in chain table
+     */
+    long fs_size = diskimg_size / block_size;
+    long bitmap_blocks = (fs_size + block_size * 8 - 1) / (block_size * 8);
+    long chain_blocks = (fs_size * (long)sizeof(struct u_fs_chain) + block_size - 1) / block_size;
+    long root_blk = 1 + bitmap_blocks + chain_blocks;
+    if(root_blk + 1 >= fs_size){
+        printf("diskimg is too small for block size %ld\n", block_size);
+        return 2;
+    }
+
     /**
      * 1. init super block
      */
@@ -66,59 +122,65 @@ int main()
         perror("diskimg open failed\n");
         return 3;
     }
-    struct sb *sblk = malloc(sizeof(struct sb)); 
-    sblk->fs_size = diskimg_size / BLOCK_SIZE;
-    sblk->first_blk = NUM_SUPER_BLOCK + NUM_BITMAP_BLOCK; //1 + 1280 = 1281
-    sblk->bitmap = NUM_BITMAP_BLOCK;
+    BYTE *blk = calloc(1, block_size);
+    struct sb *sblk = (struct sb *)blk;
+    sblk->fs_size = fs_size;
+    sblk->first_blk = root_blk;
+    sblk->bitmap = bitmap_blocks;
+    sblk->magic = U_FS_MAGIC;
+    sblk->version = version;
+    sblk->block_size = block_size;
+    sblk->chain_blk = 1 + bitmap_blocks;
+    sblk->chain_size = chain_blocks;
+    sblk->features = dir_index ? U_FS_FEATURE_DIR_INDEX : 0;
+    sblk->dir_version = dir_version;
 
     if(fseek(fp, 0, SEEK_SET) !=0){
         perror("init super block fseek error\n");
         return 4;
     }
-    fwrite(sblk, sizeof(struct sb), 1, fp);
-    free(sblk);
-    sblk = NULL;
+    fwrite(blk, block_size, 1, fp);
     printf("super block format finished\n");
 
     /**
      * 2. init bitmap block
-     * the total bits of bitmap = diskimg_size / BLOCK_SIZE
+     * super block, bitmap, chain table and root directory are in use
      */
-    BYTE byte[NUM_BITMAP_BLOCK / 8];
-    memset(byte, -1, NUM_BITMAP_BLOCK / 8);
-    BYTE s_byte = (3<<6);
-    BYTE rest_byte[(diskimg_size / BLOCK_SIZE) - NUM_BITMAP_BLOCK - 8];
-    if(fseek(fp, BLOCK_SIZE * 1, SEEK_SET) != 0){
-        perror("init bitmap block fseek error\n");
-        return 5;
+    long i;
+    for(i = 0; i < bitmap_blocks; i++){
+        memset(blk, 0, block_size);
+        long bit;
+        for(bit = i * block_size * 8; bit <= root_blk && bit < (i + 1) * block_size * 8; bit++){
+            blk[(bit / 8) % block_size] |= (BYTE)((1<<7) >> (bit%8));
+        }
+        fwrite(blk, block_size, 1, fp);
     }
-    fwrite(byte, sizeof(byte), 1, fp);
-    fwrite(&s_byte, sizeof(s_byte), 1, fp);
-    fwrite(rest_byte, sizeof(rest_byte), 1, fp);
     printf("bitmap block format finished\n");
 
     /**
-     * 3. init first data block
-     * this is for root directory block
+     * 3. init chain table
+     * no block is linked to another, the root directory is empty
      */
-    struct u_fs_disk_block *root = malloc(sizeof(struct u_fs_disk_block));
-	root->size = 0;
-	root->nNextBlock = -1;
-	root->data[0] = '\0';
-    if(fseek(fp, BLOCK_SIZE * (NUM_BITMAP_BLOCK + 1), SEEK_SET) != 0){
-        perror("init first data block fseek error\n");
-        return 6;
+    struct u_fs_chain *ch = (struct u_fs_chain *)blk;
+    long per_blk = block_size / sizeof(struct u_fs_chain);
+    for(i = 0; i < per_blk; i++){
+        ch[i].next = NO_NEXT;
+        ch[i].used = 0;
+    }
+    for(i = 0; i < chain_blocks; i++){
+        fwrite(blk, block_size, 1, fp);
     }
-    fwrite(root, sizeof(struct u_fs_disk_block), 1, fp);
-    free(root);
-    root = NULL;
-    printf("first data block format finished\n");
+    printf("chain table format finished\n");
+    free(blk);
+    blk = NULL;
 
     if(fclose(fp) != 0){
         perror("file closed failed\n");
     }
 
-    printf("format finished!\n");
+    printf("format finished! version %ld, block size %ld, %ld blocks, root directory at %ld%s%s\n",
+           version, block_size, fs_size, root_blk, dir_index ? ", hashed directory index" : "",
+           dir_version ? ", packed directory entries" : "");
     return 0;
 }
 
@@ -26,8 +26,10 @@
  */
 
 #define FUSE_USE_VERSION 31
+#define _GNU_SOURCE //O_DIRECT、statx
 
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -35,23 +37,63 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <endian.h>
 #include <assert.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <time.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#define U_FS_AVX2
+#include <immintrin.h>
+#endif
+#ifdef U_FS_IO_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE //linux/fs.h里也有一个BLOCK_SIZE
+#endif
 
-#define BLOCK_SIZE 512
+#define BLOCK_SIZE_MIN 512
+#define BLOCK_SIZE_MAX (64 << 10)
+#define U_FS_MAGIC 0x55465331L //"1SFU"，老格式的diskimg这里是0
+#define U_FS_VERSION_CHAIN 2  //文件的块靠块链表串起来
+#define U_FS_VERSION_EXTENT 3 //文件用extent记录，目录还是用块链表
+#define U_FS_VERSION U_FS_VERSION_EXTENT //diskimg_init默认格式化的版本
+#define U_FS_FEATURE_DIR_INDEX 1L         //超过一块的目录改成散列索引
+#define U_FS_DIRENT_PACKED 1              //目录块里是32字节的u_fs_dirent
 #define NUM_SUPER_BLOCK 1
-#define NUM_BITMAP_BLOCK 1280
-#define MAX_DATA_IN_BLOCK (BLOCK_SIZE - sizeof(long) - sizeof(size_t))
 #define MAX_FILENAME 8
 #define MAX_EXTENSION 3
 
-long NUM_TOTAL_BLOCK; //在u_fs_init中进行初始化
+//下面几个都在load_superblock()中按超级块初始化
+long NUM_TOTAL_BLOCK;
+long BLOCK_SIZE;        //块大小，格式化时选定，512到64K之间的2的幂
+int BLOCK_SHIFT;        //log2(BLOCK_SIZE)，文件偏移换算成块用移位和掩码
+long NUM_BITMAP_BLOCK;  //位图占多少块，位图从第1块开始
+long CHAIN_START_BLOCK; //块链表从哪一块开始
+long NUM_CHAIN_BLOCK;   //块链表占多少块
+long ROOT_DIR_BLOCK;    //根目录所在的块，之后都是数据块
+long FS_VERSION;        //U_FS_VERSION_CHAIN或U_FS_VERSION_EXTENT
+long FS_FEATURES;       //U_FS_FEATURE_*，格式化时选定
+long DIR_VERSION;       //目录块里目录项的格式，0或U_FS_DIRENT_PACKED
+long DIRENT_SIZE;       //目录块里一项占多少字节
 typedef unsigned char BYTE;
 const char *DISKIMG_PATH = "/home/zzy/Desktop/OS/diskimg";
 
-struct sb { //24bytes
+struct sb { //80bytes
     long fs_size; //size of file system, in blocks
     long first_blk; //first block of root directory
     long bitmap; //size of bitmap, in blocks
+    long magic; //U_FS_MAGIC
+    long version; //U_FS_VERSION_CHAIN or U_FS_VERSION_EXTENT
+    long block_size; //size of a block, in bytes, power of 2
+    long chain_blk; //first block of chain table
+    long chain_size; //size of chain table, in blocks
+    long features; //U_FS_FEATURE_* bits, 0 on images formatted before features existed
+    long dir_version; //directory entry format, 0 for struct u_fs_file_directory, U_FS_DIRENT_PACKED
 };
 
 struct u_fs_file_directory { //40bytes
@@ -62,14 +104,464 @@ struct u_fs_file_directory { //40bytes
     int flag; //indicate type of file. 0:for unused; 1:for file; 2:for directory
 };
 
-struct u_fs_disk_block { //512bytes
-    size_t size; // how many bytes are being used in this block
-    long nNextBlock; //The next disk block, if needed. 
-                     //This is the next pointer in the linked allocation list
-    char data[MAX_DATA_IN_BLOCK]; //And all the rest of the space in the block...
-                                  //can be used for actual data storage.
+/**
+ * 目录块里的目录项
+ * 超级块的dir_version为0（之前格式化的diskimg）时目录块里直接是上面40字节的u_fs_file_directory，
+ * 中间有填充，字节序跟着机器走。为U_FS_DIRENT_PACKED时是下面32字节的u_fs_dirent，没有填充，按小端存，
+ * 一块多放四分之一的项；项里带着名字的散列值，扫目录时先比散列值，对上了才比名字。
+ * 内存里还是用u_fs_file_directory，读写目录块时用dirent_load()/dirent_store()转换
+ */
+struct u_fs_dirent { //32bytes, little-endian
+    uint32_t hash; //dir_hash(fname, fext)
+    uint8_t flag; //0:for unused; 1:for file; 2:for directory
+    char fname[MAX_FILENAME]; //filename, padded with nul
+    char fext[MAX_EXTENSION]; //extension, padded with nul
+    uint64_t fsize; //file size
+    int64_t start; //where the first block is on disk
+};
+
+/**
+ * 块链表
+ * 每个块在块链表中有一项，记录文件/目录的下一块和目录块用了多少字节，
+ * 链接信息不再放在块头里，块的全部BLOCK_SIZE字节都是数据，
+ * 文件偏移落在第几块、块内哪里只需要移位和掩码。
+ * 和位图一样，挂载时把整个块链表读进内存，沿链找下一块只是查一下数组，
+ * 改过的块链表块在flush/fsync时整块写回
+ */
+struct u_fs_chain { //16bytes
+    long next; //the next disk block, -1 for the end of the chain
+    long used; //how many bytes are being used in a directory block
+};
+
+struct u_fs_chaintab {
+    struct u_fs_chain *tab; //块链表在内存中的副本，和diskimg上的字节一样
+    char *dirty;            //每个块链表块一项，1：改过还没写回
+    long n_dirty;
+};
+
+static struct u_fs_chaintab chaintab;
+
+/**
+ * 目录散列索引
+ * 带U_FS_FEATURE_DIR_INDEX格式化的diskimg上，目录项超过一块的目录把第一块改成索引块（块链表中这一块的
+ * used记为DIR_INDEXED），索引块里是若干个桶，名字按dir_hash()落到一个桶里，每个桶和原来的目录一样是一串
+ * 目录块。查找、新建只看一个桶，项数超过桶数能装下的3/4时桶数翻倍重新分一遍。只有一块的小目录还是原来的格式
+ */
+#define DIR_INDEXED -1 //目录第一块的used为这个值时，这一块是索引块
+#define DIR_MAX_BUCKETS (BLOCK_SIZE / (2 * (long)sizeof(long))) //桶数的上限，2的幂
+struct u_fs_dir_index { //at the start of an index block
+    long n_bucket; //number of buckets, power of 2
+    long n_item;   //number of items in the directory
+    long bucket[]; //first block of each bucket's chain, -1 for an empty bucket
+};
+
+/**
+ * extent
+ * U_FS_VERSION_EXTENT格式下，文件目录项的nStartBlock指向一个extent索引块，
+ * 块头后面是按文件内块号排好序的extent，一个extent是一段连续的块，
+ * 索引块放不下时接下一个索引块。找文件的第i块只要在extent里二分查找，
+ * 不用沿着块链表一跳一跳地走，大文件也只有几段
+ */
+struct u_fs_extent { //24bytes
+    long lblk;  //first file block covered by this extent
+    long start; //first disk block
+    long len;   //number of blocks
+};
+
+struct u_fs_ext_head { //24bytes, at the start of an extent index block
+    long n_ext; //number of extents in this index block
+    long next;  //next index block, -1 for none
+    long reserved;
+};
+
+#define EXT_PER_BLOCK (BLOCK_SIZE / (long)sizeof(struct u_fs_extent) - 1) //一个索引块能放几个extent
+
+/**
+ * 一个文件的全部extent，读进内存里查找和修改
+ */
+struct u_fs_extmap {
+    struct u_fs_extent *ext;
+    long n;     //extent个数
+    long cap;   //ext数组的大小
+};
+
+/**
+ * 块设备层
+ * 挂载时打开一次diskimg并一直持有其文件描述符，卸载时关闭，
+ * 所有对diskimg的访问都通过pread/pwrite（多块时用preadv/pwritev）按位置读写，
+ * 不再每读写一个块就fopen/fseek/fclose一次。
+ * mmap模式下整个diskimg用MAP_SHARED映射进来，块直接在映射区里读写，
+ * 落盘靠msync，此时不再需要块缓存。
+ * O_DIRECT模式下diskimg绕过宿主机的页缓存，只由块缓存缓存一份。O_DIRECT要求
+ * 偏移、长度和内存地址都对齐，所以所有读写都按dio_align对齐成I/O单元，
+ * 经对齐缓冲池里的缓冲区中转，单元两头不满的部分先读出来再整单元写回
+ */
+#define DIO_MIN_ALIGN 4096       //I/O单元至少4KiB，块比它小时一个单元有几个块
+#define DIO_BUF_SIZE (128 << 10) //对齐缓冲池中每个缓冲区的大小
+#define DIO_POOL_BUFS 8          //对齐缓冲池中的缓冲区个数
+
+struct u_fs_blkdev {
+    int fd;          //diskimg的文件描述符，-1表示未打开
+    long blk_size;   //块大小，单位字节
+    long n_blocks;   //diskimg能容纳的总块数
+    char *map;       //mmap模式下diskimg的映射区，否则为NULL
+    pthread_mutex_t map_lock; //保护下面的脏区间
+    long map_dirty_lo, map_dirty_hi; //映射区中被写过、还没msync的块范围[lo, hi)
+    int direct;      //1：diskimg以O_DIRECT打开
+    long dio_align;  //O_DIRECT模式下的I/O单元大小，单位字节
+    long dio_unit;   //一个I/O单元包含的块数，非O_DIRECT模式为1
+    pthread_mutex_t dio_lock; //单元的读-改-写要串行，否则并发写同一单元的不同块会丢数据
+};
+
+static struct u_fs_blkdev blkdev = { -1, BLOCK_SIZE_MIN, 0, NULL, PTHREAD_MUTEX_INITIALIZER, 0, 0,
+                                     0, 0, 1, PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ * 对齐缓冲池：O_DIRECT模式下启动时一次申请好，用完还回来，缓冲区都用光了就等
+ */
+struct u_fs_dio_pool {
+    char *mem;               //所有缓冲区所在的一整块对齐内存
+    char *free[DIO_POOL_BUFS];
+    int n_free;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static struct u_fs_dio_pool dio_pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+/**
+ * 一次块I/O请求：从blk开始的连续若干块和iov描述的缓冲区之间的读或写。
+ * 一批请求交给blkdev_submit()，开启io_uring时整批一次提交、同时在飞，
+ * 否则逐个用preadv/pwritev同步完成
+ */
+struct u_fs_bio {
+    long blk;            //起始块号
+    struct iovec *iov;   //缓冲区，总长度为块大小的整数倍
+    int iovcnt;
+    int write;           //1：写; 0：读
+};
+
+#ifdef U_FS_IO_URING
+/**
+ * io_uring后端，直接用io_uring_setup/io_uring_enter系统调用，不依赖liburing。
+ * 所有FUSE线程共用一个环，提交和收割都在lock里进行
+ */
+#define URING_DEPTH 64 //最多同时在飞的请求数
+
+struct u_fs_uring {
+    int fd;                       //-1表示没有开启io_uring
+    pthread_mutex_t lock;
+    unsigned entries;             //SQ的长度
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+};
+
+static struct u_fs_uring uring = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+#endif
+
+/**
+ * 块缓存
+ * 位于read_disk_block()/write_disk_block()之下，所有元数据和数据块都先经过它。
+ * 淘汰采用ARC（Adaptive Replacement Cache）：T1放只访问过一次的块，T2放访问过
+ * 至少两次的块，B1/B2只记录从T1/T2淘汰出去的块号（幽灵项，不占数据空间）。
+ * 命中幽灵项时调整T1的目标长度p，因此ls -l这种一次性扫描只会在T1里打转，
+ * 不会把T2里反复读写的热数据挤出去。
+ * 写是write-back的：块只被标脏，等flush/fsync/卸载或者被淘汰时才写回diskimg
+ */
+#define CACHE_DEFAULT_SIZE (16L << 20) //默认缓存16MiB
+#define CACHE_MIN_BLOCKS 16             //同时被钉住的块不会超过这个数，缓存再小就转不动了
+
+enum { ARC_T1, ARC_T2, ARC_B1, ARC_B2, ARC_NLIST };
+
+struct u_fs_cbuf {
+    long blk;                       //缓存的块号
+    int list;                       //在ARC的哪个链表上
+    int dirty;                      //1：比diskimg上的新，需要写回
+    int pin;                        //被get_block()钉住的次数，大于0时不能淘汰
+    int wb;                         //1：cache_sync()正在不拿锁地写回它，不能淘汰
+    int prefetched;                 //1：预读进来的，还没被真正访问过
+    char *data;                     //块的内容，幽灵项为NULL
+    struct u_fs_cbuf *prev, *next;  //ARC链表，next方向从MRU到LRU
+    struct u_fs_cbuf *hnext;        //哈希链
+};
+
+struct u_fs_cache {
+    pthread_mutex_t lock;
+    long capacity;                     //最多缓存多少个块（ARC中的c），0表示不使用缓存
+    long p;                            //T1的目标长度
+    struct u_fs_cbuf list[ARC_NLIST];  //各链表的哨兵
+    long len[ARC_NLIST];               //各链表的长度
+    struct u_fs_cbuf **hash;           //块号到缓存项的哈希表
+    long hash_mask;
+    struct u_fs_cbuf *free_cbuf;       //空闲缓存项，用hnext串起来
+    char **free_data;                  //空闲的数据缓冲区
+    long n_free_data;
+    struct u_fs_cbuf *cbufs;           //缓存项和数据缓冲区都是在初始化时一次申请好的
+    char *slab;
+    long n_dirty;
+    long n_wb;                         //正在写回的块数
+    pthread_cond_t wb_cond;            //一次写回做完时广播，等着淘汰的cache_get()再试
+    pthread_mutex_t sync_lock;         //同一时间只有一个cache_sync()在写回
+    unsigned long hits, misses, ghost_hits, evictions, writebacks;
+};
+
+static struct u_fs_cache cache = { .lock = PTHREAD_MUTEX_INITIALIZER, .wb_cond = PTHREAD_COND_INITIALIZER,
+                                   .sync_lock = PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ * 顺序预读
+ * 文件的块是靠块链表串起来的，不一定连续，内核对diskimg的预读帮不上忙，
+ * u_fs_read()每走一跳都要等一次I/O。每个打开的文件记下上一次read结束的位置，
+ * 下一次read正好从这里接着读就算顺序访问，预读窗口翻倍（最大到ra.max_window），
+ * 随机访问时窗口减半。顺序读到离已预读位置不足半个窗口时，
+ * 把沿链再往后一个窗口的块交给后台预读线程读进块缓存
+ */
+#define RA_DEFAULT_SIZE (256L << 10) //默认预读窗口最大256KiB
+#define RA_MIN_WINDOW 4               //预读窗口最小4块
+#define RA_QUEUE 64                   //预读任务队列长度，满了就丢掉新任务
+
+/**
+ * 打开的文件，u_fs_open()申请，挂在fi->fh上，u_fs_release()释放。
+ * 打开时记下目录项在哪个目录的哪一块第几项，读写时直接读那一项，不再按路径一级一级地找；
+ * 目录里有增删时这一项可能被挪走，对不上再在所在目录里按名字找一次。
+ * bmap是文件内块号到diskimg块号的表，第一次读写时才建，写文件变长时接着往后补，
+ * 读写任意位置都直接查表，不用每次从nStartBlock开始重新走。空洞在表里记为-1。
+ * 有块被释放或者空洞被填上时bmap_gen加一，表里的块号可能过时了，下次用的时候重建。
+ * 块链表格式下表超过FH_MAP_MAX块就扔掉，从游标（上次读写到的文件第几块和它的块号）接着往后建，
+ * 顺序读写大文件时表只留最近的一段；extent格式不用游标，表本来就是从要读写的块开始建的
+ */
+#define FH_MAP_AHEAD 256 //读的时候块号表多往后建这么多块
+#define FH_MAP_MAX 8192  //块链表格式下块号表最多留多少块
+struct u_fs_fh {
+    pthread_mutex_t lock;
+    pthread_cond_t idle;  //这个文件的预读任务做完了
+    off_t ra_next_off;    //顺序读的话下一次read应该从这里开始
+    long ra_window;       //预读窗口，单位块
+    long ra_idx;          //预读已经排到了文件的第几块（不含）
+    long ra_blk;          //文件第ra_idx块的块号，-1表示链已经走到头
+    long start;           //目录项里的nStartBlock，extent格式下预读要用
+    long dir;             //所在目录的第一块，-1表示没有记下目录项（根目录本身）
+    long ent_blk;         //目录项在哪个目录块，-1表示还不知道
+    long ent_slot;        //是块里的第几项
+    char fname[MAX_FILENAME + 1];
+    char fext[MAX_EXTENSION + 1];
+    int ra_pending;       //1：有预读任务在排队或者正在做
+    long *bmap;           //bmap[i]是文件第bmap_base+i块的块号
+    long bmap_base;       //表从文件的第几块开始
+    long n_bmap;          //表里已经有多少块
+    long cap_bmap;        //bmap数组的大小
+    unsigned long bmap_gen; //建表时的bmap_gen
+    long cur_idx;         //游标：上次读写从文件的第几块开始，-1表示没有
+    long cur_blk;         //文件第cur_idx块的块号
+    unsigned long cur_gen; //记下游标时的bmap_gen
+    char *path;           //打开时的路径，提交延迟写的数据时要用
+    char *dbuf;           //延迟分配：攒着还没写下去的数据
+    off_t d_off;          //dbuf[0]在文件里的位置
+    size_t d_len;         //dbuf里有多少字节，0表示没有
+    size_t d_cap;         //dbuf的大小
+    time_t d_time;        //什么时候开始攒的
+    struct u_fs_fh *d_next; //dalloc.head链表
+};
+
+static unsigned long bmap_gen; //每释放一次块加一，用BMAP_GEN()读、BMAP_GEN_BUMP()加，不用拿锁
+#define BMAP_GEN() __atomic_load_n(&bmap_gen, __ATOMIC_ACQUIRE)
+#define BMAP_GEN_BUMP() __atomic_add_fetch(&bmap_gen, 1, __ATOMIC_RELEASE)
+
+/**
+ * 块链表格式下记住每个文件走到过的最后一块（一般就是链尾），按nStartBlock散列。
+ * 新打开的文件往末尾追加时直接从这里接着走，不用从第一块走到文件尾。
+ * 记下的块只会因为释放块而失效，所以同样用bmap_gen判断
+ */
+#define TAIL_HINTS 256
+struct u_fs_tail {
+    long start;           //文件的nStartBlock，0表示没用
+    long idx;             //文件的第几块
+    long blk;             //第idx块的块号
+    unsigned long gen;    //记下时的bmap_gen
+};
+
+static struct u_fs_tail tails[TAIL_HINTS];
+
+/**
+ * 延迟分配
+ * 打开的文件往文件尾追加的数据先攒在fh->dbuf里，既不分配块也不写diskimg，
+ * 到flush/fsync/release、攒够dalloc.max字节、所有文件攒的加起来超过dalloc.max
+ * （先提交最早的）或者攒了超过DALLOC_TIMEOUT秒时才提交：按最后的大小一次分配好连续的块再写下去。
+ * 没提交的数据算在文件大小里，别的路径读写、删除这个文件前先提交或丢掉
+ */
+#define DALLOC_DEFAULT_SIZE (1L << 20) //默认最多攒1MiB
+#define DALLOC_TIMEOUT 5               //攒了5秒还没提交的，后台线程提交
+
+static struct u_fs_dalloc {
+    pthread_mutex_t lock; //保护链表、total和链表上每个fh的d_off、d_len
+    long max;             //最多攒多少字节，0表示不延迟分配
+    long total;           //现在一共攒了多少字节
+    struct u_fs_fh *head; //有数据没提交的fh，先开始攒的在前面
+    pthread_t thread;     //每秒醒一次，提交攒了超过DALLOC_TIMEOUT秒的
+    int running;
+    int stop;
+    pthread_cond_t cond;
+} dalloc = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+/**
+ * 目录项缓存
+ * 按（所在目录的第一块，文件名，后缀名）散列，记下这一项在哪个目录块的第几项，目录里没有的名字也记下（负项），
+ * 同一个目录下的文件不用每次都从目录的第一块扫起。只记位置不记属性，命中后读那一项，
+ * 所以write_stat_from_block()改了文件大小也不会过时。目录项只在mkdir/mknod新建、
+ * rm_item()删除和回填时会动，这几处同时改缓存；readdir扫过的项也顺手记下
+ */
+#define DCACHE_BUCKETS 4096 //散列桶个数，2的幂
+#define DCACHE_MAX 65536    //最多记这么多项，满了整个清空
+
+struct u_fs_dentry {
+    struct u_fs_dentry *next;     //同一个桶里的下一项
+    long dir;                     //所在目录的第一块
+    char fname[MAX_FILENAME + 1];
+    char fext[MAX_EXTENSION + 1];
+    long blk;                     //这一项在哪个目录块，-1表示目录里没有这个名字
+    long slot;                    //是块里的第几项
+};
+
+static struct u_fs_dcache {
+    pthread_mutex_t lock;         //只保护散列表本身，项的内容由所在目录的锁保证
+    struct u_fs_dentry *bucket[DCACHE_BUCKETS];
+    long n;                       //现在记了几项
+    unsigned long hits;
+    unsigned long misses;
+} dcache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ * 并发
+ * libfuse默认多线程分发请求，锁分四层，拿的时候只能从上往下：
+ * 1. 文件/目录锁：每个文件、目录一把读写锁，按nStartBlock在olocks里找，用的时候才建，没人用了就删掉。
+ *    读文件、在目录里查找拿读锁，写文件、改目录项拿写锁。要同时拿两把时先拿文件（或子目录）的，
+ *    再拿它所在目录的，根目录最后；按路径查找时每一级的读锁查完就放，不会拿着不放。
+ *    删文件/目录要拿着它自己的写锁，所以拿到一个文件的锁以后再查一次，还在就不会被删掉
+ * 2. fh->lock：同一个fh上并发的读共用块号表，查表和拷数据时拿着
+ * 3. alloc_lock：位图、块链表的脏标记和tails，分配、释放块都在里面做
+ * 4. 叶子锁：块缓存、目录项缓存、延迟分配、inode表、预读队列各一把，拿着它们时不再拿别的锁
+ * 块链表项不加锁：一个文件/目录的链只有拿着它写锁的线程会改，读的时候拿着读锁就够了。
+ * 不同文件的读只在块缓存的锁上碰一下，可以并行
+ */
+#define OLOCK_BUCKETS 256 //散列桶个数，2的幂
+
+struct u_fs_olock {
+    struct u_fs_olock *next;      //同一个桶里的下一项
+    long start;                   //文件/目录的nStartBlock
+    long refs;                    //拿着或者在等这把锁的线程数
+    pthread_rwlock_t rw;
+};
+
+static struct u_fs_olocks {
+    pthread_mutex_t lock;
+    struct u_fs_olock *bucket[OLOCK_BUCKETS];
+} olocks = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+#define OLOCK_READ 0  //读锁，文件有攒着没写下去的数据时换成OLOCK_SYNC
+#define OLOCK_WRITE 1 //写锁
+#define OLOCK_SYNC 2  //写锁，并且先提交攒着的数据
+
+//分配块要先看线段树再置位，chain_grow()、ext_fill()里套着调bitmap_*()，所以是可重入锁
+static pthread_mutex_t alloc_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+/**
+ * 低层接口（--lowlevel）的inode表
+ * inode号直接用文件/目录的nStartBlock，文件存在期间不会变，根目录固定是FUSE_ROOT_ID。
+ * lookup时记下这个inode在哪个目录、叫什么名字，内核每记住一次nlookup加一，forget减到0时删掉。
+ * getattr拿（目录，名字）去目录项缓存里找那一项，不用解析路径。
+ * 文件删掉以后它的块可能分给新文件，inode号就重复了，所以删除时gen加一，内核会当成另一个inode
+ */
+#define ITAB_BUCKETS 4096 //散列桶个数，2的幂
+#define ITAB_PATH (2 * MAX_FILENAME + MAX_EXTENSION + 4) //"/dirname/fname.ext"
+#define LL_TIMEOUT 1.0    //内核缓存属性和目录项的秒数
+
+struct u_fs_inode {
+    struct u_fs_inode *next;      //同一个桶里的下一项
+    fuse_ino_t ino;               //就是nStartBlock
+    long dir;                     //所在目录的第一块
+    char fname[MAX_FILENAME + 1];
+    char fext[MAX_EXTENSION + 1];
+    char path[ITAB_PATH];         //交给路径接口的函数时用
+    uint64_t nlookup;             //内核记住了几次
+    uint64_t gen;                 //回复给内核的generation
+};
+
+static struct u_fs_itab {
+    pthread_mutex_t lock;
+    struct u_fs_inode *bucket[ITAB_BUCKETS];
+    long n;                       //现在记了几项
+} itab = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ * 低层接口的opendir把整个目录按fuse_add_direntry()的格式排好挂在fi->fh上，
+ * readdir按偏移从里面截一段，releasedir释放
+ */
+struct u_fs_dirbuf {
+    fuse_req_t req;
+    fuse_ino_t ino;  //目录的inode号
+    char *p;
+    size_t size;
+};
+
+struct u_fs_ra_job {
+    struct u_fs_fh *fh;
+    long start;           //文件的nStartBlock
+    long blk;             //从这个块开始沿链预读
+    long idx;             //blk是文件的第几块
+    long cnt;             //预读多少块
+};
+
+struct u_fs_ra {
+    pthread_t thread;
+    int running;          //1：后台预读线程在跑
+    int stop;
+    long max_window;      //预读窗口的上限，单位块，0表示不预读
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct u_fs_ra_job jobs[RA_QUEUE];
+    int head, n;
+    unsigned long issued, dropped; //排进队列的任务数、队列满被丢掉的任务数
+};
+
+static struct u_fs_ra ra = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+/**
+ * 空闲块位图
+ * 挂载时把整个位图读进内存，分配/释放只改内存里的副本，
+ * 改过的位图块记下来，flush/fsync时整块写回。
+ * 位图是按字节从高位到低位排的，按大端读成64位的字以后，
+ * 第i块就是字里从最高位数起的第i%64位，找空闲块用clz一次看64位，
+ * CPU支持AVX2时一次跳过256位全满（或全空）的位图。
+ * 位图每BITMAP_GROUP位分成一组，组上面建一棵线段树，每个结点记下
+ * 这一段开头、结尾的空闲块数和最长的连续空闲块数，挂载时建好，
+ * 改位图时只重算那一组和它到根的结点。找n块连续空闲块时从根往下走，
+ * 直接落到第一段够长的空闲块所在的地方，不用从头扫位图
+ */
+#define BITMAP_GROUP 4096 //每组的位数，正好是512字节的位图
+
+struct u_fs_bnode {
+    long len;           //这一段有多少块
+    long head;          //开头连续的空闲块数
+    long tail;          //结尾连续的空闲块数
+    long max;           //最长的连续空闲块数
+};
+
+struct u_fs_bitmap {
+    BYTE *map;          //位图在内存中的副本，和diskimg上的字节一样
+    char *dirty;        //每个位图块一项，1：改过还没写回
+    long n_dirty;
+    long n_free;        //空闲的数据块总数
+    int avx2;           //1：CPU支持AVX2
+    struct u_fs_bnode *tree; //线段树，tree[1]是根，第g组是tree[n_leaf + g]
+    long n_leaf;        //叶子数，组数向上取到2的幂
 };
 
+static struct u_fs_bitmap bitmap;
+
 static void *u_fs_init(struct fuse_conn_info *conn, struct fuse_config *cfg);
 static int u_fs_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi);
 static int u_fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
@@ -81,13 +573,57 @@ static int u_fs_read(const char *path, char *buf, size_t size, off_t offset,
 		    struct fuse_file_info *fi);
 static int u_fs_write(const char *path, const char *buf, size_t size,
 		     off_t offset, struct fuse_file_info *fi);
+static int u_fs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi);
 static int u_fs_unlink(const char *path);
 static int u_fs_open(const char *path, struct fuse_file_info *fi);
+static int u_fs_release(const char *path, struct fuse_file_info *fi);
 static int u_fs_truncate(const char *path, off_t size, struct fuse_file_info *fi);
 static int u_fs_flush(const char *path, struct fuse_file_info *fi);
+static int u_fs_fsync(const char *path, int datasync, struct fuse_file_info *fi);
+static int u_fs_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi);
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 8)
+static off_t u_fs_lseek(const char *path, off_t off, int whence, struct fuse_file_info *fi);
+#endif
+static int u_fs_getxattr(const char *path, const char *name, char *value, size_t size);
+static int u_fs_listxattr(const char *path, char *list, size_t size);
+static void u_fs_destroy(void *private_data);
+
+static void u_fs_ll_init(void *userdata, struct fuse_conn_info *conn);
+static void u_fs_ll_destroy(void *userdata);
+static void u_fs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name);
+static void u_fs_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup);
+static void u_fs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+static void u_fs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+            int to_set, struct fuse_file_info *fi);
+static void u_fs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev);
+static void u_fs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode);
+static void u_fs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name);
+static void u_fs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name);
+static void u_fs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+static void u_fs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+            struct fuse_file_info *fi);
+static void u_fs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+            off_t off, struct fuse_file_info *fi);
+static void u_fs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+            off_t off, struct fuse_file_info *fi);
+static void u_fs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+static void u_fs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+static void u_fs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi);
+static void u_fs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+static void u_fs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+            struct fuse_file_info *fi);
+static void u_fs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+static void u_fs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset,
+            off_t length, struct fuse_file_info *fi);
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 8)
+static void u_fs_ll_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence, struct fuse_file_info *fi);
+#endif
+static void u_fs_ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size);
+static void u_fs_ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size);
 
 static struct fuse_operations u_fs_oper = {
 	.init = u_fs_init,
+	.destroy = u_fs_destroy,
 	.getattr = u_fs_getattr,
 	.readdir = u_fs_readdir,
 	.mkdir = u_fs_mkdir,
@@ -95,18 +631,483 @@ static struct fuse_operations u_fs_oper = {
 	.mknod = u_fs_mknod,
 	.read = u_fs_read,
 	.write = u_fs_write,
+    .write_buf = u_fs_write_buf,
 	.unlink = u_fs_unlink,
     .truncate = u_fs_truncate,
     .open = u_fs_open,
-    .flush = u_fs_flush
+    .release = u_fs_release,
+    .flush = u_fs_flush,
+    .fsync = u_fs_fsync,
+    .fallocate = u_fs_fallocate,
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 8)
+    .lseek = u_fs_lseek,
+#endif
+    .getxattr = u_fs_getxattr,
+    .listxattr = u_fs_listxattr
+};
+
+/**
+ * 低层接口，挂载时加--lowlevel才用。内核拿inode号来请求，
+ * lookup、getattr直接查目录项，别的操作把inode号换成路径交给上面的函数
+ */
+static struct fuse_lowlevel_ops u_fs_ll_oper = {
+    .init = u_fs_ll_init,
+    .destroy = u_fs_ll_destroy,
+    .lookup = u_fs_ll_lookup,
+    .forget = u_fs_ll_forget,
+    .getattr = u_fs_ll_getattr,
+    .setattr = u_fs_ll_setattr,
+    .mknod = u_fs_ll_mknod,
+    .mkdir = u_fs_ll_mkdir,
+    .unlink = u_fs_ll_unlink,
+    .rmdir = u_fs_ll_rmdir,
+    .open = u_fs_ll_open,
+    .read = u_fs_ll_read,
+    .write = u_fs_ll_write,
+    .write_buf = u_fs_ll_write_buf,
+    .flush = u_fs_ll_flush,
+    .release = u_fs_ll_release,
+    .fsync = u_fs_ll_fsync,
+    .opendir = u_fs_ll_opendir,
+    .readdir = u_fs_ll_readdir,
+    .releasedir = u_fs_ll_releasedir,
+    .fallocate = u_fs_ll_fallocate,
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 8)
+    .lseek = u_fs_ll_lseek,
+#endif
+    .getxattr = u_fs_ll_getxattr,
+    .listxattr = u_fs_ll_listxattr
+};
+
+/**
+ * 命令行选项，写法同libfuse的example/hello.c
+ */
+static struct options {
+    const char *cache_size; //块缓存的内存预算，可带K/M/G后缀，0表示不使用缓存
+    const char *readahead;  //顺序预读窗口的上限，可带K/M/G后缀，0表示不预读
+    const char *delalloc;   //延迟分配最多攒多少数据，可带K/M/G后缀，0表示关闭
+    int mmap;               //1：把diskimg整个mmap进来直接读写，不使用块缓存
+    int io_uring;           //1：块缓存的批量读写走io_uring（编译时要带U_FS_IO_URING）
+    int direct;             //1：以O_DIRECT打开diskimg，不经过宿主机的页缓存
+    int lowlevel;           //1：用libfuse的低层接口，内核按inode号而不是路径请求
+    int show_help;
+} options;
+
+#define OPTION(t, p) \
+    { t, offsetof(struct options, p), 1 }
+static const struct fuse_opt option_spec[] = {
+    OPTION("--cache-size=%s", cache_size),
+    OPTION("--readahead=%s", readahead),
+    OPTION("--delalloc=%s", delalloc),
+    OPTION("--mmap", mmap),
+    OPTION("--io-uring", io_uring),
+    OPTION("--direct", direct),
+    OPTION("--lowlevel", lowlevel),
+    OPTION("-h", show_help),
+    OPTION("--help", show_help),
+    FUSE_OPT_END
 };
 
+#define XATTR_CACHE_STAT "user.u_fs.cache" //在根目录上用getfattr读这个属性可以看到块缓存的计数
+
+/** blkdev_open()
+ * 功能：打开diskimg，初始化块设备层，整个挂载期间只调用一次
+ * 参数：path：diskimg的路径; blk_size：块大小;
+ *      direct：1 尝试以O_DIRECT打开，不行就退回普通打开
+ * 返回：-1 失败; 0 成功
+ */
+static int blkdev_open(const char *path, const long blk_size, const int direct);
+
+/** blkdev_open_direct()
+ * 功能：定下I/O单元大小，申请对齐缓冲池，再以O_DIRECT重新打开diskimg
+ * 参数：path：diskimg的路径; size：diskimg的字节数
+ * 返回：-1 失败（仍用原来的描述符）; 0 成功
+ */
+static int blkdev_open_direct(const char *path, const off_t size);
+
+/** blkdev_mmap()
+ * 功能：把整个diskimg映射进地址空间，之后的块访问都直接走映射区
+ * 返回：-1 失败（仍可用pread/pwrite）; 0 成功
+ */
+static int blkdev_mmap(void);
+
+/** blkdev_msync()
+ * 功能：mmap模式下把映射区里写过的范围msync到diskimg，其它模式什么都不做
+ * 返回：-1 失败; 0 成功
+ */
+static int blkdev_msync(void);
+
+/** blkdev_close()
+ * 功能：把diskimg落盘并关闭文件描述符
+ * 返回：NULL
+ */
+static void blkdev_close(void);
+
+/** blkdev_read() / blkdev_write()
+ * 功能：从n_blk开始连续读/写n_cnt个块，buf大小至少为n_cnt个块
+ * 参数：n_blk：起始块号; n_cnt：块数; buf：数据缓冲区
+ * 返回：-1 失败; 0 成功
+ */
+static int blkdev_read(const long n_blk, const long n_cnt, void *buf);
+static int blkdev_write(const long n_blk, const long n_cnt, const void *buf);
+
+/** blkdev_readv() / blkdev_writev()
+ * 功能：从n_blk开始的一段连续块与iov描述的多个缓冲区之间做一次向量读/写
+ * 参数：n_blk：起始块号; iov：缓冲区数组（总长度应为块大小的整数倍）; iovcnt：数组长度
+ * 返回：-1 失败; 0 成功
+ */
+static int blkdev_readv(const long n_blk, const struct iovec *iov, int iovcnt);
+static int blkdev_writev(const long n_blk, const struct iovec *iov, int iovcnt);
+
+/** blkdev_dio_rw()
+ * 功能：O_DIRECT模式下从字节偏移pos开始与iov之间读/写，范围被扩成对齐的I/O单元，
+ *      经对齐缓冲区中转
+ * 参数：is_write：1写 0读
+ * 返回：-1 失败; 0 成功
+ */
+static int blkdev_dio_rw(const off_t pos, const struct iovec *iov, int iovcnt, const int is_write);
+
+/** blkdev_read_bytes() / blkdev_write_bytes()
+ * 功能：按字节偏移读/写diskimg，只给位图这种不足一个块的访问使用
+ * 参数：pos：在diskimg中的字节偏移; buf：缓冲区; len：长度
+ * 返回：-1 失败; 0 成功
+ */
+static int blkdev_read_bytes(const off_t pos, void *buf, const size_t len);
+static int blkdev_write_bytes(const off_t pos, const void *buf, const size_t len);
+
+/** blkdev_submit()
+ * 功能：执行一批块I/O请求，全部完成后才返回
+ * 参数：bios：请求数组; n：请求个数
+ * 返回：-1 有请求失败; 0 全部成功
+ */
+static int blkdev_submit(struct u_fs_bio *bios, const int n);
+
+/** uring_init() / uring_exit()
+ * 功能：建立/拆除io_uring；内核不支持或编译时没打开时uring_init()失败，
+ *      blkdev_submit()会退回同步的preadv/pwritev
+ * 返回：uring_init -1 失败; 0 成功
+ */
+static int uring_init(void);
+static void uring_exit(void);
+
+/** blkdev_sync()
+ * 功能：把已写入diskimg的数据刷到磁盘
+ * 返回：-1 失败; 0 成功
+ */
+static int blkdev_sync(void);
+
+/** cache_init()
+ * 功能：按内存预算初始化块缓存，必须在blkdev_open()之后调用
+ * 参数：budget：给缓存块数据用的内存字节数，0表示不使用缓存
+ * 返回：-1 失败; 0 成功
+ */
+static int cache_init(const long budget);
+
+/** cache_destroy()
+ * 功能：写回所有脏块并释放块缓存
+ * 返回：NULL
+ */
+static void cache_destroy(void);
+
+/** cache_read_block() / cache_write_block()
+ * 功能：经过缓存读/写一整个块，写只是把缓存中的块标脏
+ * 参数：n_blk：块号; buf：一个块大小的缓冲区
+ * 返回：-1 失败; 0 成功
+ */
+static int cache_read_block(const long n_blk, void *buf);
+static int cache_write_block(const long n_blk, const void *buf);
+
+/** cache_sync()
+ * 功能：把缓存中所有脏块按块号顺序写回diskimg，相邻的块合并成一次pwritev。
+ *      做I/O时不拿着cache.lock，别的线程照样能访问缓存
+ * 返回：-1 失败; 0 成功
+ */
+static int cache_sync(void);
+
+/** cache_prefetch_blocks()
+ * 功能：把blks中列出的n_cnt个块里还不在缓存里的读进缓存，一般是沿块链表收集到的一段链，
+ *      块号相邻的合并成一个向量请求，整批请求一次提交
+ * 参数：blks：块号数组; n_cnt：块数
+ * 返回：-1 失败; 0 成功
+ */
+static int cache_prefetch_blocks(const long *blks, long n_cnt);
+
+/** cache_fill_unit()
+ * 功能：O_DIRECT模式下n_blk不在缓存里时，反正要读它所在的整个I/O单元，
+ *      就把单元里其它不在缓存里的块一起读进来。调用者需持有cache.lock
+ * 参数：n_blk：马上要访问的块号
+ * 返回：NULL
+ */
+static void cache_fill_unit(const long n_blk);
+
+/** cache_pin() / cache_unpin()
+ * 功能：把一个块钉在缓存里并返回其缓冲区，调用者可以直接读写，
+ *      用完必须cache_unpin()，被钉住的块不会被淘汰
+ * 参数：n_blk：块号; fill：1 未命中时从diskimg读入; 0 调用者会覆盖整块
+ * 参数：dirty：1 调用者修改了这个块
+ * 返回：cache_pin NULL失败，否则为块缓冲区; cache_unpin -1 失败，0 成功
+ */
+static char *cache_pin(const long n_blk, const int fill);
+static int cache_unpin(const long n_blk, const int dirty);
+
+/** cache_resident()
+ * 功能：看一个块现在是不是在缓存里（不算幽灵项），不改变它在ARC里的位置
+ * 参数：n_blk：块号
+ * 返回：1 在缓存里; 0 不在
+ */
+static int cache_resident(const long n_blk);
+
+/** cache_stat()
+ * 功能：把缓存的命中/未命中/淘汰等计数格式化成一行文本
+ * 参数：buf：输出缓冲区; size：缓冲区大小
+ * 返回：格式化后的长度（不含结尾的\0）
+ */
+static int cache_stat(char *buf, const size_t size);
+
+/** ra_init() / ra_exit()
+ * 功能：启动/停止后台预读线程，ra_init()须在cache_init()之后调用
+ * 参数：max_bytes：预读窗口的上限，单位字节
+ * 返回：ra_init -1 失败; 0 成功（包括不需要预读的情况）
+ */
+static int ra_init(const long max_bytes);
+static void ra_exit(void);
+
+/** ra_update()
+ * 功能：一次read完成后更新打开文件的预读状态，需要时排一个预读任务
+ * 参数：fh：打开的文件; offset, size：这次read的范围;
+ *      next_blk：这次读到的最后一块的下一块，-1表示已经到链尾
+ * 返回：NULL
+ */
+static void ra_update(struct u_fs_fh *fh, const off_t offset, const size_t size, const long next_blk);
+
+/** get_block() / put_block()
+ * 功能：取得n_blk块内容的指针，不再另外malloc一个块再把内容拷过来：
+ *      mmap模式下直接指向映射区，开启缓存时是钉在缓存里的缓冲区；
+ *      用完必须put_block()，修改过的块dirty传1
+ * 参数：n_blk：块号; fill：1 需要块原来的内容; 0 调用者会覆盖整块
+ * 返回：get_block NULL失败，否则为块指针; put_block -1 失败，0 成功
+ */
+static char *get_block(const long n_blk, const int fill);
+static int put_block(const long n_blk, char *disk_blk, const int dirty);
+
+/** load_superblock()
+ * 功能：读出diskimg的超级块，检查格式版本，初始化NUM_TOTAL_BLOCK、BLOCK_SIZE等全局量
+ * 参数：path：diskimg的路径
+ * 返回：-1 失败（打不开，或不是本版本格式化的diskimg）; 0 成功
+ */
+static int load_superblock(const char *path);
+
+/** chain_get() / chain_set()
+ * 功能：读/写n_blk块在块链表中的那一项
+ * 参数：n_blk：块号; ch：链表项
+ * 返回：-1 失败; 0 成功
+ */
+static int chain_get(const long n_blk, struct u_fs_chain *ch);
+static int chain_set(const long n_blk, const struct u_fs_chain *ch);
+
+/** chain_next()
+ * 功能：取n_blk在链上的下一块
+ * 参数：n_blk：块号
+ * 返回：-1 链尾或者出错; 否则为下一块的块号
+ */
+static long chain_next(const long n_blk);
+
+/** chain_load() / chain_sync() / chain_destroy()
+ * 功能：挂载时把块链表整个读进内存 / 把改过的块链表块写回块缓存 / 写回后释放
+ * 返回：chain_load、chain_sync -1 失败; 0 成功
+ */
+static int chain_load(void);
+static int chain_sync(void);
+static void chain_destroy(void);
+
+/** ext_load() / ext_store()
+ * 功能：把文件的全部extent从索引块读进内存 / 写回索引块（不够时会分配新的索引块）
+ * 参数：idx_blk：文件的第一个索引块; m：内存中的extent，用完ext_release()
+ * 返回：-1 失败; 0 成功
+ */
+static int ext_load(const long idx_blk, struct u_fs_extmap *m);
+static int ext_store(const long idx_blk, const struct u_fs_extmap *m);
+static void ext_release(struct u_fs_extmap *m);
+
+/** ext_lookup()
+ * 功能：二分查找文件的第lblk块落在哪个extent里
+ * 参数：m：文件的extent; lblk：文件内的块号
+ * 返回：-1 没有; 否则为extent的下标
+ */
+static long ext_lookup(const struct u_fs_extmap *m, const long lblk);
+
+/** ext_after()
+ * 功能：二分查找第一个从lblk后面开始的extent，lblk在空洞里时就是空洞后面的那一段
+ * 参数：m：文件的extent; lblk：文件内的块号
+ * 返回：extent的下标，没有时为m->n
+ */
+static long ext_after(const struct u_fs_extmap *m, const long lblk);
+
+/** ext_fill()
+ * 功能：给文件第lblk块到第lend块（不含）里还没有块的地方（空洞和文件尾后面）分配块。
+ *      先试着紧接在前一个extent后面原地接，接不上再找一段尽量长的连续空闲块作为新extent
+ * 参数：m：文件的extent; lblk：从文件的第几块开始; lend：到文件的第几块
+ * 返回：-1 空间不够（已经分配到的会留在m里）; 否则为新分配了多少块
+ *      ext_fill()拿着alloc_lock调ext_fill_locked()
+ */
+static long ext_fill(struct u_fs_extmap *m, const long lblk, const long lend);
+static long ext_fill_locked(struct u_fs_extmap *m, const long lblk, const long lend);
+
+/** ext_free()
+ * 功能：释放文件的全部数据块和索引块
+ * 参数：idx_blk：文件的第一个索引块
+ * 返回：-1 失败; 0 成功
+ */
+static int ext_free(const long idx_blk);
+
+/** file_map()
+ * 功能：把文件的第idx块起的n_cnt块换算成diskimg上的块号，两种格式都走这里
+ * 参数：start：目录项里的nStartBlock; idx：从文件的第几块开始; n_cnt：块数;
+ *      blks：换算出来的块号存在这里; alloc：1 文件不够长时分配新块（写的时候用）
+ * 返回：-1 出错; 否则为换算出来的块数，文件没有那么长（或者空间不够）时比n_cnt少
+ */
+static long file_map(const long start, const long idx, const long n_cnt, long *blks, const int alloc);
+
+/** fh_init() / fh_destroy()
+ * 功能：初始化/释放打开文件的状态
+ * 参数：fh：打开的文件; start：目录项里的nStartBlock
+ * 返回：NULL
+ */
+static void fh_init(struct u_fs_fh *fh, const long start);
+static void fh_destroy(struct u_fs_fh *fh);
+
+/** fh_map()
+ * 功能：查打开文件第idx块到第end块（不含）的块号，表不够时补到end块，文件没那么长时补到文件尾。
+ *      块链表格式下表可以从记下的链尾开始建，前面的块不在表里
+ * 参数：fh：打开的文件; idx：从文件的第几块开始; end：需要表补到文件的第几块;
+ *      alloc：1 文件不够长时分配新块（写的时候用）; blks：返回第idx块在表里的位置
+ * 返回：-1 出错; 否则为从第idx块开始表里有几块，可能比end-idx多，也可能比它少（<=0时blks为NULL）
+ */
+static long fh_map(struct u_fs_fh *fh, const long idx, const long end, const int alloc, long **blks);
+
+/** file_write_blocks()
+ * 功能：不经过块缓存时把一次写的数据写进文件的n_cnt个块，块号连续的一段用一次blkdev_writev()写下去。
+ *      整块覆盖的块直接用buf里的数据，头尾不满一块的经临时块中转（原有的块先读出来，新块其余部分补0）
+ * 参数：blks：块号; n_cnt：块数; old_head/old_tail：第一块/最后一块是不是文件原有的块;
+ *      offset：在第一块内的偏移; buf：要写的数据; size：数据长度
+ * 返回：-1 失败; 否则为写了多少字节
+ */
+static long file_write_blocks(const long *blks, const long n_cnt, const int old_head, const int old_tail,
+                              off_t offset, const char *buf, const size_t size);
+
+/** file_zero()
+ * 功能：把文件from到to（不含）的字节清零，写到文件尾后面或者fallocate把文件变长时用。
+ *      版本3没有块的地方是空洞，本来就读成0；版本2没有空洞，块不够时分配
+ * 参数：fh：打开的文件; from/to：文件内的字节位置
+ * 返回：-1 失败; 0 成功
+ */
+static int file_zero(struct u_fs_fh *fh, const off_t from, const off_t to);
+
+/** file_free_from()
+ * 功能：释放文件第lblk块和后面所有的块（包括fallocate在文件尾后面预先分配的），
+ *      位图按连续的一段一次清掉。版本2的第一块是nStartBlock，至少留一块
+ * 参数：start：目录项里的nStartBlock; lblk：从文件的第几块开始释放
+ * 返回：-1 失败; 0 成功
+ */
+static int file_free_from(const long start, const long lblk);
+
+/** file_bufvec() / bufvec_free()
+ * 功能：把文件[offset, offset + size)换算成diskimg上的几段，diskimg上连续的块合成一段，
+ *      每段是(diskimg的fd, 位置)，libfuse可以直接从diskimg splice到/dev/fuse，不经过用户态;
+ *      空洞是一段全0的内存，在块缓存里的块（可能是脏的）从缓存拷进内存，不写回
+ * 参数：path：文件路径; fi：打开的文件，可以为NULL; size/offset：同u_fs_read();
+ *      bufp：换算出来的几段，用完bufvec_free(); start：拿着读锁的文件
+ * 返回：负数为错误码，这时没有拿着锁; 0 成功，拿着文件的读锁返回，用完obj_unlock(*start)
+ */
+static int file_bufvec(const char *path, struct fuse_file_info *fi, size_t size, off_t offset,
+            struct fuse_bufvec **bufp, long *start);
+static void bufvec_free(struct fuse_bufvec *v);
+
+/** write_file()
+ * 功能：u_fs_write()不经过延迟分配的部分，把数据写进文件的块，文件变长时改目录项里的大小
+ * 参数：path：文件路径; buf：要写的数据; size：数据长度; offset：写到文件的哪里;
+ *      fh：打开的文件，NULL表示没有经过u_fs_open()
+ * 返回：负数为错误码; 否则为写了多少字节
+ */
+static int write_file(const char *path, const char *buf, size_t size, off_t offset, struct u_fs_fh *fh);
+
+/** dalloc_write()
+ * 功能：试着把一次写攒进fh->dbuf，只接受紧接着dbuf或者从文件尾开始的写
+ * 参数：fh：打开的文件; path：文件路径; buf/size/offset：同u_fs_write()
+ * 返回：负数为错误码; 0 没有攒，要直接写; 否则为攒下的字节数
+ *      调用的时候要拿着文件的写锁，下面提交数据的几个函数也一样
+ */
+static int dalloc_write(struct u_fs_fh *fh, const char *path, const char *buf, size_t size, off_t offset);
+
+/** dalloc_commit_fh()
+ * 功能：把fh攒着的数据写下去，块在这时才分配
+ * 参数：fh：打开的文件
+ * 返回：-1 失败，数据还留在fh里，下次flush/fsync再试; 0 成功
+ */
+static int dalloc_commit_fh(struct u_fs_fh *fh);
+
+/** dalloc_commit()
+ * 功能：提交nStartBlock为start的文件所有没提交的数据
+ * 参数：start：文件的nStartBlock
+ * 返回：-1 失败; 0 没有要提交的; 1 提交了，文件大小变了
+ */
+static int dalloc_commit(const long start);
+
+/** dalloc_commit_try()
+ * 功能：试着拿文件的写锁提交它的数据，锁被别人拿着就算了，不等
+ * 参数：start：文件的nStartBlock; held：自己已经拿着写锁的文件，没有为-1
+ * 返回：-1 失败; 0 文件忙; 1 提交了（或者已经没有要提交的了）
+ */
+static int dalloc_commit_try(const long start, const long held);
+
+/** fh_commit()
+ * 功能：拿着文件的写锁调dalloc_commit_fh()，flush、fsync、release用
+ * 参数：fh：打开的文件
+ * 返回：-1 失败; 0 成功
+ */
+static int fh_commit(struct u_fs_fh *fh);
+
+/** dalloc_commit_all()
+ * 功能：提交所有文件没提交的数据; expired为1时只提交攒了超过DALLOC_TIMEOUT秒的
+ *      正被别的线程读写的文件跳过，不拿着任何文件的锁调用
+ * 返回：-1 失败; 0 成功
+ */
+static int dalloc_commit_all(const int expired);
+
+/** dalloc_drop()
+ * 功能：文件被删除时丢掉它没提交的数据
+ * 参数：start：文件的nStartBlock
+ */
+static void dalloc_drop(const long start);
+
+/** dalloc_end()
+ * 功能：算上没提交的数据，文件至少有多长
+ * 参数：start：文件的nStartBlock
+ * 返回：没有没提交的数据时为0
+ */
+static off_t dalloc_end(const long start);
+
+/** dalloc_init() / dalloc_exit()
+ * 功能：启动/停止定时提交的后台线程，dalloc.max为0时不启动
+ * 返回：dalloc_init -1 失败; 0 成功
+ */
+static int dalloc_init(void);
+static void dalloc_exit(void);
+
+/** chain_grow()
+ * 功能：在链尾tail后面一次接上num个新块。先试着紧接在tail后面分配，
+ *      接不上再找一段尽量长的连续空闲块，新块在块链表里一次串好
+ * 参数：tail：链尾的块号; num：要接几块; blks：返回新块的块号
+ * 返回：接上了几块，空间不够时比num少
+ */
+static long chain_grow(const long tail, const long num, long *blks);
+
 /** enlarge_a_block()
- * 功能：给disk_blk扩充一个块，返回扩充新块的块号
- * 参数：n_blk：需要扩充的块号; disk_blk：一个申请好内存空间的u_fs_disk_block类型的指针
+ * 功能：在n_blk块后面接一个新块，返回扩充新块的块号
+ * 参数：n_blk：需要扩充的块号，应当是链尾
  * 返回：-1 失败; 成功则返回新块的块号
  */
-static long enlarge_a_block(const long n_blk, struct u_fs_disk_block * const disk_blk);
+static long enlarge_a_block(const long n_blk);
 
 /** clear blocks()
  * 功能：释放包括start_blk开始的后续块，同时在位图中将对应位的占用改为空闲
@@ -124,17 +1125,17 @@ static int strcnt(const char* str, const char ch);
 
 /** read_disk_block()
  * 功能：在diskimg中读出一个块的，保存在disk_blk中
- * 参数：n_blk：需要读的块号; disk_blk：一个申请好内存空间的u_fs_disk_block类型的指针
+ * 参数：n_blk：需要读的块号; disk_blk：一个申请好BLOCK_SIZE大小内存空间的指针
  * 返回：-1 失败; 0 成功
  */
-static int read_disk_block(long n_blk, struct u_fs_disk_block *disk_blk);
+static int read_disk_block(long n_blk, void *disk_blk);
 
 /** write_disk_block()
  * 功能：往diskimg中写一个块的内容
  * 参数：n_blk：需要写的块号; disk_blk：需要写往diskimg的内容
  * 返回：-1 失败; 0 成功
  */
-static int write_disk_block(long n_blk, struct u_fs_disk_block *disk_blk);
+static int write_disk_block(long n_blk, const void *disk_blk);
 
 /** set_single_bit_in_bitmap()
  * 功能：在diskimg的位图块中设置指定位为0或1
@@ -150,19 +1151,72 @@ static int set_single_bit_in_bitmap(const long n_blk, const int flag);
  */
 static int get_consecutive_free_blocks(const long n_blk, long* start_blk);
 
-/** check_path()
- * 功能：检查传入的路径path是否正确（纯粹的字符串检查），并分割路径
- * 参数：path：路径; dirname：子目录名（只有路径是子目录下的文件时才不会赋""值）
- * 参数：fname: 文件名; fext: 后缀名
- * 返回：-2 有文件名/目录名过长; -1 路径错误; 0 路径是根目录; 
- * 返回：1 根目录下，不带后缀名的文件或目录; 2 子目录下的文件
+/** bitmap_load()
+ * 功能：把diskimg的位图整个读进内存，须在blkdev_open()之后调用
+ * 返回：-1 失败; 0 成功
  */
-static int check_path(const char * const path, char * const dirname,
-                    char * const fname, char * const fext);
+static int bitmap_load(void);
 
-/** read_stat_in_rootdir()
- * 功能：传入文件/目录项的名称，读取根目录下对应的项的所有属性
- * 参数：fname：文件/目录名; fext：后缀名（没有时请传入""）
+/** bitmap_sync()
+ * 功能：把改过的位图块写回块缓存
+ * 返回：-1 失败; 0 成功
+ */
+static int bitmap_sync(void);
+
+/** bitmap_destroy()
+ * 功能：写回改过的位图块，释放内存中的位图
+ * 返回：NULL
+ */
+static void bitmap_destroy(void);
+
+/** bitmap_set_range()
+ * 功能：把从start开始的num块在位图中一起置为占用或空闲，每个组只重算一次
+ * 参数：start：起始块号; num：块数; flag：置为0还是1
+ * 返回：NULL
+ */
+static void bitmap_set_range(const long start, const long num, const int flag);
+
+/** bitmap_alloc_at()
+ * 功能：从start开始占用最多num块连续的空闲块，用于在已有的extent后面原地扩展
+ * 参数：start：起始块号; num：最多要多少块
+ * 返回：实际占用的块数，start不是空闲块时为0
+ */
+static long bitmap_alloc_at(const long start, const long num);
+
+/** bitmap_next()
+ * 功能：从pos开始往后找第一个值为used的位
+ * 参数：pos：从这一位开始找; used：1 找占用的块; 0 找空闲的块; limit：找到这一位为止（不含）
+ * 返回：找到的位，找不到返回limit
+ */
+static long bitmap_next(const long pos, const int used, const long limit);
+
+/** bitmap_group_update()
+ * 功能：重算第g组的汇总，再沿线段树往上更新到根
+ * 参数：g：组号
+ * 返回：NULL
+ */
+static void bitmap_group_update(const long g);
+
+/** bitmap_find_run()
+ * 功能：在线段树上找第一段至少num块的连续空闲块
+ * 参数：num：需要的块数
+ * 返回：-1 没有这么长的空闲块; 否则为这段空闲块的起始块号
+ */
+static long bitmap_find_run(const long num);
+
+/** check_path()
+ * 功能：检查传入的路径path是否正确（纯粹的字符串检查），并分割路径
+ * 参数：path：路径; dirname：子目录名（只有路径是子目录下的文件时才不会赋""值）
+ * 参数：fname: 文件名; fext: 后缀名
+ * 返回：-2 有文件名/目录名过长; -1 路径错误; 0 路径是根目录; 
+ * 返回：1 根目录下，不带后缀名的文件或目录; 2 子目录下的文件
+ */
+static int check_path(const char * const path, char * const dirname,
+                    char * const fname, char * const fext);
+
+/** read_stat_in_rootdir()
+ * 功能：传入文件/目录项的名称，读取根目录下对应的项的所有属性
+ * 参数：fname：文件/目录名; fext：后缀名（没有时请传入""）
  * 参数：f_dir: 分配好内存的u_fs_file_directory指针，得到属性会被保存在这里
  * 返回：-1 失败; 成功则返回该项处在根目录的哪个块上; 
  */
@@ -186,778 +1240,4502 @@ static long read_stat_from_block(const char* const fname, const char* const fext
  */
 static long read_stat_from_path(const char* path, struct u_fs_file_directory* f_dir);
 
+/** lookup_path()
+ * 功能：同read_stat_from_path()，另外给出这一项所在目录的第一块
+ * 参数：path：路径; f_dir：得到的属性; dir：所在目录的第一块放在这里，不要可以传NULL
+ * 返回：同read_stat_from_path()
+ */
+static long lookup_path(const char* path, struct u_fs_file_directory* f_dir, long *dir);
+
+/** dir_lookup()
+ * 功能：同read_stat_from_block()，但不拿目录的锁，调用的时候要拿着
+ */
+static long dir_lookup(const char* const fname, const char* const fext,
+                       const long blk, struct u_fs_file_directory* f_dir);
+
 /** write_stat_from_block()
- * 功能：写回属性到指定目录块
- * 参数：blk：属性需要写到哪个块上;
- * 参数：f_dir: 分配好内存的u_fs_file_directory指针，得到属性会被保存在这里
+ * 功能：写回属性，拿着目录的写锁按名字找到这一项再改，项被回填挪过位置也能找到
+ * 参数：dir：项所在目录的第一块;
+ * 参数：f_dir: 要写回的属性，按fname、fext找，nStartBlock要对得上
  * 返回：-1 失败; 0 成功; 
  */
-static int write_stat_from_block(const long blk, struct u_fs_file_directory const * const f_dir);
+static int write_stat_from_block(const long dir, struct u_fs_file_directory const * const f_dir);
 
-/** cp_item()
- * 功能：将src的文件/目录项属性复制到dest上
- * 参数：src：源内容; dest: 目的内容
+/** dirent_load() / dirent_store()
+ * 功能：把目录块里的一项读成u_fs_file_directory / 把u_fs_file_directory写成目录块里的一项，按超级块的dir_version
+ * 参数：de：目录项在目录块里的位置; item：内存中的项
  * 返回：NULL
  */
-static void cp_item(struct u_fs_file_directory * const dest, struct u_fs_file_directory const * const src);
+static void dirent_load(const char *de, struct u_fs_file_directory * const item);
+static void dirent_store(char *de, struct u_fs_file_directory const * const item);
+
+/** dirent_match()
+ * 功能：目录块里的一项是不是这个名字，紧凑格式先比散列值
+ * 参数：de：目录项在目录块里的位置; fname：文件/目录名; fext：后缀名; hash：dir_hash(fname, fext)
+ * 返回：1 是; 0 不是
+ */
+static int dirent_match(const char *de, const char *fname, const char *fext, const uint32_t hash);
+
+/** rm_item()
+ * 功能：从指定块中删除一个文件/目录项，采取了回填策略，同时置位位图
+ * 参数：dir：所在目录的第一块; i_blk：哪个块中的项目; f_dir：需要删除项目的一切属性
+ * 返回：-1 失败; 0 成功
+ */
+static int rm_item(const long dir, const long i_blk, struct u_fs_file_directory const * const f_dir);
+
+/** dir_hash()
+ * 功能：目录项名字的散列值，目录散列索引和目录项缓存都用它
+ * 参数：fname：文件/目录名; fext：后缀名
+ * 返回：32位散列值
+ */
+static uint32_t dir_hash(const char *fname, const char *fext);
+
+/** dir_chain()
+ * 功能：找名字在目录里该扫哪一串目录块，没有索引的目录是整个目录，有索引的是名字所在的桶
+ * 参数：dir：目录的第一块; fname：文件/目录名; fext：后缀名
+ * 返回：-1 空桶或出错; 否则为这一串的第一块
+ */
+static long dir_chain(const long dir, const char *fname, const char *fext);
+
+/** dir_add()
+ * 功能：往目录里加一项，接在目录（或名字所在的桶）最后一块的后面，不检查重名。
+ *      没有索引的目录放不下时改成散列索引（格式化时打开了的话），有索引的目录项数多了时桶数翻倍
+ * 参数：dir：目录的第一块; item：要加的项
+ * 返回：-1 失败; 否则为这一项所在的目录块
+ */
+static long dir_add(const long dir, struct u_fs_file_directory const * const item);
+
+/** dir_rebuild()
+ * 功能：把目录里的项全部读出来，按项数选好桶数，重新写成散列索引，再放掉原来的目录块
+ * 参数：dir：目录的第一块
+ * 返回：-1 失败（目录保持原样）; 0 成功
+ */
+static int dir_rebuild(const long dir);
+
+/** dir_index_count()
+ * 功能：有索引的目录的项数加上delta
+ * 参数：dir：目录的第一块; delta：加多少
+ * 返回：-1 目录没有索引或出错; 否则为加完后的项数
+ */
+static long dir_index_count(const long dir, const long delta);
+
+/** dir_free()
+ * 功能：释放目录的所有块，有索引时包括每个桶
+ * 参数：dir：目录的第一块
+ * 返回：-1 失败; 0 成功
+ */
+static int dir_free(const long dir);
+
+/** dcache_get() / dcache_set() / dcache_clear()
+ * 功能：查找、记下目录项缓存里的一项，清空目录项缓存
+ * 参数：dir：所在目录的第一块; fname：文件/目录名; fext：后缀名
+ * 参数：blk：这一项在哪个目录块，-1表示目录里没有; slot：是块里的第几项
+ * 返回：dcache_get()记过返回1，blk、slot里是记下的位置; 没记过返回0
+ */
+static int dcache_get(const long dir, const char *fname, const char *fext, long *blk, long *slot);
+static void dcache_set(const long dir, const char *fname, const char *fext, const long blk, const long slot);
+static void dcache_clear(void);
+
+/** obj_lock() / obj_trylock() / obj_unlock()
+ * 功能：拿、试着拿、放掉文件/目录的读写锁
+ * 参数：start：文件/目录的nStartBlock; write：1 写锁; 0 读锁
+ * 返回：-1 失败（obj_trylock()是锁被别人拿着）; 0 成功
+ */
+static int obj_lock(const long start, const int write);
+static int obj_trylock(const long start, const int write);
+static void obj_unlock(const long start);
+
+/** file_lock()
+ * 功能：按路径找到文件/目录，拿着它的锁返回。拿锁以后再查一次，中间被删掉或者名字换了主人就重来
+ *      有打开的fh时直接按fh记下的目录项找，不解析路径
+ * 参数：path：路径; fh：打开的文件，没有为NULL; f_dir：找到的项; dir：所在目录的第一块，不要可以传NULL;
+ * 参数：mode：OLOCK_READ、OLOCK_WRITE或OLOCK_SYNC，OLOCK_SYNC返回时f_dir是提交以后的
+ * 返回：负数为错误码：-ENOENT 找不到，-ENAMETOOLONG 名字过长，-EIO 提交攒着的数据失败;
+ *      否则同read_stat_from_path()，用完obj_unlock(f_dir->nStartBlock)
+ */
+static long file_lock(const char *path, struct u_fs_fh *fh, struct u_fs_file_directory *f_dir,
+                      long *dir, int mode);
+
+/** fh_entry() / fh_store()
+ * 功能：按fh记下的位置读出、写回文件的目录项，拿着所在目录的读锁/写锁;
+ *      位置对不上就在目录里按名字重新找，找到了记下新位置
+ * 参数：fh：打开的文件; f_dir：读出的项 / 要写回的项
+ * 返回：fh_entry() -1 文件已经被删掉了，否则为目录项所在的块; fh_store() -1 失败，0 成功
+ */
+static long fh_entry(struct u_fs_fh *fh, struct u_fs_file_directory *f_dir);
+static int fh_store(struct u_fs_fh *fh, struct u_fs_file_directory const * const f_dir);
 
-/** reset_item()
- * 功能：将dest的内容设为默认值
- * 参数：dest: 目的内容
+/** dir_lock()
+ * 功能：拿着根目录下一个目录的锁返回，拿锁以后再查一次，确认目录没有在这中间被删掉
+ * 参数：dirname：目录名; write：1 写锁; 0 读锁
+ * 返回：-2 拿锁失败（内存不够）; -1 目录不存在; 否则为目录的第一块，用完obj_unlock()
+ */
+static long dir_lock(const char *dirname, const int write);
+
+/** fill_stat()
+ * 功能：按目录项填struct stat，getattr和低层接口的lookup、readdir都用
+ * 参数：item：目录项; stbuf：填到这里
  * 返回：NULL
  */
-static void reset_item(struct u_fs_file_directory * const dest);
+static void fill_stat(struct u_fs_file_directory const * const item, struct stat *stbuf);
+
+/** itab_find() / itab_get() / itab_forget() / itab_clear()
+ * 功能：查找inode表里的一项; lookup到一个inode时登记，nlookup加一;
+ *      内核forget时nlookup减掉，减到0就删掉; 清空inode表
+ * 参数：ino：inode号; dir：所在目录的第一块; fname：文件/目录名; fext：后缀名;
+ * 参数：path：这一项的路径; nlookup：内核忘掉了几次; copy：itab_copy()把这一项拷到这里
+ * 返回：itab_find()没记过、itab_get()失败返回NULL; itab_copy()没记过返回-1
+ *      itab_find()和itab_get()要拿着itab.lock，返回的项只能在放锁之前用
+ */
+static struct u_fs_inode *itab_find(const fuse_ino_t ino);
+static struct u_fs_inode *itab_get(const fuse_ino_t ino, const long dir, const char *fname,
+                                   const char *fext, const char *path);
+static int itab_copy(const fuse_ino_t ino, struct u_fs_inode *copy);
+static void itab_forget(const fuse_ino_t ino, const uint64_t nlookup);
+static void itab_clear(void);
+
+/** ll_path()
+ * 功能：inode号换成路径，交给路径接口的函数
+ * 参数：ino：inode号; path：路径放在这里，要ITAB_PATH字节
+ * 返回：NULL 不认识这个inode; 否则为path
+ */
+static const char *ll_path(const fuse_ino_t ino, char *path);
+
+/** ll_child()
+ * 功能：（父目录的inode号，名字）换成所在目录的第一块、文件名、后缀名和路径
+ * 参数：parent：父目录的inode号; name：名字;
+ * 参数：dir、fname、fext、path：结果放在这里，fname、fext、path都要ITAB_PATH字节
+ * 返回：负的errno 失败; 0 成功
+ */
+static int ll_child(const fuse_ino_t parent, const char *name, long *dir,
+                    char *fname, char *fext, char *path);
 
-/** move_to_last_item()
- * 功能：移动it指针指向db块的的最后记录的位置
- * 参数：it：需要修改指针的指向; db：disk_block块
+/** ll_stat()
+ * 功能：按inode号读出属性，不解析路径
+ * 参数：ino：inode号; stbuf：填到这里
+ * 返回：负的errno 失败; 0 成功
+ */
+static int ll_stat(const fuse_ino_t ino, struct stat *stbuf);
+
+/** ll_reply_entry()
+ * 功能：查到或新建了一项以后登记进inode表，回复内核fuse_entry_param
+ * 参数：req：请求; dir：所在目录的第一块; fname：文件/目录名; fext：后缀名; path：路径
  * 返回：NULL
  */
-static void move_to_last_item(struct u_fs_file_directory **it, struct u_fs_disk_block const * const db);
+static void ll_reply_entry(fuse_req_t req, const long dir, const char *fname,
+                           const char *fext, const char *path);
 
-/** rm_item()
- * 功能：从指定块中删除一个文件/目录项，采取了回填策略，同时置位位图
- * 参数：i_blk：哪个块中的项目; f_dir：需要删除项目的一切属性
- * 返回：-1 失败; 0 成功
+/** ll_main()
+ * 功能：用低层接口挂载，自己建fuse_session跑请求循环，相当于低层接口的fuse_main()
+ * 参数：args：fuse_opt_parse()剩下的参数
+ * 返回：main()的返回值
+ */
+static int ll_main(struct fuse_args *args);
+
+static void show_help(const char *progname)
+{
+    printf("usage: %s [options] <mountpoint>\n\n", progname);
+    printf("File-system specific options:\n"
+           "    --cache-size=<size>  memory for the block cache, e.g. 64M (default: 16M, 0: off)\n"
+           "    --readahead=<size>   max sequential readahead window per open file (default: 256K, 0: off)\n"
+           "    --delalloc=<size>    buffer appends in memory up to this size before allocating (default: 1M, 0: off)\n"
+           "    --mmap               map the whole diskimg and access blocks in place (no block cache)\n"
+           "    --io-uring           submit batched block I/O through io_uring (build with IO_URING=1)\n"
+           "    --direct             open the diskimg with O_DIRECT, caching only in the block cache\n"
+           "    --lowlevel           use the low-level FUSE API with inode numbers instead of paths\n"
+           "\n");
+}
+
+/** parse_size()
+ * 功能：解析"64M"这种带K/M/G后缀的大小
+ * 参数：str：要解析的字符串
+ * 返回：-1 格式不对; 否则为字节数
  */
-static int rm_item(const long i_blk, struct u_fs_file_directory const * const f_dir);
+static long parse_size(const char *str){
+    char *end;
+    long n = strtol(str, &end, 10);
+    if(end == str || n < 0){
+        return -1;
+    }
+    switch(*end){
+        case 'g': case 'G': n <<= 10; //fall through
+        case 'm': case 'M': n <<= 10; //fall through
+        case 'k': case 'K': n <<= 10; end++; break;
+        case '\0': break;
+        default: return -1;
+    }
+    return *end == '\0' ? n : -1;
+}
 
 int main(int argc, char *argv[])
 {
+    int ret;
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+
+    if (fuse_opt_parse(&args, &options, option_spec, NULL) == -1)
+        return 1;
+    if (options.show_help) {
+        show_help(argv[0]);
+        assert(fuse_opt_add_arg(&args, "--help") == 0);
+        args.argv[0][0] = '\0';
+    }
+    else if (options.cache_size != NULL && parse_size(options.cache_size) == -1) {
+        fprintf(stderr, "invalid --cache-size: %s\n", options.cache_size);
+        return 1;
+    }
+    else if (options.readahead != NULL && parse_size(options.readahead) == -1) {
+        fprintf(stderr, "invalid --readahead: %s\n", options.readahead);
+        return 1;
+    }
+    else if (options.delalloc != NULL && parse_size(options.delalloc) == -1) {
+        fprintf(stderr, "invalid --delalloc: %s\n", options.delalloc);
+        return 1;
+    }
+    else if (load_superblock(DISKIMG_PATH) == -1) { //挂载前先检查diskimg的格式
+        return 1;
+    }
+
 	umask(0);
-	return fuse_main(argc, argv, &u_fs_oper, NULL);
+    if (options.lowlevel && !options.show_help) {
+        ret = ll_main(&args);
+    }
+    else {
+        ret = fuse_main(args.argc, args.argv, &u_fs_oper, NULL);
+    }
+    fuse_opt_free_args(&args);
+    return ret;
 }
 
-static int read_disk_block(long num_block, struct u_fs_disk_block *disk_block){
-	FILE *fp;
-	fp = fopen(DISKIMG_PATH, "r+");
-	if (fp == NULL){
-		perror("read_disk_block_info(): open file failed");
-		return -1;
-	}
-	if (fseek(fp, num_block * BLOCK_SIZE, SEEK_SET) != 0){
-		perror("read_disk_block_info(): fseek error");
-		fclose(fp);
-		return -1;
-	}
-	fread(disk_block, sizeof(struct u_fs_disk_block), 1, fp);
-	if (ferror(fp) || feof(fp)) {
-		fclose(fp);
-		perror("read_disk_block_info(): read file wrong");
-		return -1;
-	}
-	fclose(fp);
-	return 0;
+static int blkdev_open(const char *path, const long blk_size, const int direct){
+    int fd = open(path, O_RDWR);
+    if(fd == -1){
+        perror("blkdev_open(): open diskimg failed");
+        return -1;
+    }
+    struct stat st;
+    if(fstat(fd, &st) == -1){
+        perror("blkdev_open(): fstat failed");
+        close(fd);
+        return -1;
+    }
+    blkdev.fd = fd;
+    blkdev.blk_size = blk_size;
+    blkdev.n_blocks = st.st_size / blk_size;
+    blkdev.direct = 0;
+    blkdev.dio_unit = 1;
+    if(direct && blkdev_open_direct(path, st.st_size) == -1){
+        fprintf(stderr, "u_fs: O_DIRECT unavailable, using buffered I/O\n");
+    }
+    return 0;
 }
 
-static int write_disk_block(long num_block, struct u_fs_disk_block *disk_block){
-	FILE* fp;
-	fp = fopen(DISKIMG_PATH, "r+");
-	if (fp == NULL){
-		perror("write_disk_block_info(): open file failed");
-		return -1;
-	}	
-	if (fseek(fp, num_block * BLOCK_SIZE, SEEK_SET) != 0) {
-		perror("write_disk_block_info(): fseek error");
-		fclose(fp);
-		return -1;
-	}
-	fwrite(disk_block, sizeof(struct u_fs_disk_block), 1, fp);
-	if (ferror(fp) || feof(fp)) {
-		fclose(fp);
-		perror("write_disk_block_info(): read file wrong");
-		return -1;
-	}
-	fclose(fp);
-	return 0;
+static int blkdev_open_direct(const char *path, const off_t size){
+    long align = DIO_MIN_ALIGN;
+#ifdef STATX_DIOALIGN
+    struct statx stx;
+    if(statx(blkdev.fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 && (stx.stx_mask & STATX_DIOALIGN)){
+        if(stx.stx_dio_offset_align == 0){ //这个文件系统不支持O_DIRECT
+            return -1;
+        }
+        if(stx.stx_dio_offset_align > align) align = stx.stx_dio_offset_align;
+        if(stx.stx_dio_mem_align > align) align = stx.stx_dio_mem_align;
+    }
+#endif
+    if(align < blkdev.blk_size){ //块比对齐要求还大，一块就是一个I/O单元
+        align = blkdev.blk_size;
+    }
+    if(align % blkdev.blk_size != 0 || DIO_BUF_SIZE % align != 0 || size % align != 0){
+        //diskimg结尾不是整单元的话，最后一个单元写回时会把文件撑大
+        return -1;
+    }
+    if(posix_memalign((void **)&dio_pool.mem, align, (size_t)DIO_POOL_BUFS * DIO_BUF_SIZE) != 0){
+        dio_pool.mem = NULL;
+        return -1;
+    }
+    int fd = open(path, O_RDWR | O_DIRECT);
+    if(fd == -1){
+        perror("blkdev_open_direct(): open diskimg with O_DIRECT failed");
+        free(dio_pool.mem);
+        dio_pool.mem = NULL;
+        return -1;
+    }
+    int i;
+    for(i = 0; i < DIO_POOL_BUFS; i++){
+        dio_pool.free[i] = dio_pool.mem + (size_t)i * DIO_BUF_SIZE;
+    }
+    dio_pool.n_free = DIO_POOL_BUFS;
+    close(blkdev.fd);
+    blkdev.fd = fd;
+    blkdev.direct = 1;
+    blkdev.dio_align = align;
+    blkdev.dio_unit = align / blkdev.blk_size;
+    return 0;
 }
 
-static int strcnt(const char* str, const char ch){
-	int cnt = 0;
-	while(*str){
-		if(*str == ch) ++cnt;
-		++str;
-	}
-	return cnt;
+static char *dio_buf_get(void){
+    pthread_mutex_lock(&dio_pool.lock);
+    while(dio_pool.n_free == 0){
+        pthread_cond_wait(&dio_pool.cond, &dio_pool.lock);
+    }
+    char *buf = dio_pool.free[--dio_pool.n_free];
+    pthread_mutex_unlock(&dio_pool.lock);
+    return buf;
 }
 
-static int check_path(const char * const path, char * const dirname,
-                    char * const fname, char * const fext){
-    if(strcmp(path, "/") == 0){
-        return 0; //指根目录
+static void dio_buf_put(char *buf){
+    pthread_mutex_lock(&dio_pool.lock);
+    dio_pool.free[dio_pool.n_free++] = buf;
+    pthread_cond_signal(&dio_pool.cond);
+    pthread_mutex_unlock(&dio_pool.lock);
+}
+
+static int blkdev_mmap(void){
+    size_t len = (size_t)blkdev.n_blocks * blkdev.blk_size;
+    void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, blkdev.fd, 0);
+    if(map == MAP_FAILED){
+        perror("blkdev_mmap(): mmap diskimg failed");
+        return -1;
     }
-    if(strlen(path) <= 1){
-        return -1; //路径不正确
+    blkdev.map = map;
+    blkdev.map_dirty_lo = blkdev.map_dirty_hi = 0;
+    return 0;
+}
+
+/** blkdev_map_dirty()
+ * 功能：记下映射区里[n_blk, n_blk + n_cnt)这些块被写过了
+ */
+static void blkdev_map_dirty(const long n_blk, const long n_cnt){
+    pthread_mutex_lock(&blkdev.map_lock);
+    if(blkdev.map_dirty_lo == blkdev.map_dirty_hi){
+        blkdev.map_dirty_lo = n_blk;
+        blkdev.map_dirty_hi = n_blk + n_cnt;
     }
-    int res = strcnt(path, '/');
-    if(res == 1){
-        int cnt = strcnt(path, '.');
-        if(cnt == 0){
-            sscanf(path, "/%s", fname);
-            strcpy(fext, "");
-            strcpy(dirname, "");
-            if(strlen(fname) > MAX_FILENAME){
-                return -2; //文件名过长
-            }
-            return 1; //根目录下，不带后缀名的文件或目录
+    else{
+        if(n_blk < blkdev.map_dirty_lo) blkdev.map_dirty_lo = n_blk;
+        if(n_blk + n_cnt > blkdev.map_dirty_hi) blkdev.map_dirty_hi = n_blk + n_cnt;
+    }
+    pthread_mutex_unlock(&blkdev.map_lock);
+}
+
+static int blkdev_msync(void){
+    if(blkdev.map == NULL){
+        return 0;
+    }
+    pthread_mutex_lock(&blkdev.map_lock);
+    long lo = blkdev.map_dirty_lo, hi = blkdev.map_dirty_hi;
+    blkdev.map_dirty_lo = blkdev.map_dirty_hi = 0;
+    pthread_mutex_unlock(&blkdev.map_lock);
+    if(lo == hi){
+        return 0;
+    }
+    long page = sysconf(_SC_PAGESIZE);
+    off_t start = ((off_t)lo * blkdev.blk_size) & ~(off_t)(page - 1); //msync要求页对齐
+    off_t end = (off_t)hi * blkdev.blk_size;
+    if(msync(blkdev.map + start, end - start, MS_SYNC) == -1){
+        perror("blkdev_msync(): msync failed");
+        blkdev_map_dirty(lo, hi - lo); //下次再试
+        return -1;
+    }
+    return 0;
+}
+
+static void blkdev_close(void){
+    if(blkdev.fd == -1){
+        return;
+    }
+    blkdev_sync();
+    if(blkdev.map != NULL){
+        munmap(blkdev.map, (size_t)blkdev.n_blocks * blkdev.blk_size);
+        blkdev.map = NULL;
+    }
+    close(blkdev.fd);
+    blkdev.fd = -1;
+    if(blkdev.direct){
+        free(dio_pool.mem);
+        dio_pool.mem = NULL;
+        blkdev.direct = 0;
+        blkdev.dio_unit = 1;
+    }
+}
+
+/** blkdev_pread_full() / blkdev_pwrite_full()
+ * 功能：pread/pwrite直到读写完len字节，O_DIRECT模式下调用者负责对齐
+ */
+static int blkdev_pread_full(const off_t pos, void *buf, const size_t len){
+    size_t done = 0;
+    while(done < len){
+        ssize_t n = pread(blkdev.fd, (char *)buf + done, len - done, pos + done);
+        if(n == -1 && errno == EINTR){
+            continue;
         }
-        else if(cnt == 1){
-            sscanf(path, "/%[^.].%s", fname, fext);
-            strcpy(dirname, "");
-            if(strlen(fname) > MAX_FILENAME 
-            || strlen(fext) > MAX_EXTENSION){
-                return -2; //文件名过长
-            }
-            return 1; //根目录下，带后缀的文件
+        if(n <= 0){ //出错，或读到了diskimg的结尾
+            perror("blkdev_pread_full(): pread failed");
+            return -1;
         }
-        return -1; //路径有误
+        done += n;
     }
-    else if(res == 2){
-        sscanf(path, "/%[^/]", dirname);
-        if(strcnt(dirname, '.') != 0){
-            return -1; //目录名不能带.
+    return 0;
+}
+
+static int blkdev_pwrite_full(const off_t pos, const void *buf, const size_t len){
+    size_t done = 0;
+    while(done < len){
+        ssize_t n = pwrite(blkdev.fd, (const char *)buf + done, len - done, pos + done);
+        if(n == -1 && errno == EINTR){
+            continue;
         }
-        if(strlen(dirname) > MAX_FILENAME){
-            return -2; //目录名过长
+        if(n <= 0){
+            perror("blkdev_pwrite_full(): pwrite failed");
+            return -1;
         }
-        int cnt = strcnt(path, '.');
-        if(cnt == 0){
-            sscanf(path, "/%[^/]/%s", dirname, fname);
-            strcpy(fext, "");
-            if(strlen(fname) > MAX_FILENAME){
-                return -2; //文件名过长
+        done += n;
+    }
+    return 0;
+}
+
+static int blkdev_dio_rw(const off_t pos, const struct iovec *iov, int iovcnt, const int is_write){
+    size_t len = 0;
+    int i;
+    for(i = 0; i < iovcnt; i++){
+        len += iov[i].iov_len;
+    }
+    off_t unit = blkdev.dio_align;
+    off_t lo = pos / unit * unit;
+    off_t hi = (pos + len + unit - 1) / unit * unit;
+    size_t v_off = 0; //在当前iov里已经拷过的字节
+    char *bounce = dio_buf_get();
+    int res = 0;
+    if(is_write){
+        pthread_mutex_lock(&blkdev.dio_lock);
+    }
+    off_t at;
+    for(at = lo; at < hi && res == 0; at += DIO_BUF_SIZE){
+        off_t end = at + DIO_BUF_SIZE < hi ? at + DIO_BUF_SIZE : hi;
+        off_t from = at > pos ? at : pos; //这一段里真正要读写的范围[from, to)
+        off_t to = end < pos + (off_t)len ? end : pos + (off_t)len;
+        if(!is_write){
+            res = blkdev_pread_full(at, bounce, end - at);
+        }
+        else{ //只有头尾两个单元可能不满，先把它们原来的内容读出来
+            if(from > at){
+                res = blkdev_pread_full(at, bounce, unit);
+            }
+            if(res == 0 && to < end && !(from > at && end - at == unit)){
+                res = blkdev_pread_full(end - unit, bounce + (end - unit - at), unit);
             }
-            return 2;
         }
-        else if(cnt == 1){
-            sscanf(path, "/%[^/]/%[^.].%s", dirname, fname, fext);
-            if(strlen(fname) > MAX_FILENAME 
-            || strlen(fext) > MAX_EXTENSION){
-                return -2; //文件名过长
+        if(res == -1){
+            break;
+        }
+        off_t p = from;
+        while(p < to){
+            size_t n = iov->iov_len - v_off;
+            if(n > (size_t)(to - p)){
+                n = to - p;
             }
-            if(strlen(fname) == 0){
-                //文件名不能为空
-                return -1; 
+            if(is_write){
+                memcpy(bounce + (p - at), (char *)iov->iov_base + v_off, n);
+            }
+            else{
+                memcpy((char *)iov->iov_base + v_off, bounce + (p - at), n);
+            }
+            p += n;
+            v_off += n;
+            if(v_off == iov->iov_len){
+                iov++;
+                v_off = 0;
             }
-            return 2;
         }
-        return -1; //路径不正确
+        if(is_write){
+            res = blkdev_pwrite_full(at, bounce, end - at);
+        }
     }
-    return -1;//路径不正确
+    if(is_write){
+        pthread_mutex_unlock(&blkdev.dio_lock);
+    }
+    dio_buf_put(bounce);
+    return res;
 }
 
-static long read_stat_in_rootdir(const char* const fname, const char * const fext, 
-                                struct u_fs_file_directory* f_dir){
-    //you have to ensure that is under rootdir
-    struct u_fs_disk_block *disk_blk = malloc(sizeof(struct u_fs_disk_block));
-    if(read_disk_block(0, disk_blk) == -1){
-		printf("read_stat_in_rootdir(): read_disk_block failed\n");
-		return -1;
-	}
-    long root_blk = ((struct sb*)disk_blk)->first_blk;
+static int blkdev_read_bytes(const off_t pos, void *buf, const size_t len){
+    if(blkdev.direct){
+        struct iovec iov = { buf, len };
+        return blkdev_dio_rw(pos, &iov, 1, 0);
+    }
+    return blkdev_pread_full(pos, buf, len);
+}
 
-    struct u_fs_file_directory *dir;
-    long curr_blk = 0; //目前在sb块
-    long next_blk = root_blk; //下一步想读的是根目录块
-    int offset = 0;
-    while(next_blk != -1){
-        read_disk_block(next_blk, disk_blk);
-        curr_blk = next_blk; //读完了，当前块移动到next_blk
-        next_blk = disk_blk->nNextBlock;
-        offset = 0;
-        dir = (struct u_fs_file_directory *)disk_blk->data;
-        while(offset < disk_blk->size){
-            if(strcmp(dir->fname, fname) == 0
-            && strcmp(dir->fext, fext) == 0)
-            {
-                strcpy(f_dir->fname, fname);
-                strcpy(f_dir->fext, fext);
-                f_dir->fsize = dir->fsize;
-                f_dir->nStartBlock = dir->nStartBlock;
-                f_dir->flag = dir->flag;
-                free(disk_blk);
-                return curr_blk; //返回这个项目在目录中的位置
-            }
-            dir++;
-            offset += sizeof(struct u_fs_file_directory);
+static int blkdev_write_bytes(const off_t pos, const void *buf, const size_t len){
+    if(blkdev.direct){
+        struct iovec iov = { (void *)buf, len };
+        return blkdev_dio_rw(pos, &iov, 1, 1);
+    }
+    return blkdev_pwrite_full(pos, buf, len);
+}
+
+static int blkdev_read(const long n_blk, const long n_cnt, void *buf){
+    if(n_blk < 0 || n_blk + n_cnt > blkdev.n_blocks){
+        printf("blkdev_read(): block %ld out of range\n", n_blk);
+        return -1;
+    }
+    if(blkdev.map != NULL){
+        char *src = blkdev.map + (off_t)n_blk * blkdev.blk_size;
+        if(src != buf){
+            memcpy(buf, src, n_cnt * blkdev.blk_size);
         }
+        return 0;
     }
-    free(disk_blk);
-    return -1;
+    return blkdev_read_bytes((off_t)n_blk * blkdev.blk_size, buf, n_cnt * blkdev.blk_size);
 }
 
-static long read_stat_from_block(const char* const fname, const char* const fext, 
-                                        const long blk, struct u_fs_file_directory* f_dir)
-{
-    //you have to ensure that block not wrong
-    struct u_fs_disk_block *disk_blk = malloc(sizeof(struct u_fs_disk_block));
-    struct u_fs_file_directory *dir;
-    long curr_blk = -1; //目前在sb块
-    long next_blk = blk; //下一步想读的是blk块
-    int offset = 0;
-    while(next_blk != -1){
-        read_disk_block(next_blk, disk_blk);
-        curr_blk = next_blk; //读完了，当前块移动到next_blk
-        next_blk = disk_blk->nNextBlock;
-        offset = 0;
-        dir = (struct u_fs_file_directory *)disk_blk->data;
-        while(offset < disk_blk->size){
-            if(strcmp(dir->fname, fname) == 0
-            && strcmp(dir->fext, fext) == 0)
-            {
-                strcpy(f_dir->fname, fname);
-                strcpy(f_dir->fext, fext);
-                f_dir->fsize = dir->fsize;
-                f_dir->nStartBlock = dir->nStartBlock;
-                f_dir->flag = dir->flag;
-                free(disk_blk);
-                return curr_blk; //返回这个项目在目录中的位置
-            }
-            dir++;
-            offset += sizeof(struct u_fs_file_directory);
+static int blkdev_write(const long n_blk, const long n_cnt, const void *buf){
+    if(n_blk < 0 || n_blk + n_cnt > blkdev.n_blocks){
+        printf("blkdev_write(): block %ld out of range\n", n_blk);
+        return -1;
+    }
+    if(blkdev.map != NULL){
+        char *dst = blkdev.map + (off_t)n_blk * blkdev.blk_size;
+        if(dst != buf){ //get_block()拿到的指针本身就在映射区里
+            memcpy(dst, buf, n_cnt * blkdev.blk_size);
         }
+        blkdev_map_dirty(n_blk, n_cnt);
+        return 0;
     }
-    free(disk_blk);
-    return -1;
+    return blkdev_write_bytes((off_t)n_blk * blkdev.blk_size, buf, n_cnt * blkdev.blk_size);
 }
 
-static int write_stat_from_block(const long blk, struct u_fs_file_directory const * const f_dir){
-    struct u_fs_disk_block *disk_blk;
-	disk_blk = malloc(sizeof(struct u_fs_disk_block));
-    read_disk_block(blk, disk_blk);
-    struct u_fs_file_directory *it;
-    it = (struct u_fs_file_directory *)disk_blk->data;
-    int offset = 0;
-    while(offset < disk_blk->size){ 
-        if(f_dir->flag == it->flag &&
-            strcmp(f_dir->fname, it->fname) == 0 &&
-            strcmp(f_dir->fext, it->fext) == 0)
-        {   
-            cp_item(it, f_dir);
-            write_disk_block(blk, disk_blk);
-            free(disk_blk);
-            return 0;
+/** blkdev_rw_vec()
+ * 功能：blkdev_readv()和blkdev_writev()的共同实现，处理preadv/pwritev只完成一部分的情况
+ * 参数：is_write：1写 0读
+ * 返回：-1 失败; 0 成功
+ */
+static int blkdev_rw_vec(const long n_blk, const struct iovec *iov, int iovcnt, const int is_write){
+    size_t total = 0;
+    int i;
+    for(i = 0; i < iovcnt; i++){
+        total += iov[i].iov_len;
+    }
+    if(n_blk < 0 || (off_t)n_blk * blkdev.blk_size + total > (off_t)blkdev.n_blocks * blkdev.blk_size){
+        printf("blkdev_rw_vec(): block %ld out of range\n", n_blk);
+        return -1;
+    }
+    off_t pos = (off_t)n_blk * blkdev.blk_size;
+    if(blkdev.map != NULL){
+        for(i = 0; i < iovcnt; i++){
+            if(is_write){
+                memcpy(blkdev.map + pos, iov[i].iov_base, iov[i].iov_len);
+            }
+            else{
+                memcpy(iov[i].iov_base, blkdev.map + pos, iov[i].iov_len);
+            }
+            pos += iov[i].iov_len;
+        }
+        if(is_write){
+            blkdev_map_dirty(n_blk, total / blkdev.blk_size);
         }
-        offset += sizeof(struct u_fs_file_directory);
-        it++;
+        return 0;
     }
-    printf("write_stat_from_block(): can't find the item!\n");
-    free(disk_blk);
-    return -1;
-}
-
-static long read_stat_from_path(const char* path, struct u_fs_file_directory* f_dir){
-    char dirname[2*MAX_FILENAME + 1];
-    char fname[2*MAX_FILENAME + 1];
-    char fext[2*MAX_EXTENSION + 1];
-    int res = check_path(path, dirname, fname, fext);
-    if(res < 0){
-        return res;//-2路径中有名字过长, -1路径有误
+    if(blkdev.direct){
+        return blkdev_dio_rw(pos, iov, iovcnt, is_write);
     }
-    if(res == 0){
-        struct u_fs_disk_block *disk_blk = malloc(sizeof(struct u_fs_disk_block));
-        if(read_disk_block(0, disk_blk) == -1){
-		    printf("read_stat_from_path(): read_disk_block failed!\n");
-		    return -1;
-	    }
-        strcpy(f_dir->fname, "root");
-        strcpy(f_dir->fext, "");
-        f_dir->fsize = ((struct sb*)disk_blk)->fs_size * BLOCK_SIZE;
-        f_dir->nStartBlock = ((struct sb*)disk_blk)->first_blk;
-        f_dir->flag = 2;
-        free(disk_blk);
-        return 0; //返回超级块所在位置
-	}
-	if(res == 1){
-		//根目录下的文件或目录 
-        return read_stat_in_rootdir(fname, fext, f_dir);
-	}
-	if(res == 2){
-		//子目录下的文件
-        struct u_fs_file_directory* temp_dir = malloc(sizeof(struct u_fs_file_directory));
-        long dres =  read_stat_in_rootdir(dirname, "", temp_dir);
-        if(dres == -1){
-			printf("read_stat_from_path(): subdirectory doesn't existed!\n");
-            free(temp_dir);
+    while(iovcnt > 0){
+        int cnt = iovcnt < UIO_MAXIOV ? iovcnt : UIO_MAXIOV;
+        ssize_t n = is_write ? pwritev(blkdev.fd, iov, cnt, pos) : preadv(blkdev.fd, iov, cnt, pos);
+        if(n == -1 && errno == EINTR){
+            continue;
+        }
+        if(n <= 0){
+            perror("blkdev_rw_vec(): preadv/pwritev failed");
             return -1;
         }
-        dres = read_stat_from_block(fname, fext, temp_dir->nStartBlock, f_dir);
-        free(temp_dir);
-        return dres;
-	}
-    return -1;
+        pos += n;
+        //跳过已经完成的iov，最后一个只完成一部分的用字节接口补齐
+        while(iovcnt > 0 && (size_t)n >= iov->iov_len){
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if(n > 0){
+            size_t rest = iov->iov_len - n;
+            int res = is_write ? blkdev_pwrite_full(pos, (char *)iov->iov_base + n, rest)
+                                : blkdev_pread_full(pos, (char *)iov->iov_base + n, rest);
+            if(res == -1){
+                return -1;
+            }
+            pos += rest;
+            iov++;
+            iovcnt--;
+        }
+    }
+    return 0;
 }
 
-static long enlarge_a_block(const long num_block, struct u_fs_disk_block * const disk_blk){
-    long new_block = -1;
-    if(get_consecutive_free_blocks(1, &new_block) == -1){
-        printf("enlarge_a_block(): get a free block failed!\n");
-        return -1;
-    }
-    //格式化新块
-    struct u_fs_disk_block *tmp = malloc(sizeof(struct u_fs_disk_block));
-    read_disk_block(new_block, tmp);
-    tmp->size = 0;
-    tmp->nNextBlock = -1;
-    tmp->data[0] = '\0';
-    write_disk_block(new_block, tmp);
-    free(tmp);
-    tmp = NULL;
-    //disk_blk更新，同时写回磁盘
-    disk_blk->nNextBlock = new_block;
-    write_disk_block(num_block, disk_blk);  
-    return new_block;
+static int blkdev_readv(const long n_blk, const struct iovec *iov, int iovcnt){
+    return blkdev_rw_vec(n_blk, iov, iovcnt, 0);
 }
 
-static int clear_blocks(const long start_blk){
-    if(start_blk == -1){
+static int blkdev_writev(const long n_blk, const struct iovec *iov, int iovcnt){
+    return blkdev_rw_vec(n_blk, iov, iovcnt, 1);
+}
+
+#ifdef U_FS_IO_URING
+static int uring_init(void){
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, URING_DEPTH, &p);
+    if(fd == -1){
+        perror("uring_init(): io_uring_setup failed");
         return -1;
     }
-    struct u_fs_disk_block* disk_blk;
-    disk_blk = malloc(sizeof(struct u_fs_disk_block));
-
-    long curr_blk = start_blk;
-    long next_blk = -1;
-    while(curr_blk != -1){
-        read_disk_block(curr_blk, disk_blk);
-        next_blk = disk_blk->nNextBlock;
-        disk_blk->size = 0;
-        disk_blk->nNextBlock = -1;
-        disk_blk->data[0] = '\0';
-        write_disk_block(curr_blk, disk_blk);
-        set_single_bit_in_bitmap(curr_blk, 0);
-        curr_blk = next_blk;
+    uring.sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    uring.cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP){ //SQ和CQ两个环可以一次映射
+        if(uring.cq_ring_size > uring.sq_ring_size){
+            uring.sq_ring_size = uring.cq_ring_size;
+        }
+        uring.cq_ring_size = uring.sq_ring_size;
     }
-    free(disk_blk);
-    disk_blk = NULL;
-    return 0;
-}
-
-static int set_single_bit_in_bitmap(const long num, const int flag) {
-	if (num == -1){
-		return -1;
+    uring.sq_ring = mmap(NULL, uring.sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if(uring.sq_ring == MAP_FAILED){
+        perror("uring_init(): mmap sq ring failed");
+        close(fd);
+        return -1;
     }
-	FILE* fp;
-	fp = fopen(DISKIMG_PATH, "r+");
-	if (fp == NULL){
-		return -1;
+    if(p.features & IORING_FEAT_SINGLE_MMAP){
+        uring.cq_ring = uring.sq_ring;
     }
-
-	fseek(fp, BLOCK_SIZE + (num/8), SEEK_SET);
-	BYTE *byte = malloc(sizeof(BYTE));
-	fread(byte, sizeof(BYTE), 1, fp);
-    BYTE mask = (1<<7);
-    mask >>= (num%8);
-	if (flag){
-		*byte |= mask;
+    else{
+        uring.cq_ring = mmap(NULL, uring.cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if(uring.cq_ring == MAP_FAILED){
+            perror("uring_init(): mmap cq ring failed");
+            munmap(uring.sq_ring, uring.sq_ring_size);
+            close(fd);
+            return -1;
+        }
     }
-	else{
-        *byte &= ~mask;
+    uring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(uring.sqes == MAP_FAILED){
+        perror("uring_init(): mmap sqes failed");
+        if(uring.cq_ring != uring.sq_ring){
+            munmap(uring.cq_ring, uring.cq_ring_size);
+        }
+        munmap(uring.sq_ring, uring.sq_ring_size);
+        close(fd);
+        return -1;
     }
+    char *sq = uring.sq_ring, *cq = uring.cq_ring;
+    uring.sq_head = (unsigned *)(sq + p.sq_off.head);
+    uring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    uring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    uring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    uring.cq_head = (unsigned *)(cq + p.cq_off.head);
+    uring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    uring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    uring.entries = p.sq_entries;
+    uring.fd = fd;
+    return 0;
+}
 
-	fseek(fp, BLOCK_SIZE + (num/8), SEEK_SET);
-	fwrite(byte, sizeof(BYTE), 1, fp);
-	fclose(fp);
-	free(byte);
-	return 0;
+static void uring_exit(void){
+    pthread_mutex_lock(&uring.lock);
+    if(uring.fd != -1){
+        munmap(uring.sqes, uring.entries * sizeof(struct io_uring_sqe));
+        if(uring.cq_ring != uring.sq_ring){
+            munmap(uring.cq_ring, uring.cq_ring_size);
+        }
+        munmap(uring.sq_ring, uring.sq_ring_size);
+        close(uring.fd);
+        uring.fd = -1;
+    }
+    pthread_mutex_unlock(&uring.lock);
 }
 
-static int get_consecutive_free_blocks(const long num, long* start_blk){
-    FILE *fp;
-    fp = fopen(DISKIMG_PATH, "r+");
-    if(fp == NULL){
-        printf("get_free_blocks(): file open failed");
-        return -1;
-    }
-    //检索bitmap，查找连续的
-    long sum_cnt = 0;
-    long ibit = 1 + NUM_BITMAP_BLOCK + 1;
-    BYTE *byte;
-    byte = malloc(sizeof(BYTE));
-    long cnt = 0;
-    long res_start_blk = ibit;
-    int flag = 0;
-    while(ibit < NUM_TOTAL_BLOCK - 1){
-        long l_off = ibit % 8;
-        BYTE mask = (1<<7);
-        mask >>= l_off;
-        fseek(fp, BLOCK_SIZE + (ibit/8), SEEK_SET);
-        fread(byte, sizeof(BYTE), 1, fp);
-        int i = l_off;
-        for(; i < 8; i++){
-            if((*byte&mask)!=mask){ //该位为0,空闲
-                ++cnt;
-                ++sum_cnt;
-                if(cnt == num){
-                    *start_blk = res_start_blk;
-                    flag = 1;
-                    break;
-                }
-            }
-            else{
-                cnt = 0;
-                res_start_blk = ibit + 1;
+/** uring_reap()
+ * 功能：收割CQ里已经完成的请求，只完成了一部分的请求用同步的preadv/pwritev重做。调用者需持有uring.lock
+ * 参数：bios：这一批请求，user_data是下标; res：有请求重做也失败时置为-1
+ * 返回：收割了多少个请求
+ */
+static int uring_reap(struct u_fs_bio *bios, int *res){
+    int n = 0;
+    unsigned head = *uring.cq_head;
+    while(head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)){
+        struct io_uring_cqe *cqe = &uring.cqes[head & *uring.cq_mask];
+        struct u_fs_bio *bio = &bios[cqe->user_data];
+        size_t want = 0;
+        int i;
+        for(i = 0; i < bio->iovcnt; i++){
+            want += bio->iov[i].iov_len;
+        }
+        if(cqe->res < 0 || (size_t)cqe->res != want){
+            int r = bio->write ? blkdev_writev(bio->blk, bio->iov, bio->iovcnt)
+                               : blkdev_readv(bio->blk, bio->iov, bio->iovcnt);
+            if(r == -1){
+                *res = -1;
             }
-            mask >>= 1;
-            ++ibit;
         }
-        if(flag == 1) break;
+        head++;
+        n++;
     }
-    free(byte);
-    fclose(fp);
+    __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+    return n;
+}
 
-    if(flag == 0){ //没找到足够大的连续的空闲块
-        return sum_cnt;
+/** uring_submit()
+ * 功能：把一批请求放进io_uring，最多保持URING_DEPTH个同时在飞，直到全部完成；
+ *      只完成了一部分的请求用同步的preadv/pwritev重做
+ * 返回：-1 有请求失败; 0 全部成功
+ */
+static int uring_submit(struct u_fs_bio *bios, const int n){
+    int res = 0;
+    int queued = 0;   //已经放进SQ的请求数
+    int pending = 0;  //放进了SQ但内核还没取走的请求数
+    int inflight = 0; //内核已取走但还没完成的请求数
+    int done = 0;
+    pthread_mutex_lock(&uring.lock);
+    if(uring.fd == -1){ //别的线程刚把环关掉了
+        pthread_mutex_unlock(&uring.lock);
+        return blkdev_submit(bios, n);
     }
-    //可优化，write bitmap;
-    int j = res_start_blk;
-    int i;
-    for(i = 0; i < num; i++){
-        if(set_single_bit_in_bitmap(j, 1) == -1){
-            return -2; //error
+    while(done < n){
+        //尽量把SQ填满
+        unsigned tail = *uring.sq_tail;
+        while(queued < n && inflight + pending < (int)uring.entries){
+            struct u_fs_bio *bio = &bios[queued];
+            unsigned idx = tail & *uring.sq_mask;
+            struct io_uring_sqe *sqe = &uring.sqes[idx];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = bio->write ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe->fd = blkdev.fd;
+            sqe->addr = (unsigned long)bio->iov;
+            sqe->len = bio->iovcnt;
+            sqe->off = (off_t)bio->blk * blkdev.blk_size;
+            sqe->user_data = queued;
+            uring.sq_array[idx] = idx;
+            tail++;
+            queued++;
+            pending++;
+        }
+        __atomic_store_n(uring.sq_tail, tail, __ATOMIC_RELEASE);
+        //提交新请求，并至少等一个完成
+        int ret = syscall(__NR_io_uring_enter, uring.fd, pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if(ret == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            //环出了问题，不再使用io_uring。内核还没取走的请求从SQ撤回来，
+            //已经取走的要等它们做完，否则同步重做以后旧的写还可能落盘，拆环时也还有I/O在用它
+            perror("uring_submit(): io_uring_enter failed, falling back to pread/pwrite");
+            unsigned head = __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE);
+            __atomic_store_n(uring.sq_tail, head, __ATOMIC_RELEASE);
+            int first = queued - (int)(tail - head); //下标在这之前的请求都被内核取走了
+            inflight += pending - (int)(tail - head);
+            while(1){
+                int r = uring_reap(bios, &res);
+                inflight -= r;
+                done += r;
+                if(inflight <= 0){
+                    break;
+                }
+                if(syscall(__NR_io_uring_enter, uring.fd, 0, inflight, IORING_ENTER_GETEVENTS, NULL, 0) == -1
+                && errno != EINTR){
+                    break;
+                }
+            }
+            pthread_mutex_unlock(&uring.lock);
+            if(inflight > 0){ //等不到它们完成，环只能留着，这一批算失败
+                printf("uring_submit(): %d requests still in flight\n", inflight);
+                return -1;
+            }
+            uring_exit();
+            //只重做内核没取走的请求
+            if(first < n && blkdev_submit(bios + first, n - first) == -1){
+                res = -1;
+            }
+            return res;
         }
-        ++j;
+        pending -= ret;
+        inflight += ret;
+        //收割完成的请求
+        int r = uring_reap(bios, &res);
+        inflight -= r;
+        done += r;
     }
-    return -1; //success
+    pthread_mutex_unlock(&uring.lock);
+    return res;
 }
-
-static void cp_item(struct u_fs_file_directory * const dest, struct u_fs_file_directory const * const src){
-    strcpy(dest->fname, src->fname);
-    strcpy(dest->fext, src->fext);
-    dest->fsize = src->fsize;
-    dest->nStartBlock = src->nStartBlock;
-    dest->flag = src->flag;
+#else
+static int uring_init(void){
+    fprintf(stderr, "u_fs: built without io_uring support (make IO_URING=1)\n");
+    return -1;
 }
 
-static void reset_item(struct u_fs_file_directory * const dest){
-    strcpy(dest->fname, "");
-    strcpy(dest->fext, "");
-    dest->fsize = 0;
-    dest->nStartBlock = -1;
-    dest->flag = 0;
+static void uring_exit(void){
 }
+#endif
 
-static void move_to_last_item(struct u_fs_file_directory **it, struct u_fs_disk_block const * const db){
-    int ceiling = sizeof(struct u_fs_file_directory);
-    (*it) = (struct u_fs_file_directory *)db->data;
-    while(ceiling < db->size){
-        ceiling += sizeof(struct u_fs_file_directory);
-        (*it)++;
+static int blkdev_submit(struct u_fs_bio *bios, const int n){
+#ifdef U_FS_IO_URING
+    if(uring.fd != -1 && blkdev.map == NULL && !blkdev.direct){ //O_DIRECT的请求要经过对齐缓冲区中转
+        return uring_submit(bios, n);
+    }
+#endif
+    int res = 0;
+    int i;
+    for(i = 0; i < n; i++){
+        int r = bios[i].write ? blkdev_writev(bios[i].blk, bios[i].iov, bios[i].iovcnt)
+                              : blkdev_readv(bios[i].blk, bios[i].iov, bios[i].iovcnt);
+        if(r == -1){
+            res = -1;
+        }
     }
+    return res;
 }
 
-static int rm_item(const long i_blk, struct u_fs_file_directory const * const f_dir){
-    struct u_fs_disk_block* disk_blk;
-    disk_blk = malloc(sizeof(struct u_fs_disk_block));
-    read_disk_block(i_blk, disk_blk);
-    //删除项目所在的目录块中对应的一项
-    struct u_fs_file_directory *it;
-    struct u_fs_file_directory *last;
-    it = (struct u_fs_file_directory *)disk_blk->data;
-    last = (struct u_fs_file_directory *)disk_blk->data;
-    int offset = 0;
-    int flag = 0;
-    while(offset < disk_blk->size){ 
-        if(f_dir->flag == it->flag &&
-            strcmp(f_dir->fname, it->fname) == 0 &&
-            strcmp(f_dir->fext, it->fext) == 0)
-        {   
-            flag = 1;
-            break;
-        }
-        offset += sizeof(struct u_fs_file_directory);
-        it++;
+static int blkdev_sync(void){
+    if(blkdev.map != NULL){
+        return blkdev_msync();
     }
-    if(flag == 0){
-        printf("rm_item(): target item is not found!\n");
+    if(fdatasync(blkdev.fd) == -1){
+        perror("blkdev_sync(): fdatasync failed");
         return -1;
     }
-    //首先删除其内容所在后续块
-    clear_blocks(it->nStartBlock);
-    //移动last指向该块最末尾
-    move_to_last_item(&last, disk_blk);
-    //把last数据覆盖到item上，并且清空last数据
-    cp_item(it, last);
-    reset_item(last);
-    disk_blk->size -= sizeof(struct u_fs_file_directory);
-    write_disk_block(i_blk, disk_blk);
-    //上面的步骤把i_blk最后的项目覆盖到想要删除的项上，并已经项目清空了后续块
-    
-    long curr_blk = i_blk;
-    long next_blk = disk_blk->nNextBlock;
-    struct u_fs_disk_block* next_disk_blk;
-    next_disk_blk = malloc(sizeof(struct u_fs_disk_block));
-    while(next_blk != -1){
-        //读下一块的内容
-        read_disk_block(curr_blk, disk_blk); 
-        read_disk_block(next_blk, next_disk_blk);
-        //两个块item指针都指向最后，前面的块需要多增一位
-        move_to_last_item(&it, disk_blk);
-        it++;
-        move_to_last_item(&last, next_disk_blk);
-        //it内容用last覆盖，写回前块
-        cp_item(it, last);
-        disk_blk->size += sizeof(struct u_fs_file_directory);
-        reset_item(last);
-        next_disk_blk->size -= sizeof(struct u_fs_file_directory);
-        if(next_disk_blk->size == 0){
-            clear_blocks(next_blk);
-            next_blk = -1;
-            disk_blk->nNextBlock = -1;
-            write_disk_block(curr_blk, disk_blk);
-        }
-        else{
-            write_disk_block(curr_blk, disk_blk);
-            write_disk_block(next_blk, next_disk_blk);
-            curr_blk = next_blk;
-            next_blk = next_disk_blk->nNextBlock;
-        }
-    } 
     return 0;
 }
 
-static int u_fs_getattr(const char *path, struct stat *stbuf,
-		       struct fuse_file_info *fi)
-{
-	(void) fi;
+static void arc_unlink(struct u_fs_cbuf *b){
+    b->prev->next = b->next;
+    b->next->prev = b->prev;
+    cache.len[b->list]--;
+}
 
-	struct u_fs_file_directory* attr;
-	attr = malloc(sizeof(struct u_fs_file_directory));
-	long res = read_stat_from_path(path, attr);
-	if(res == -1){
-		free(attr);
-		return -ENOENT;
-	}
-	memset(stbuf, 0, sizeof(struct stat));
-	if(attr->flag == 2){
-		stbuf->st_mode = S_IFDIR | 0666;
-        stbuf->st_size = attr->fsize;
-	}
-	else if(attr->flag == 1){
-		stbuf->st_mode = S_IFREG | 0666;
-		stbuf->st_size = attr->fsize;
-	}
-	free(attr);
-    attr = NULL;
-	return 0;
+static void arc_push_mru(const int list, struct u_fs_cbuf *b){
+    struct u_fs_cbuf *head = &cache.list[list];
+    b->list = list;
+    b->prev = head;
+    b->next = head->next;
+    head->next->prev = b;
+    head->next = b;
+    cache.len[list]++;
 }
 
-static int u_fs_mkdir(const char *path, mode_t mode){
-    (void) mode;
+static struct u_fs_cbuf *arc_lru(const int list){
+    struct u_fs_cbuf *head = &cache.list[list];
+    return head->prev == head ? NULL : head->prev;
+}
 
-	if(strcmp(path, "/") == 0 || strcnt(path, '/') > 1
-    || strcnt(path, '.') != 0){
-		return -EPERM;
-	}
-    if(strlen(path) > (MAX_FILENAME - 1)){ //目录名过长
-        return ENAMETOOLONG;
+static long cache_hash(const long n_blk){
+    return (unsigned long)n_blk * 0x9E3779B97F4A7C15UL >> 20 & cache.hash_mask;
+}
+
+static struct u_fs_cbuf *cache_lookup(const long n_blk){
+    struct u_fs_cbuf *b = cache.hash[cache_hash(n_blk)];
+    while(b != NULL && b->blk != n_blk){
+        b = b->hnext;
     }
-    char dirname[MAX_FILENAME + 1];
-    sscanf(path, "/%s", dirname);
+    return b;
+}
 
-	//读sb找到根目录块
-	struct u_fs_disk_block *disk_blk = malloc(sizeof(struct u_fs_disk_block));
-	if(read_disk_block(0, disk_blk) == -1){
-		printf("u_fs_mkdir(): read_disk_block failed\n");
-		return -errno;
-	}
-	long root_blk = ((struct sb*)disk_blk)->first_blk;
+static void cache_hash_remove(struct u_fs_cbuf *b){
+    struct u_fs_cbuf **pp = &cache.hash[cache_hash(b->blk)];
+    while(*pp != b){
+        pp = &(*pp)->hnext;
+    }
+    *pp = b->hnext;
+}
 
-	//遍历根目录
-    struct u_fs_file_directory *dir = (struct u_fs_file_directory *)disk_blk->data;
-    long curr_blk = 0; //目前在sb块
-    long next_blk = root_blk; //下一步想读的是根目录块
-    int offset = 0;
-    while(next_blk != -1){
-        read_disk_block(next_blk, disk_blk);
-        curr_blk = next_blk; //读完了，当前块移动到next_blk
-        next_blk = disk_blk->nNextBlock;
-        offset = 0;
-        dir = (struct u_fs_file_directory *)disk_blk->data;
-        while(offset < disk_blk->size){
-            if(strcmp(dir->fname, dirname) == 0
-            && strcmp(dir->fext, "") == 0){
-                free(disk_blk);
-                return -EEXIST; //存在同名的文件或目录
-            }
-            dir++;
-            offset += sizeof(struct u_fs_file_directory);
-        }
+/** cache_writeback()
+ * 功能：把一个脏块写回diskimg
+ * 返回：-1 失败; 0 成功
+ */
+static int cache_writeback(struct u_fs_cbuf *b){
+    if(!b->dirty){
+        return 0;
+    }
+    if(blkdev_write(b->blk, 1, b->data) == -1){
+        printf("cache_writeback(): write back block %ld failed\n", b->blk);
+        return -1;
     }
+    b->dirty = 0;
+    cache.n_dirty--;
+    cache.writebacks++;
+    return 0;
+}
 
-	/**
-	 * 遍历结束(此时没有重名)，添加新目录项给根目录，同时分配新目录空间
-	 */
-	if((offset + sizeof(struct u_fs_file_directory)) > MAX_DATA_IN_BLOCK)
-	{ //根目录的这个块刚好满了
-        long free_blk = enlarge_a_block(curr_blk, disk_blk);
-		if(free_blk == -1){
-            printf("u_fs_mkdir(): enlarge wrong!\n");
-            free(disk_blk);
-            return -errno;
-        }
-        read_disk_block(free_blk, disk_blk);
-        curr_blk = free_blk;
-        next_blk = -1;
-	}
-	//添加新目录项，并写回
-	long free_blk = -1;
-	if(get_consecutive_free_blocks(1, &free_blk) != -1){
-		printf("No more space to mk or something error!");
-		return -EPERM;
-	}
-    //在根目录添加一条新纪录
-	strcpy(dir->fname, dirname);
-	strcpy(dir->fext, "");
-	dir->fsize = BLOCK_SIZE;
-	dir->nStartBlock = free_blk;
-	dir->flag = 2; //for directory
-	disk_blk->size += sizeof(struct u_fs_file_directory);
-	write_disk_block(curr_blk, disk_blk);
-    //分配新目录空间，写回
-	read_disk_block(free_blk, disk_blk);
-	disk_blk->size = 0;
-	disk_blk->nNextBlock = -1;
-    disk_blk->data[0] = '\0';
-	write_disk_block(free_blk, disk_blk);
-	free(disk_blk);
-	return 0;
+/** cache_drop_ghost()
+ * 功能：彻底丢掉某个幽灵链表LRU端的一项
+ */
+static void cache_drop_ghost(const int list){
+    struct u_fs_cbuf *b = arc_lru(list);
+    if(b == NULL){
+        return;
+    }
+    arc_unlink(b);
+    cache_hash_remove(b);
+    b->hnext = cache.free_cbuf;
+    cache.free_cbuf = b;
 }
 
-static int u_fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-			 off_t offset, struct fuse_file_info *fi,
-			 enum fuse_readdir_flags flags)
-{
-    (void) offset;
-	(void) fi;
-	(void) flags;
-    if(strcmp(path, "/") == 0){ //读根目录
-        struct u_fs_disk_block *disk_blk = malloc(sizeof(struct u_fs_disk_block));
-        if(read_disk_block(0, disk_blk) == -1){
-            printf("u_fs_readdir(): read_disk_block failed\n");
-            return -errno;
-        }
-        long root_blk = ((struct sb*)disk_blk)->first_blk;
-        filler(buf, ".", NULL, 0, 0); //printf(".\n");
-        filler(buf, "..", NULL, 0, 0); //printf("..\n");
-        //遍历根目录
-        struct u_fs_file_directory *dir;
-        long curr_blk = 0; //目前在sb块
-        long next_blk = root_blk; //下一步想读的是根目录块
-        int offs = 0;
-        while(next_blk != -1){
-            read_disk_block(next_blk, disk_blk);
-            curr_blk = next_blk; //读完了，当前块移动到next_blk
-            next_blk = disk_blk->nNextBlock;
-            offs = 0;
-            dir = (struct u_fs_file_directory *)disk_blk->data;
-            while(offs < disk_blk->size){
-                if(strcmp(dir->fext, "") ==0){
-                    filler(buf, dir->fname, NULL, 0, 0);
-                }
-                else{
-                    char fdname[MAX_FILENAME + MAX_EXTENSION + 2];
-                    strcpy(fdname, dir->fname);
-                    strcat(fdname, ".");
-                    strcat(fdname, dir->fext);
-                    filler(buf, fdname, NULL, 0, 0);
-                }
-                dir++;
-                offs += sizeof(struct u_fs_file_directory);
-            }
-        }
-        free(disk_blk);
-        return 0;
+/** cache_evict()
+ * 功能：把驻留链表list中最靠近LRU端且没被钉住的项淘汰掉，数据缓冲区还回空闲池；
+ *      ghost为1时该项转成对应的幽灵项，否则直接丢掉。脏块写回失败的不淘汰，换下一个
+ * 返回：-1 这个链表里没有能淘汰的项; 0 成功
+ */
+static int cache_evict(const int list, const int ghost){
+    struct u_fs_cbuf *head = &cache.list[list];
+    struct u_fs_cbuf *b = head->prev;
+    while(b != head && (b->pin > 0 || b->wb || cache_writeback(b) == -1)){
+        b = b->prev;
     }
-    if(strcnt(path, '/') > 1 || strlen(path) > (MAX_FILENAME + 1)
-    || strcnt(path, '.') != 0)
-    {
-        return -ENOENT;
+    if(b == head){
+        return -1;
     }
-    char dirname[MAX_FILENAME + 1];
-    sscanf(path, "/%s", dirname);
-    struct u_fs_file_directory *tmp;
-    tmp = malloc(sizeof(struct u_fs_file_directory));
-    long curr_blk = read_stat_in_rootdir(dirname, "", tmp);
-    if(curr_blk == -1 || tmp->flag != 2){ //找不到或找到的不是目录
-        return -ENOENT;
+    arc_unlink(b);
+    cache.free_data[cache.n_free_data++] = b->data;
+    b->data = NULL;
+    cache.evictions++;
+    if(ghost){
+        arc_push_mru(list == ARC_T1 ? ARC_B1 : ARC_B2, b);
     }
-    //开始遍历指定目录
-    struct u_fs_disk_block *disk_blk = malloc(sizeof(struct u_fs_disk_block));
-    filler(buf, ".", NULL, 0, 0); //printf(".\n");
-    filler(buf, "..", NULL, 0, 0); //printf("..\n");
-    //遍历目录
-    struct u_fs_file_directory *dir;
-    //curr_blk目前在根目录块
-    long next_blk = tmp->nStartBlock; //下一步想读的是指定目录块
-    free(tmp);
-    int offs = 0;
-    while(next_blk != -1){
-        read_disk_block(next_blk, disk_blk);
-        curr_blk = next_blk; //读完了，当前块移动到next_blk
-        next_blk = disk_blk->nNextBlock;
-        offs = 0;
-        dir = (struct u_fs_file_directory *)disk_blk->data;
-        while(offs < disk_blk->size){
-            if(strcmp(dir->fext, "") ==0){
-                filler(buf, dir->fname, NULL, 0, 0);
-            }
-            else{
-                char fdname[MAX_FILENAME + MAX_EXTENSION + 2];
-                strcpy(fdname, dir->fname);
-                strcat(fdname, ".");
-                strcat(fdname, dir->fext);
-                filler(buf, fdname, NULL, 0, 0);
-            }
-            dir++;
-            offs += sizeof(struct u_fs_file_directory);
-        }
+    else{
+        cache_hash_remove(b);
+        b->hnext = cache.free_cbuf;
+        cache.free_cbuf = b;
     }
-    free(disk_blk);
     return 0;
 }
 
-static void *u_fs_init(struct fuse_conn_info *conn, struct fuse_config *cfg){
-	(void) conn;
+/** arc_replace()
+ * 功能：ARC的REPLACE，按p在T1和T2之间选一个淘汰
+ * 参数：in_b2：本次访问是否命中了B2
+ */
+static void arc_replace(const int in_b2){
+    int victim = ARC_T2;
+    if(cache.len[ARC_T1] > 0
+    && ((in_b2 && cache.len[ARC_T1] == cache.p) || cache.len[ARC_T1] > cache.p
+        || cache.len[ARC_T2] == 0)){
+        victim = ARC_T1;
+    }
+    if(cache_evict(victim, 1) == -1){ //按p该淘汰的链表里全被钉住了，只能换另一个
+        cache_evict(victim == ARC_T1 ? ARC_T2 : ARC_T1, 1);
+    }
+}
 
-	FILE *fp = NULL;
-	fp = fopen(DISKIMG_PATH, "r+");
-	if (fp == NULL) {
-		fprintf(stderr, "u_fs init unsuccessful!\n");
-		return NULL;
+/** cache_get()
+ * 功能：按ARC规则访问一个块，返回它的驻留缓存项，调用者需持有cache.lock
+ * 参数：n_blk：块号; fill：1 未命中时从diskimg读入; 0 调用者马上会覆盖整块，不用读
+ * 返回：NULL 失败; 否则为驻留的缓存项
+ */
+static struct u_fs_cbuf *cache_get(const long n_blk, const int fill){
+    struct u_fs_cbuf *b = cache_lookup(n_blk);
+    if(b != NULL && (b->list == ARC_T1 || b->list == ARC_T2)){ //命中
+        cache.hits++;
+        arc_unlink(b);
+        if(b->prefetched){ //预读进来后第一次被访问，只算访问过一次
+            b->prefetched = 0;
+            arc_push_mru(ARC_T1, b);
+        }
+        else{
+            arc_push_mru(ARC_T2, b);
+        }
+        return b;
+    }
+    cache.misses++;
+    long c = cache.capacity;
+    if(b != NULL){ //命中幽灵项，说明它被淘汰得太早了，调整p
+        cache.ghost_hits++;
+        int in_b2 = (b->list == ARC_B2);
+        if(in_b2){
+            long delta = cache.len[ARC_B1] / cache.len[ARC_B2];
+            cache.p -= delta > 1 ? delta : 1;
+            if(cache.p < 0) cache.p = 0;
+        }
+        else{
+            long delta = cache.len[ARC_B2] / cache.len[ARC_B1];
+            cache.p += delta > 1 ? delta : 1;
+            if(cache.p > c) cache.p = c;
+        }
+        arc_unlink(b);
+        if(cache.n_free_data == 0){
+            arc_replace(in_b2);
+        }
+    }
+    else{ //完全没见过的块
+        long l1 = cache.len[ARC_T1] + cache.len[ARC_B1];
+        long total = l1 + cache.len[ARC_T2] + cache.len[ARC_B2];
+        if(l1 >= c){
+            if(cache.len[ARC_T1] < c){
+                cache_drop_ghost(ARC_B1);
+                if(cache.n_free_data == 0){
+                    arc_replace(0);
+                }
+            }
+            else if(cache_evict(ARC_T1, 0) == -1){
+                arc_replace(0);
+            }
+        }
+        else if(total >= c){
+            if(total >= 2 * c){
+                cache_drop_ghost(ARC_B2);
+            }
+            if(cache.n_free_data == 0){
+                arc_replace(0);
+            }
+        }
+        b = cache.free_cbuf;
+        cache.free_cbuf = b->hnext;
+        b->blk = n_blk;
+        b->list = ARC_NLIST;
+        b->dirty = 0;
+        b->pin = 0;
+        b->wb = 0;
+        b->prefetched = 0;
+        long h = cache_hash(n_blk);
+        b->hnext = cache.hash[h];
+        cache.hash[h] = b;
+    }
+    if(cache.n_free_data == 0){ //所有驻留的块都被钉住了，或者是写不回去的脏块
+        if(cache.n_wb == 0){
+            printf("cache_get(): every cached block is pinned or cannot be written back\n");
+        }
+        if(b->list == ARC_B1 || b->list == ARC_B2){
+            arc_push_mru(b->list, b);
+        }
+        else{
+            cache_hash_remove(b);
+            b->hnext = cache.free_cbuf;
+            cache.free_cbuf = b;
+        }
+        if(cache.n_wb > 0){ //有块正在写回，等写完腾出来再试
+            pthread_cond_wait(&cache.wb_cond, &cache.lock);
+            return cache_get(n_blk, fill);
+        }
+        return NULL;
+    }
+    b->data = cache.free_data[--cache.n_free_data];
+    if(fill && blkdev_read(n_blk, 1, b->data) == -1){
+        //读失败就不要留下这个块了
+        cache.free_data[cache.n_free_data++] = b->data;
+        b->data = NULL;
+        cache_hash_remove(b);
+        b->hnext = cache.free_cbuf;
+        cache.free_cbuf = b;
+        return NULL;
+    }
+    //新进来的块放到T1，从幽灵项回来的块说明被访问了不止一次，放到T2
+    arc_push_mru(b->list == ARC_B1 || b->list == ARC_B2 ? ARC_T2 : ARC_T1, b);
+    return b;
+}
+
+static int cache_init(const long budget){
+    long c = budget / blkdev.blk_size;
+    if(c <= 0){
+        cache.capacity = 0;
+        return 0;
+    }
+    if(c < CACHE_MIN_BLOCKS){
+        c = CACHE_MIN_BLOCKS;
+    }
+    cache.capacity = c;
+    int i;
+    for(i = 0; i < ARC_NLIST; i++){
+        cache.list[i].prev = cache.list[i].next = &cache.list[i];
+        cache.len[i] = 0;
+    }
+    cache.p = 0;
+    long n_hash = 1;
+    while(n_hash < 2 * c){
+        n_hash <<= 1;
+    }
+    cache.hash_mask = n_hash - 1;
+    cache.hash = calloc(n_hash, sizeof(struct u_fs_cbuf *));
+    cache.cbufs = calloc(2 * c + 1, sizeof(struct u_fs_cbuf)); //T1+T2+B1+B2最多2c项
+    cache.free_data = malloc(c * sizeof(char *));
+    cache.slab = malloc(c * blkdev.blk_size);
+    if(cache.hash == NULL || cache.cbufs == NULL || cache.free_data == NULL || cache.slab == NULL){
+        printf("cache_init(): no memory for %ld blocks\n", c);
+        free(cache.hash);
+        free(cache.cbufs);
+        free(cache.free_data);
+        free(cache.slab);
+        cache.capacity = 0;
+        return -1;
+    }
+    long j;
+    cache.free_cbuf = NULL;
+    for(j = 0; j < 2 * c + 1; j++){
+        cache.cbufs[j].hnext = cache.free_cbuf;
+        cache.free_cbuf = &cache.cbufs[j];
+    }
+    for(j = 0; j < c; j++){
+        cache.free_data[j] = cache.slab + j * blkdev.blk_size;
+    }
+    cache.n_free_data = c;
+    return 0;
+}
+
+static void cache_destroy(void){
+    if(cache.capacity == 0){
+        return;
+    }
+    cache_sync();
+    free(cache.hash);
+    free(cache.cbufs);
+    free(cache.free_data);
+    free(cache.slab);
+    cache.capacity = 0;
+}
+
+static int cache_read_block(const long n_blk, void *buf){
+    if(cache.capacity == 0){
+        return blkdev_read(n_blk, 1, buf);
+    }
+    pthread_mutex_lock(&cache.lock);
+    cache_fill_unit(n_blk);
+    struct u_fs_cbuf *b = cache_get(n_blk, 1);
+    if(b != NULL && b->data != buf){
+        memcpy(buf, b->data, blkdev.blk_size);
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return b == NULL ? -1 : 0;
+}
+
+static int cache_write_block(const long n_blk, const void *buf){
+    if(cache.capacity == 0){
+        return blkdev_write(n_blk, 1, buf);
+    }
+    if(n_blk < 0 || n_blk >= blkdev.n_blocks){
+        printf("cache_write_block(): block %ld out of range\n", n_blk);
+        return -1;
+    }
+    pthread_mutex_lock(&cache.lock);
+    struct u_fs_cbuf *b = cache_get(n_blk, 0); //整块覆盖，不用先读
+    if(b != NULL){
+        if(b->data != buf){ //buf可能就是get_block()钉住的这个块
+            memcpy(b->data, buf, blkdev.blk_size);
+        }
+        if(!b->dirty){
+            b->dirty = 1;
+            cache.n_dirty++;
+        }
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return b == NULL ? -1 : 0;
+}
+
+/** cache_forget()
+ * 功能：把一个内容无效的驻留项彻底丢掉（不写回）
+ */
+static void cache_forget(struct u_fs_cbuf *b){
+    if(b->dirty){
+        b->dirty = 0;
+        cache.n_dirty--;
+    }
+    arc_unlink(b);
+    cache.free_data[cache.n_free_data++] = b->data;
+    b->data = NULL;
+    cache_hash_remove(b);
+    b->hnext = cache.free_cbuf;
+    cache.free_cbuf = b;
+}
+
+/** cache_prefetch_locked()
+ * 功能：cache_prefetch_blocks()和cache_fill_unit()的实现，调用者需持有cache.lock
+ * 参数：blks为NULL时预读[n_blk, n_blk + n_cnt)，否则预读blks中的n_cnt个块
+ */
+static int cache_prefetch_locked(const long *blks, const long n_blk, long n_cnt){
+    if(cache.capacity == 0 || (blks == NULL && n_blk < 0)){
+        return 0;
+    }
+    if(blks == NULL && n_blk + n_cnt > blkdev.n_blocks){
+        n_cnt = blkdev.n_blocks - n_blk;
+    }
+    if(n_cnt > cache.capacity / 4){ //一次预读不能把缓存冲掉太多
+        n_cnt = cache.capacity / 4;
+    }
+    if(n_cnt <= 0){
+        return 0;
+    }
+    struct u_fs_cbuf **got = malloc(n_cnt * sizeof(struct u_fs_cbuf *));
+    struct iovec *iov = malloc(n_cnt * sizeof(struct iovec));
+    struct u_fs_bio *bios = malloc(n_cnt * sizeof(struct u_fs_bio));
+    if(got == NULL || iov == NULL || bios == NULL){ //预读只是优化，内存不够就不读了
+        free(got);
+        free(iov);
+        free(bios);
+        return 0;
+    }
+    long n_got = 0;
+    int n_bio = 0;
+    long i;
+    for(i = 0; i < n_cnt; i++){
+        long blk = blks == NULL ? n_blk + i : blks[i];
+        if(blk < 0 || blk >= blkdev.n_blocks){
+            continue;
+        }
+        struct u_fs_cbuf *b = cache_lookup(blk);
+        if(b != NULL && (b->list == ARC_T1 || b->list == ARC_T2)){
+            continue; //已经在缓存里了
+        }
+        b = cache_get(blk, 0);
+        if(b == NULL){
+            break;
+        }
+        b->pin++; //读完之前不能被这一批后面的块挤掉
+        b->prefetched = 1;
+        iov[n_got].iov_base = b->data;
+        iov[n_got].iov_len = blkdev.blk_size;
+        if(n_got > 0 && got[n_got - 1]->blk + 1 == b->blk && bios[n_bio - 1].iovcnt < UIO_MAXIOV){
+            bios[n_bio - 1].iovcnt++;
+        }
+        else{
+            bios[n_bio].blk = b->blk;
+            bios[n_bio].iov = &iov[n_got];
+            bios[n_bio].iovcnt = 1;
+            bios[n_bio].write = 0;
+            n_bio++;
+        }
+        got[n_got++] = b;
+    }
+    int res = n_bio > 0 ? blkdev_submit(bios, n_bio) : 0;
+    for(i = 0; i < n_got; i++){
+        got[i]->pin--;
+        if(res == -1){ //读失败的块内容不可信，不能留在缓存里
+            cache_forget(got[i]);
+        }
+    }
+    free(bios);
+    free(iov);
+    free(got);
+    return res;
+}
+
+static int cache_prefetch_blocks(const long *blks, long n_cnt){
+    if(cache.capacity == 0){
+        return 0;
+    }
+    pthread_mutex_lock(&cache.lock);
+    int res = cache_prefetch_locked(blks, 0, n_cnt);
+    pthread_mutex_unlock(&cache.lock);
+    return res;
+}
+
+static void cache_fill_unit(const long n_blk){
+    if(blkdev.dio_unit <= 1){
+        return;
+    }
+    struct u_fs_cbuf *b = cache_lookup(n_blk);
+    if(b != NULL && (b->list == ARC_T1 || b->list == ARC_T2)){
+        return;
+    }
+    cache_prefetch_locked(NULL, n_blk - n_blk % blkdev.dio_unit, blkdev.dio_unit);
+}
+
+static char *cache_pin(const long n_blk, const int fill){
+    if(n_blk < 0 || n_blk >= blkdev.n_blocks){
+        printf("cache_pin(): block %ld out of range\n", n_blk);
+        return NULL;
+    }
+    pthread_mutex_lock(&cache.lock);
+    if(fill){
+        cache_fill_unit(n_blk);
+    }
+    struct u_fs_cbuf *b = cache_get(n_blk, fill);
+    char *data = NULL;
+    if(b != NULL){
+        b->pin++;
+        data = b->data;
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return data;
+}
+
+static int cache_unpin(const long n_blk, const int dirty){
+    pthread_mutex_lock(&cache.lock);
+    struct u_fs_cbuf *b = cache_lookup(n_blk);
+    if(b == NULL || b->pin == 0){
+        pthread_mutex_unlock(&cache.lock);
+        printf("cache_unpin(): block %ld is not pinned\n", n_blk);
+        return -1;
+    }
+    if(dirty && !b->dirty){
+        b->dirty = 1;
+        cache.n_dirty++;
+    }
+    b->pin--;
+    pthread_mutex_unlock(&cache.lock);
+    return 0;
+}
+
+static int cache_resident(const long n_blk){
+    if(cache.capacity == 0){
+        return 0;
+    }
+    pthread_mutex_lock(&cache.lock);
+    struct u_fs_cbuf *b = cache_lookup(n_blk);
+    int res = b != NULL && (b->list == ARC_T1 || b->list == ARC_T2) && b->data != NULL;
+    pthread_mutex_unlock(&cache.lock);
+    return res;
+}
+
+static int cmp_cbuf_blk(const void *a, const void *b){
+    long x = (*(struct u_fs_cbuf * const *)a)->blk;
+    long y = (*(struct u_fs_cbuf * const *)b)->blk;
+    return x < y ? -1 : x > y;
+}
+
+static int cache_sync(void){
+    if(cache.capacity == 0){
+        return 0;
+    }
+    //写回的时候又被改脏的块下次还要写，两次写回同时在飞的话旧的可能后落盘，所以一次只做一个
+    pthread_mutex_lock(&cache.sync_lock);
+    pthread_mutex_lock(&cache.lock);
+    if(cache.n_dirty == 0){
+        pthread_mutex_unlock(&cache.lock);
+        pthread_mutex_unlock(&cache.sync_lock);
+        return 0;
+    }
+    struct u_fs_cbuf **dirty = malloc(cache.n_dirty * sizeof(struct u_fs_cbuf *));
+    struct iovec *iov = malloc(cache.n_dirty * blkdev.dio_unit * sizeof(struct iovec));
+    struct u_fs_cbuf **wr = blkdev.dio_unit > 1 ? malloc(cache.n_dirty * blkdev.dio_unit * sizeof(struct u_fs_cbuf *))
+                                                : dirty;
+    struct u_fs_bio *bios = malloc(cache.n_dirty * blkdev.dio_unit * sizeof(struct u_fs_bio));
+    if(dirty == NULL || iov == NULL || wr == NULL || bios == NULL){
+        pthread_mutex_unlock(&cache.lock);
+        pthread_mutex_unlock(&cache.sync_lock);
+        if(wr != dirty){
+            free(wr);
+        }
+        free(dirty);
+        free(iov);
+        free(bios);
+        return -1;
+    }
+    long n = 0;
+    int l;
+    for(l = ARC_T1; l <= ARC_T2; l++){
+        struct u_fs_cbuf *b;
+        for(b = cache.list[l].next; b != &cache.list[l]; b = b->next){
+            if(b->dirty){
+                dirty[n++] = b;
+            }
+        }
+    }
+    qsort(dirty, n, sizeof(struct u_fs_cbuf *), cmp_cbuf_blk);
+    //O_DIRECT模式下把脏块所在单元里还驻留着的干净块也一起写，
+    //单元写满了blkdev_dio_rw()就不用先从diskimg读出单元的两头
+    long n_wr = n;
+    long i;
+    if(blkdev.dio_unit > 1){
+        n_wr = 0;
+        long last_unit = -1;
+        for(i = 0; i < n; i++){
+            long unit = dirty[i]->blk - dirty[i]->blk % blkdev.dio_unit;
+            if(unit == last_unit){
+                continue;
+            }
+            last_unit = unit;
+            long blk;
+            for(blk = unit; blk < unit + blkdev.dio_unit && blk < blkdev.n_blocks; blk++){
+                struct u_fs_cbuf *b = cache_lookup(blk);
+                if(b != NULL && (b->list == ARC_T1 || b->list == ARC_T2)){
+                    wr[n_wr++] = b;
+                }
+            }
+        }
+    }
+    //要写的块标成写回中，不会被淘汰，缓冲区一直有效，就可以放开cache.lock去做I/O，
+    //这期间别的线程照样能命中缓存。脏标记先清掉，写回时又被改了的块写下去的可能只有一半，
+    //但改完时会重新标脏，下次再写
+    for(i = 0; i < n_wr; i++){
+        wr[i]->wb = 1;
+    }
+    cache.n_wb += n_wr;
+    for(i = 0; i < n; i++){
+        dirty[i]->dirty = 0;
+    }
+    cache.n_dirty -= n;
+    //块号连续的一段合成一个向量请求，所有请求一次提交
+    int n_bio = 0;
+    for(i = 0; i < n_wr; i++){
+        iov[i].iov_base = wr[i]->data;
+        iov[i].iov_len = blkdev.blk_size;
+        if(i > 0 && wr[i]->blk == wr[i - 1]->blk + 1 && bios[n_bio - 1].iovcnt < UIO_MAXIOV){
+            bios[n_bio - 1].iovcnt++;
+        }
+        else{
+            bios[n_bio].blk = wr[i]->blk;
+            bios[n_bio].iov = &iov[i];
+            bios[n_bio].iovcnt = 1;
+            bios[n_bio].write = 1;
+            n_bio++;
+        }
+    }
+    pthread_mutex_unlock(&cache.lock);
+    int res = blkdev_submit(bios, n_bio);
+    pthread_mutex_lock(&cache.lock);
+    for(i = 0; i < n_wr; i++){
+        wr[i]->wb = 0;
+    }
+    cache.n_wb -= n_wr;
+    if(res == 0){
+        cache.writebacks += n;
+    }
+    else{ //没写下去，还是脏的
+        for(i = 0; i < n; i++){
+            if(!dirty[i]->dirty){
+                dirty[i]->dirty = 1;
+                cache.n_dirty++;
+            }
+        }
+    }
+    pthread_cond_broadcast(&cache.wb_cond);
+    pthread_mutex_unlock(&cache.lock);
+    pthread_mutex_unlock(&cache.sync_lock);
+    if(wr != dirty){
+        free(wr);
+    }
+    free(bios);
+    free(iov);
+    free(dirty);
+    return res;
+}
+
+/** ra_do_job()
+ * 功能：沿块链表收集job描述的一段链，整段交给cache_prefetch_blocks()读进缓存
+ */
+static void ra_do_job(struct u_fs_ra_job *job){
+    long *blks = malloc((job->cnt + 1) * sizeof(long));
+    long blk = job->blk;
+    long done = 0;
+    //文件正拿着写锁被改的话块链可能正在变，不等它，这次不预读，下次顺序读时再排
+    int locked = obj_trylock(job->start, 0) == 0;
+    if(locked && FS_VERSION == U_FS_VERSION_EXTENT){ //多换算一块，就知道下一次从哪里接着预读
+        done = file_map(job->start, job->idx, job->cnt + 1, blks, 0);
+        if(done < 0){
+            done = 0;
+        }
+        blk = -1;
+        if(done > job->cnt){
+            blk = blks[job->cnt];
+            done = job->cnt;
+        }
+    }
+    else if(locked){
+        while(done < job->cnt && blk != -1){
+            blks[done++] = blk;
+            blk = chain_next(blk);
+        }
+    }
+    if(locked){
+        obj_unlock(job->start);
+    }
+    cache_prefetch_blocks(blks, done);
+    free(blks);
+    struct u_fs_fh *fh = job->fh;
+    pthread_mutex_lock(&fh->lock);
+    fh->ra_idx = job->idx + done;
+    fh->ra_blk = blk;
+    fh->ra_pending = 0;
+    pthread_cond_broadcast(&fh->idle);
+    pthread_mutex_unlock(&fh->lock);
+}
+
+static void *ra_worker(void *arg){
+    (void) arg;
+    pthread_mutex_lock(&ra.lock);
+    while(1){
+        while(ra.n == 0 && !ra.stop){
+            pthread_cond_wait(&ra.cond, &ra.lock);
+        }
+        if(ra.n == 0){ //要停了，队列也清空了
+            break;
+        }
+        struct u_fs_ra_job job = ra.jobs[ra.head];
+        ra.head = (ra.head + 1) % RA_QUEUE;
+        ra.n--;
+        pthread_mutex_unlock(&ra.lock);
+        ra_do_job(&job);
+        pthread_mutex_lock(&ra.lock);
+    }
+    pthread_mutex_unlock(&ra.lock);
+    return NULL;
+}
+
+static int ra_init(const long max_bytes){
+    ra.max_window = max_bytes >> BLOCK_SHIFT;
+    if(ra.max_window < RA_MIN_WINDOW || cache.capacity == 0){ //没有块缓存的话预读的块也没地方放
+        ra.max_window = 0;
+        return 0;
+    }
+    ra.stop = 0;
+    ra.head = ra.n = 0;
+    if(pthread_create(&ra.thread, NULL, ra_worker, NULL) != 0){
+        printf("ra_init(): create readahead thread failed\n");
+        ra.max_window = 0;
+        return -1;
+    }
+    ra.running = 1;
+    return 0;
+}
+
+static void ra_exit(void){
+    if(!ra.running){
+        return;
+    }
+    pthread_mutex_lock(&ra.lock);
+    ra.stop = 1;
+    pthread_cond_signal(&ra.cond);
+    pthread_mutex_unlock(&ra.lock);
+    pthread_join(ra.thread, NULL);
+    ra.running = 0;
+    ra.max_window = 0;
+}
+
+static void ra_update(struct u_fs_fh *fh, const off_t offset, const size_t size, const long next_blk){
+    if(fh == NULL || !ra.running || size == 0){
+        return;
+    }
+    long last_idx = (offset + size - 1) >> BLOCK_SHIFT; //这次读到的最后一块是文件的第几块
+    pthread_mutex_lock(&fh->lock);
+    int seq = (offset == fh->ra_next_off);
+    fh->ra_next_off = offset + size;
+    if(!seq){ //随机访问，窗口减半，已经排好的预读位置也作废
+        fh->ra_window /= 2;
+        if(fh->ra_window < RA_MIN_WINDOW){
+            fh->ra_window = RA_MIN_WINDOW;
+        }
+        if(!fh->ra_pending){
+            fh->ra_idx = -1;
+        }
+        pthread_mutex_unlock(&fh->lock);
+        return;
+    }
+    if(fh->ra_pending){ //上一个任务还没做完，等它报告链走到了哪里
+        pthread_mutex_unlock(&fh->lock);
+        return;
+    }
+    if(fh->ra_idx <= last_idx){ //预读被追上了（或者还没开始），从这次读完的地方开始
+        fh->ra_idx = last_idx + 1;
+        fh->ra_blk = next_blk;
+    }
+    if(fh->ra_blk == -1 || fh->ra_idx - last_idx > fh->ra_window / 2){
+        pthread_mutex_unlock(&fh->lock);
+        return;
+    }
+    struct u_fs_ra_job job = { fh, fh->start, fh->ra_blk, fh->ra_idx, fh->ra_window };
+    fh->ra_window *= 2; //持续顺序读，下一次预读得更多
+    if(fh->ra_window > ra.max_window){
+        fh->ra_window = ra.max_window;
+    }
+    pthread_mutex_lock(&ra.lock);
+    if(ra.n == RA_QUEUE){
+        ra.dropped++;
+    }
+    else{
+        ra.jobs[(ra.head + ra.n) % RA_QUEUE] = job;
+        ra.n++;
+        ra.issued++;
+        fh->ra_pending = 1;
+        pthread_cond_signal(&ra.cond);
+    }
+    pthread_mutex_unlock(&ra.lock);
+    pthread_mutex_unlock(&fh->lock);
+}
+
+static int cache_stat(char *buf, const size_t size){
+    pthread_mutex_lock(&cache.lock);
+    int n = snprintf(buf, size,
+        "capacity=%ld block_size=%ld resident=%ld t1=%ld t2=%ld b1=%ld b2=%ld p=%ld dirty=%ld "
+        "hits=%lu misses=%lu ghost_hits=%lu evictions=%lu writebacks=%lu\n",
+        cache.capacity, blkdev.blk_size, cache.len[ARC_T1] + cache.len[ARC_T2],
+        cache.len[ARC_T1], cache.len[ARC_T2], cache.len[ARC_B1], cache.len[ARC_B2], cache.p,
+        cache.n_dirty, cache.hits, cache.misses, cache.ghost_hits, cache.evictions, cache.writebacks);
+    pthread_mutex_unlock(&cache.lock);
+    return n;
+}
+
+static char *get_block(const long n_blk, const int fill){
+    if(n_blk < 0 || n_blk >= blkdev.n_blocks){
+        printf("get_block(): block %ld out of range\n", n_blk);
+        return NULL;
+    }
+    if(blkdev.map != NULL){
+        return blkdev.map + (off_t)n_blk * blkdev.blk_size;
+    }
+    if(cache.capacity > 0){
+        return cache_pin(n_blk, fill);
+    }
+    //既没有映射也没有缓存，只能临时申请一块
+    char *disk_blk = malloc(blkdev.blk_size);
+    if(fill && blkdev_read(n_blk, 1, disk_blk) == -1){
+        free(disk_blk);
+        return NULL;
+    }
+    return disk_blk;
+}
+
+static int put_block(const long n_blk, char *disk_blk, const int dirty){
+    if(blkdev.map != NULL){
+        if(dirty){
+            blkdev_map_dirty(n_blk, 1);
+        }
+        return 0;
+    }
+    if(cache.capacity > 0){
+        return cache_unpin(n_blk, dirty);
+    }
+    int res = dirty ? blkdev_write(n_blk, 1, disk_blk) : 0;
+    free(disk_blk);
+    return res;
+}
+
+static int read_disk_block(long num_block, void *disk_block){
+    if(cache_read_block(num_block, disk_block) == -1){
+        printf("read_disk_block(): read block %ld failed\n", num_block);
+        return -1;
+    }
+    return 0;
+}
+
+static int write_disk_block(long num_block, const void *disk_block){
+    if(cache_write_block(num_block, disk_block) == -1){
+        printf("write_disk_block(): write block %ld failed\n", num_block);
+        return -1;
+    }
+    return 0;
+}
+
+static int load_superblock(const char *path){
+    int fd = open(path, O_RDONLY);
+    if(fd == -1){
+        perror("load_superblock(): open diskimg failed");
+        return -1;
+    }
+    struct sb sblk;
+    memset(&sblk, 0, sizeof(sblk));
+    ssize_t n = pread(fd, &sblk, sizeof(sblk), 0); //超级块总在diskimg的开头，和块大小无关
+    close(fd);
+    if(n != sizeof(sblk)){
+        printf("load_superblock(): read super block failed\n");
+        return -1;
+    }
+    if(sblk.magic != U_FS_MAGIC
+    || (sblk.version != U_FS_VERSION_CHAIN && sblk.version != U_FS_VERSION_EXTENT)){
+        printf("load_superblock(): %s is not a version %d or %d u_fs image, format it with diskimg_init\n",
+               path, U_FS_VERSION_CHAIN, U_FS_VERSION_EXTENT);
+        return -1;
+    }
+    if(sblk.block_size < BLOCK_SIZE_MIN || sblk.block_size > BLOCK_SIZE_MAX
+    || (sblk.block_size & (sblk.block_size - 1)) != 0){
+        printf("load_superblock(): bad block size %ld\n", sblk.block_size);
+        return -1;
+    }
+    if(sblk.dir_version != 0 && sblk.dir_version != U_FS_DIRENT_PACKED){
+        printf("load_superblock(): unknown directory entry format %ld\n", sblk.dir_version);
+        return -1;
+    }
+    if(sblk.chain_size * (sblk.block_size / (long)sizeof(struct u_fs_chain)) < sblk.fs_size){
+        printf("load_superblock(): chain table too small\n");
+        return -1;
+    }
+    NUM_TOTAL_BLOCK = sblk.fs_size;
+    BLOCK_SIZE = sblk.block_size;
+    BLOCK_SHIFT = 0;
+    while((1L << BLOCK_SHIFT) < BLOCK_SIZE){
+        BLOCK_SHIFT++;
+    }
+    NUM_BITMAP_BLOCK = sblk.bitmap;
+    CHAIN_START_BLOCK = sblk.chain_blk;
+    NUM_CHAIN_BLOCK = sblk.chain_size;
+    ROOT_DIR_BLOCK = sblk.first_blk;
+    FS_VERSION = sblk.version;
+    FS_FEATURES = sblk.features;
+    DIR_VERSION = sblk.dir_version;
+    DIRENT_SIZE = DIR_VERSION == U_FS_DIRENT_PACKED ? (long)sizeof(struct u_fs_dirent)
+                                                    : (long)sizeof(struct u_fs_file_directory);
+    return 0;
+}
+
+static int chain_get(const long n_blk, struct u_fs_chain *ch){
+    if(n_blk < 0 || n_blk >= NUM_TOTAL_BLOCK){
+        printf("chain_get(): block %ld out of range\n", n_blk);
+        return -1;
+    }
+    *ch = chaintab.tab[n_blk];
+    return 0;
+}
+
+static int chain_set(const long n_blk, const struct u_fs_chain *ch){
+    if(n_blk < 0 || n_blk >= NUM_TOTAL_BLOCK){
+        printf("chain_set(): block %ld out of range\n", n_blk);
+        return -1;
+    }
+    pthread_mutex_lock(&alloc_lock);
+    chaintab.tab[n_blk] = *ch;
+    long i = n_blk / (BLOCK_SIZE / sizeof(struct u_fs_chain)); //第几个块链表块
+    if(!chaintab.dirty[i]){
+        chaintab.dirty[i] = 1;
+        chaintab.n_dirty++;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    return 0;
+}
+
+static long chain_next(const long n_blk){
+    if(n_blk < 0 || n_blk >= NUM_TOTAL_BLOCK){
+        printf("chain_next(): block %ld out of range\n", n_blk);
+        return -1;
+    }
+    return chaintab.tab[n_blk].next;
+}
+
+static int chain_load(void){
+    chaintab.tab = malloc(NUM_CHAIN_BLOCK * BLOCK_SIZE);
+    chaintab.dirty = calloc(NUM_CHAIN_BLOCK, 1);
+    chaintab.n_dirty = 0;
+    if(chaintab.tab == NULL || chaintab.dirty == NULL
+    || blkdev_read(CHAIN_START_BLOCK, NUM_CHAIN_BLOCK, chaintab.tab) == -1){
+        printf("chain_load(): load chain table failed\n");
+        free(chaintab.tab);
+        free(chaintab.dirty);
+        chaintab.tab = NULL;
+        chaintab.dirty = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static int chain_sync(void){
+    int res = 0;
+    pthread_mutex_lock(&alloc_lock);
+    long i;
+    for(i = 0; i < NUM_CHAIN_BLOCK && chaintab.n_dirty > 0; i++){
+        if(!chaintab.dirty[i]){
+            continue;
+        }
+        if(cache_write_block(CHAIN_START_BLOCK + i, (char *)chaintab.tab + i * BLOCK_SIZE) == -1){
+            res = -1;
+            break;
+        }
+        chaintab.dirty[i] = 0;
+        chaintab.n_dirty--;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    return res;
+}
+
+static void chain_destroy(void){
+    if(chaintab.tab == NULL){
+        return;
+    }
+    if(chain_sync() == -1){ //还要接着释放，块链表改过的部分就丢了
+        printf("chain_destroy(): write back chain table failed\n");
+    }
+    free(chaintab.tab);
+    free(chaintab.dirty);
+    chaintab.tab = NULL;
+    chaintab.dirty = NULL;
+}
+
+static int ext_reserve(struct u_fs_extmap *m, const long cap){
+    if(cap <= m->cap){
+        return 0;
+    }
+    long n_cap = m->cap > 0 ? m->cap * 2 : 16;
+    while(n_cap < cap){
+        n_cap *= 2;
+    }
+    struct u_fs_extent *ext = realloc(m->ext, n_cap * sizeof(struct u_fs_extent));
+    if(ext == NULL){
+        return -1;
+    }
+    m->ext = ext;
+    m->cap = n_cap;
+    return 0;
+}
+
+static int ext_load(const long idx_blk, struct u_fs_extmap *m){
+    m->ext = NULL;
+    m->n = 0;
+    m->cap = 0;
+    long blk = idx_blk;
+    while(blk != -1){
+        char *disk_blk = get_block(blk, 1);
+        if(disk_blk == NULL){
+            ext_release(m);
+            return -1;
+        }
+        struct u_fs_ext_head *head = (struct u_fs_ext_head *)disk_blk;
+        long n_ext = head->n_ext;
+        if(n_ext < 0 || n_ext > EXT_PER_BLOCK || ext_reserve(m, m->n + n_ext) == -1){
+            printf("ext_load(): bad extent index block %ld\n", blk);
+            put_block(blk, disk_blk, 0);
+            ext_release(m);
+            return -1;
+        }
+        if(n_ext > 0){
+            memcpy(m->ext + m->n, head + 1, n_ext * sizeof(struct u_fs_extent));
+            m->n += n_ext;
+        }
+        long next = head->next;
+        put_block(blk, disk_blk, 0);
+        blk = next;
+    }
+    return 0;
+}
+
+static int ext_store(const long idx_blk, const struct u_fs_extmap *m){
+    long blk = idx_blk;
+    long done = 0;
+    while(1){
+        char *disk_blk = get_block(blk, 1);
+        if(disk_blk == NULL){
+            return -1;
+        }
+        struct u_fs_ext_head *head = (struct u_fs_ext_head *)disk_blk;
+        long old_next = head->next;
+        long n_ext = m->n - done < EXT_PER_BLOCK ? m->n - done : EXT_PER_BLOCK;
+        head->n_ext = n_ext;
+        head->reserved = 0;
+        memcpy(head + 1, m->ext + done, n_ext * sizeof(struct u_fs_extent));
+        done += n_ext;
+        if(done == m->n){ //写完了，后面多出来的索引块不要了
+            head->next = -1;
+            put_block(blk, disk_blk, 1);
+            while(old_next != -1){
+                long next = -1;
+                char *old_blk = get_block(old_next, 1);
+                if(old_blk != NULL){
+                    next = ((struct u_fs_ext_head *)old_blk)->next;
+                    put_block(old_next, old_blk, 0);
+                }
+                set_single_bit_in_bitmap(old_next, 0);
+                old_next = next;
+            }
+            return 0;
+        }
+        if(old_next == -1){ //还有extent没写，索引块不够了
+            if(get_consecutive_free_blocks(1, &old_next) != -1){
+                put_block(blk, disk_blk, 1);
+                return -1;
+            }
+            char *new_blk = get_block(old_next, 0);
+            if(new_blk == NULL){
+                put_block(blk, disk_blk, 1);
+                return -1;
+            }
+            memset(new_blk, 0, BLOCK_SIZE);
+            ((struct u_fs_ext_head *)new_blk)->next = -1;
+            put_block(old_next, new_blk, 1);
+        }
+        head->next = old_next;
+        put_block(blk, disk_blk, 1);
+        blk = old_next;
+    }
+}
+
+static void ext_release(struct u_fs_extmap *m){
+    free(m->ext);
+    m->ext = NULL;
+    m->n = 0;
+    m->cap = 0;
+}
+
+static long ext_lookup(const struct u_fs_extmap *m, const long lblk){
+    long lo = 0;
+    long hi = m->n - 1;
+    while(lo <= hi){
+        long mid = (lo + hi) / 2;
+        const struct u_fs_extent *e = &m->ext[mid];
+        if(lblk < e->lblk){
+            hi = mid - 1;
+        }
+        else if(lblk >= e->lblk + e->len){
+            lo = mid + 1;
+        }
+        else{
+            return mid;
+        }
+    }
+    return -1;
+}
+
+static long ext_after(const struct u_fs_extmap *m, const long lblk){
+    long lo = 0;
+    long hi = m->n;
+    while(lo < hi){
+        long mid = (lo + hi) / 2;
+        if(m->ext[mid].lblk <= lblk){
+            lo = mid + 1;
+        }
+        else{
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static long ext_fill(struct u_fs_extmap *m, const long lblk, const long lend){
+    pthread_mutex_lock(&alloc_lock); //最长空闲段的长度要和接下来的分配一致
+    long got = ext_fill_locked(m, lblk, lend);
+    pthread_mutex_unlock(&alloc_lock);
+    return got;
+}
+
+static long ext_fill_locked(struct u_fs_extmap *m, const long lblk, const long lend){
+    long pos = lblk;
+    long got = 0;
+    long k = 0; //第一个结束在pos后面的extent
+    while(pos < lend){
+        while(k < m->n && m->ext[k].lblk + m->ext[k].len <= pos){
+            k++;
+        }
+        if(k < m->n && m->ext[k].lblk <= pos){ //这里已经有块了
+            pos = m->ext[k].lblk + m->ext[k].len;
+            continue;
+        }
+        //[pos, gap)没有块
+        long gap = k < m->n && m->ext[k].lblk < lend ? m->ext[k].lblk : lend;
+        if(k < m->n){
+            BMAP_GEN_BUMP(); //填的是空洞，打开的文件的块号表里这里还是-1
+        }
+        long need = gap - pos;
+        struct u_fs_extent *prev = k > 0 ? &m->ext[k - 1] : NULL;
+        if(prev != NULL && prev->lblk + prev->len == pos){ //先试着紧接在前一段后面
+            long n = bitmap_alloc_at(prev->start + prev->len, need);
+            if(n > 0){
+                prev->len += n;
+                pos += n;
+                got += n;
+                continue;
+            }
+        }
+        //另起一段，最长的空闲段都不够的话先拿最长的那一段
+        long want = need < bitmap.tree[1].max ? need : bitmap.tree[1].max;
+        long start = -1;
+        if(want == 0 || get_consecutive_free_blocks(want, &start) != -1){
+            return -1;
+        }
+        if(ext_reserve(m, m->n + 1) == -1){
+            bitmap_set_range(start, want, 0);
+            return -1;
+        }
+        memmove(&m->ext[k + 1], &m->ext[k], (m->n - k) * sizeof(struct u_fs_extent));
+        m->n++;
+        m->ext[k].lblk = pos;
+        m->ext[k].start = start;
+        m->ext[k].len = want;
+        k++;
+        pos += want;
+        got += want;
+    }
+    return got;
+}
+
+static int ext_free(const long idx_blk){
+    struct u_fs_extmap m;
+    if(ext_load(idx_blk, &m) == -1){
+        return -1;
+    }
+    BMAP_GEN_BUMP(); //打开的文件的块号表可能过时了
+    long i;
+    for(i = 0; i < m.n; i++){
+        bitmap_set_range(m.ext[i].start, m.ext[i].len, 0);
+    }
+    ext_release(&m);
+    long blk = idx_blk;
+    while(blk != -1){ //索引块
+        long next = -1;
+        char *disk_blk = get_block(blk, 1);
+        if(disk_blk != NULL){
+            next = ((struct u_fs_ext_head *)disk_blk)->next;
+            put_block(blk, disk_blk, 0);
+        }
+        set_single_bit_in_bitmap(blk, 0);
+        blk = next;
+    }
+    return 0;
+}
+
+static int strcnt(const char* str, const char ch){
+	int cnt = 0;
+	while(*str){
+		if(*str == ch) ++cnt;
+		++str;
+	}
+	return cnt;
+}
+
+static int check_path(const char * const path, char * const dirname,
+                    char * const fname, char * const fext){
+    if(strcmp(path, "/") == 0){
+        return 0; //指根目录
+    }
+    if(strlen(path) <= 1){
+        return -1; //路径不正确
+    }
+    int res = strcnt(path, '/');
+    if(res == 1){
+        int cnt = strcnt(path, '.');
+        if(cnt == 0){
+            sscanf(path, "/%s", fname);
+            strcpy(fext, "");
+            strcpy(dirname, "");
+            if(strlen(fname) > MAX_FILENAME){
+                return -2; //文件名过长
+            }
+            return 1; //根目录下，不带后缀名的文件或目录
+        }
+        else if(cnt == 1){
+            sscanf(path, "/%[^.].%s", fname, fext);
+            strcpy(dirname, "");
+            if(strlen(fname) > MAX_FILENAME 
+            || strlen(fext) > MAX_EXTENSION){
+                return -2; //文件名过长
+            }
+            return 1; //根目录下，带后缀的文件
+        }
+        return -1; //路径有误
+    }
+    else if(res == 2){
+        sscanf(path, "/%[^/]", dirname);
+        if(strcnt(dirname, '.') != 0){
+            return -1; //目录名不能带.
+        }
+        if(strlen(dirname) > MAX_FILENAME){
+            return -2; //目录名过长
+        }
+        int cnt = strcnt(path, '.');
+        if(cnt == 0){
+            sscanf(path, "/%[^/]/%s", dirname, fname);
+            strcpy(fext, "");
+            if(strlen(fname) > MAX_FILENAME){
+                return -2; //文件名过长
+            }
+            return 2;
+        }
+        else if(cnt == 1){
+            sscanf(path, "/%[^/]/%[^.].%s", dirname, fname, fext);
+            if(strlen(fname) > MAX_FILENAME 
+            || strlen(fext) > MAX_EXTENSION){
+                return -2; //文件名过长
+            }
+            if(strlen(fname) == 0){
+                //文件名不能为空
+                return -1; 
+            }
+            return 2;
+        }
+        return -1; //路径不正确
+    }
+    return -1;//路径不正确
+}
+
+static long read_stat_in_rootdir(const char* const fname, const char * const fext, 
+                                struct u_fs_file_directory* f_dir){
+    //you have to ensure that is under rootdir
+    return read_stat_from_block(fname, fext, ROOT_DIR_BLOCK, f_dir);
+}
+
+static uint32_t dir_hash(const char *fname, const char *fext){
+    uint32_t h = 2166136261u; //FNV-1a
+    const char *c;
+    for(c = fname; *c; c++){
+        h = (h ^ (unsigned char)*c) * 16777619u;
+    }
+    h = (h ^ '.') * 16777619u;
+    for(c = fext; *c; c++){
+        h = (h ^ (unsigned char)*c) * 16777619u;
+    }
+    //FNV的低位只是各字符低位的异或，按低位分桶前再搅一下
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return h;
+}
+
+static struct u_fs_dentry **dcache_bucket(const long dir, const char *fname, const char *fext){
+    uint32_t h = dir_hash(fname, fext) ^ ((uint32_t)dir * 2654435761u);
+    return &dcache.bucket[h & (DCACHE_BUCKETS - 1)];
+}
+
+//拿着dcache.lock调用
+static struct u_fs_dentry *dcache_find(const long dir, const char *fname, const char *fext){
+    struct u_fs_dentry *de;
+    for(de = *dcache_bucket(dir, fname, fext); de != NULL; de = de->next){
+        if(de->dir == dir && strcmp(de->fname, fname) == 0 && strcmp(de->fext, fext) == 0){
+            return de;
+        }
+    }
+    return NULL;
+}
+
+static int dcache_get(const long dir, const char *fname, const char *fext, long *blk, long *slot){
+    pthread_mutex_lock(&dcache.lock);
+    struct u_fs_dentry *de = dcache_find(dir, fname, fext);
+    if(de != NULL){
+        *blk = de->blk;
+        *slot = de->slot;
+    }
+    pthread_mutex_unlock(&dcache.lock);
+    return de != NULL;
+}
+
+//拿着dcache.lock调用
+static void dcache_free_all(void){
+    long i;
+    for(i = 0; i < DCACHE_BUCKETS; i++){
+        while(dcache.bucket[i] != NULL){
+            struct u_fs_dentry *de = dcache.bucket[i];
+            dcache.bucket[i] = de->next;
+            free(de);
+        }
+    }
+    dcache.n = 0;
+}
+
+static void dcache_set(const long dir, const char *fname, const char *fext, const long blk, const long slot){
+    pthread_mutex_lock(&dcache.lock);
+    struct u_fs_dentry *de = dcache_find(dir, fname, fext);
+    if(de == NULL){
+        if(dcache.n >= DCACHE_MAX){
+            dcache_free_all();
+        }
+        de = malloc(sizeof(struct u_fs_dentry));
+        if(de == NULL){
+            pthread_mutex_unlock(&dcache.lock);
+            return;
+        }
+        struct u_fs_dentry **head = dcache_bucket(dir, fname, fext);
+        de->dir = dir;
+        strcpy(de->fname, fname);
+        strcpy(de->fext, fext);
+        de->next = *head;
+        *head = de;
+        dcache.n++;
+    }
+    de->blk = blk;
+    de->slot = slot;
+    pthread_mutex_unlock(&dcache.lock);
+}
+
+static void dcache_clear(void){
+    pthread_mutex_lock(&dcache.lock);
+    dcache_free_all();
+    pthread_mutex_unlock(&dcache.lock);
+}
+
+static int obj_lock(const long start, const int write){
+    pthread_mutex_lock(&olocks.lock);
+    struct u_fs_olock **head = &olocks.bucket[((uint32_t)start * 2654435761u) & (OLOCK_BUCKETS - 1)];
+    struct u_fs_olock *ol;
+    for(ol = *head; ol != NULL && ol->start != start; ol = ol->next){
+    }
+    if(ol == NULL){
+        ol = malloc(sizeof(struct u_fs_olock));
+        if(ol == NULL){
+            pthread_mutex_unlock(&olocks.lock);
+            return -1;
+        }
+        ol->start = start;
+        ol->refs = 0;
+        pthread_rwlock_init(&ol->rw, NULL);
+        ol->next = *head;
+        *head = ol;
+    }
+    ol->refs++; //记上自己，等锁的时候这一项不会被删掉
+    pthread_mutex_unlock(&olocks.lock);
+    if(write){
+        pthread_rwlock_wrlock(&ol->rw);
+    }
+    else{
+        pthread_rwlock_rdlock(&ol->rw);
+    }
+    return 0;
+}
+
+static int obj_trylock(const long start, const int write){
+    pthread_mutex_lock(&olocks.lock);
+    struct u_fs_olock **head = &olocks.bucket[((uint32_t)start * 2654435761u) & (OLOCK_BUCKETS - 1)];
+    struct u_fs_olock *ol;
+    for(ol = *head; ol != NULL && ol->start != start; ol = ol->next){
+    }
+    int res = -1;
+    if(ol == NULL){ //没人用，一定拿得到
+        ol = malloc(sizeof(struct u_fs_olock));
+        if(ol != NULL){
+            ol->start = start;
+            ol->refs = 0;
+            pthread_rwlock_init(&ol->rw, NULL);
+            ol->next = *head;
+            *head = ol;
+        }
+    }
+    if(ol != NULL){
+        res = write ? pthread_rwlock_trywrlock(&ol->rw) : pthread_rwlock_tryrdlock(&ol->rw);
+        if(res == 0){
+            ol->refs++;
+        }
+        else if(ol->refs == 0){ //上面刚建的
+            *head = ol->next;
+            pthread_rwlock_destroy(&ol->rw);
+            free(ol);
+        }
+    }
+    pthread_mutex_unlock(&olocks.lock);
+    return res == 0 ? 0 : -1;
+}
+
+static void obj_unlock(const long start){
+    pthread_mutex_lock(&olocks.lock);
+    struct u_fs_olock **pp = &olocks.bucket[((uint32_t)start * 2654435761u) & (OLOCK_BUCKETS - 1)];
+    while(*pp != NULL && (*pp)->start != start){
+        pp = &(*pp)->next;
+    }
+    struct u_fs_olock *ol = *pp;
+    if(ol == NULL){
+        pthread_mutex_unlock(&olocks.lock);
+        printf("obj_unlock(): %ld is not locked\n", start);
+        return;
+    }
+    pthread_rwlock_unlock(&ol->rw);
+    if(--ol->refs == 0){
+        *pp = ol->next;
+        pthread_rwlock_destroy(&ol->rw);
+        free(ol);
+    }
+    pthread_mutex_unlock(&olocks.lock);
+}
+
+static long dir_lock(const char *dirname, const int write){
+    struct u_fs_file_directory item;
+    while(1){
+        if(read_stat_in_rootdir(dirname, "", &item) == -1 || item.flag != 2){
+            return -1;
+        }
+        long dir = item.nStartBlock;
+        if(obj_lock(dir, write) == -1){
+            return -2;
+        }
+        //拿锁之前目录可能被删掉了，第一块还可能分给了同名的新目录
+        if(read_stat_in_rootdir(dirname, "", &item) != -1 && item.flag == 2 && item.nStartBlock == dir){
+            return dir;
+        }
+        obj_unlock(dir);
+    }
+}
+
+static long file_lock(const char *path, struct u_fs_fh *fh, struct u_fs_file_directory *f_dir,
+                      long *dir, int mode){
+    const int by_fh = fh != NULL && fh->dir != -1;
+    while(1){
+        long res;
+        long start = fh != NULL ? fh->start : -1;
+        if(!by_fh){
+            res = lookup_path(path, f_dir, dir);
+            if(res < 0){
+                return res == -2 ? -ENAMETOOLONG : -ENOENT;
+            }
+            start = f_dir->nStartBlock;
+        }
+        if(obj_lock(start, mode != OLOCK_READ) == -1){
+            return -ENOENT;
+        }
+        if(by_fh){ //打开的文件被删掉了就是删掉了，不会换成同名的新文件
+            res = fh_entry(fh, f_dir);
+            if(dir != NULL){
+                *dir = fh->dir;
+            }
+            if(res == -1){
+                obj_unlock(start);
+                return -ENOENT;
+            }
+        }
+        else{
+            res = lookup_path(path, f_dir, dir);
+            if(res < 0 || f_dir->nStartBlock != start){ //拿锁的时候被删掉或者换了一个文件
+                obj_unlock(start);
+                continue;
+            }
+        }
+        off_t end = f_dir->flag == 1 ? dalloc_end(start) : 0;
+        if(end > 0 && mode == OLOCK_READ){ //有攒着的数据，换成写锁提交掉
+            obj_unlock(start);
+            mode = OLOCK_SYNC;
+            continue;
+        }
+        if(end > 0 && mode == OLOCK_SYNC){
+            if(dalloc_commit(start) == -1){
+                obj_unlock(start);
+                return -EIO;
+            }
+            res = by_fh ? fh_entry(fh, f_dir) : lookup_path(path, f_dir, dir);
+            if(res < 0){ //拿着文件的锁，不会被删掉
+                obj_unlock(start);
+                return -EIO;
+            }
+        }
+        return res;
+    }
+}
+
+static long fh_entry(struct u_fs_fh *fh, struct u_fs_file_directory *f_dir){
+    if(obj_lock(fh->dir, 0) == -1){
+        return -1;
+    }
+    pthread_mutex_lock(&fh->lock);
+    long ent_blk = fh->ent_blk;
+    long ent_slot = fh->ent_slot;
+    pthread_mutex_unlock(&fh->lock);
+    long blk = -1;
+    struct u_fs_chain ch;
+    char *disk_blk;
+    if(ent_blk != -1 && chain_get(ent_blk, &ch) == 0
+    && (ent_slot + 1) * DIRENT_SIZE <= ch.used
+    && (disk_blk = get_block(ent_blk, 1)) != NULL){
+        char *de = disk_blk + ent_slot * DIRENT_SIZE;
+        if(dirent_match(de, fh->fname, fh->fext, dir_hash(fh->fname, fh->fext))){
+            dirent_load(de, f_dir);
+            blk = ent_blk;
+        }
+        put_block(ent_blk, disk_blk, 0);
+    }
+    if(blk == -1){ //被挪走了，按名字再找一次，一般目录项缓存里有
+        blk = dir_lookup(fh->fname, fh->fext, fh->dir, f_dir);
+        ent_blk = -1;
+        if(blk != -1 && dcache_get(fh->dir, fh->fname, fh->fext, &ent_blk, &ent_slot) && ent_blk != blk){
+            ent_blk = -1;
+        }
+        pthread_mutex_lock(&fh->lock);
+        fh->ent_blk = ent_blk;
+        fh->ent_slot = ent_slot;
+        pthread_mutex_unlock(&fh->lock);
+    }
+    obj_unlock(fh->dir);
+    if(blk != -1 && f_dir->nStartBlock != fh->start){ //文件删掉以后又建了一个同名的
+        return -1;
+    }
+    return blk;
+}
+
+static int fh_store(struct u_fs_fh *fh, struct u_fs_file_directory const * const f_dir){
+    if(obj_lock(fh->dir, 1) == -1){
+        return -1;
+    }
+    pthread_mutex_lock(&fh->lock);
+    long ent_blk = fh->ent_blk;
+    long ent_slot = fh->ent_slot;
+    pthread_mutex_unlock(&fh->lock);
+    int done = 0;
+    struct u_fs_chain ch;
+    char *disk_blk;
+    if(ent_blk != -1 && chain_get(ent_blk, &ch) == 0
+    && (ent_slot + 1) * DIRENT_SIZE <= ch.used
+    && (disk_blk = get_block(ent_blk, 1)) != NULL){
+        char *de = disk_blk + ent_slot * DIRENT_SIZE;
+        struct u_fs_file_directory old;
+        if(dirent_match(de, f_dir->fname, f_dir->fext, dir_hash(f_dir->fname, f_dir->fext))){
+            dirent_load(de, &old);
+            if(old.nStartBlock == f_dir->nStartBlock){ //直接改块里的这一项，不用整块拷出来再写回
+                dirent_store(de, f_dir);
+                done = 1;
+            }
+        }
+        put_block(ent_blk, disk_blk, done);
+    }
+    obj_unlock(fh->dir);
+    return done ? 0 : write_stat_from_block(fh->dir, f_dir);
+}
+
+static long read_stat_from_block(const char* const fname, const char* const fext, 
+                                        const long blk, struct u_fs_file_directory* f_dir)
+{
+    if(obj_lock(blk, 0) == -1){
+        return -1;
+    }
+    long res = dir_lookup(fname, fext, blk, f_dir);
+    obj_unlock(blk);
+    return res;
+}
+
+static long dir_lookup(const char* const fname, const char* const fext,
+                       const long blk, struct u_fs_file_directory* f_dir)
+{
+    //you have to ensure that block not wrong
+    //目录块直接用get_block()拿指针来扫描，不用每块都拷贝一次
+    char *disk_blk;
+    struct u_fs_chain ch;
+    const uint32_t hash = dir_hash(fname, fext);
+    long de_blk;
+    long de_slot;
+    int cached = dcache_get(blk, fname, fext, &de_blk, &de_slot);
+    if(cached && de_blk == -1){
+        __atomic_add_fetch(&dcache.hits, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    if(cached && chain_get(de_blk, &ch) == 0
+    && (de_slot + 1) * DIRENT_SIZE <= ch.used
+    && (disk_blk = get_block(de_blk, 1)) != NULL){
+        int same = dirent_match(disk_blk + de_slot * DIRENT_SIZE, fname, fext, hash);
+        if(same){
+            dirent_load(disk_blk + de_slot * DIRENT_SIZE, f_dir);
+        }
+        put_block(de_blk, disk_blk, 0);
+        if(same){
+            __atomic_add_fetch(&dcache.hits, 1, __ATOMIC_RELAXED);
+            return de_blk;
+        }
+        //对不上就当没记过，下面重新扫一遍
+    }
+    __atomic_add_fetch(&dcache.misses, 1, __ATOMIC_RELAXED);
+    long curr_blk = -1; //目前在sb块
+    long next_blk = dir_chain(blk, fname, fext); //下一步想读的块，有索引时是名字所在的桶
+    int offset = 0;
+    while(next_blk != -1){
+        curr_blk = next_blk; //读完了，当前块移动到next_blk
+        if(chain_get(curr_blk, &ch) == -1 || (disk_blk = get_block(curr_blk, 1)) == NULL){
+            return -1;
+        }
+        next_blk = ch.next;
+        offset = 0;
+        while(offset < ch.used){
+            if(dirent_match(disk_blk + offset, fname, fext, hash)){
+                dirent_load(disk_blk + offset, f_dir);
+                put_block(curr_blk, disk_blk, 0);
+                dcache_set(blk, fname, fext, curr_blk, offset / DIRENT_SIZE);
+                return curr_blk; //返回这个项目在目录中的位置
+            }
+            offset += DIRENT_SIZE;
+        }
+        put_block(curr_blk, disk_blk, 0);
+    }
+    dcache_set(blk, fname, fext, -1, 0); //整个目录都扫完了没有，记成负项
+    return -1;
+}
+
+static int write_stat_from_block(const long dir, struct u_fs_file_directory const * const f_dir){
+    if(obj_lock(dir, 1) == -1){
+        return -1;
+    }
+    //同一个目录里别的项的增删会挪动这一项，拿着目录的写锁重新找一次
+    struct u_fs_file_directory old;
+    long blk = dir_lookup(f_dir->fname, f_dir->fext, dir, &old);
+    if(blk == -1 || old.nStartBlock != f_dir->nStartBlock){
+        obj_unlock(dir);
+        printf("write_stat_from_block(): can't find the item!\n");
+        return -1;
+    }
+    char *disk_blk;
+	disk_blk = malloc(BLOCK_SIZE);
+    struct u_fs_chain ch;
+    if(read_disk_block(blk, disk_blk) == -1 || chain_get(blk, &ch) == -1){
+        free(disk_blk);
+        obj_unlock(dir);
+        return -1;
+    }
+    const uint32_t hash = dir_hash(f_dir->fname, f_dir->fext);
+    int offset = 0;
+    while(offset < ch.used){ 
+        if(dirent_match(disk_blk + offset, f_dir->fname, f_dir->fext, hash)){   
+            dirent_store(disk_blk + offset, f_dir);
+            write_disk_block(blk, disk_blk);
+            free(disk_blk);
+            obj_unlock(dir);
+            return 0;
+        }
+        offset += DIRENT_SIZE;
+    }
+    printf("write_stat_from_block(): can't find the item!\n");
+    free(disk_blk);
+    obj_unlock(dir);
+    return -1;
+}
+
+static long read_stat_from_path(const char* path, struct u_fs_file_directory* f_dir){
+    return lookup_path(path, f_dir, NULL);
+}
+
+static long lookup_path(const char* path, struct u_fs_file_directory* f_dir, long *dir){
+    char dirname[2*MAX_FILENAME + 1];
+    char fname[2*MAX_FILENAME + 1];
+    char fext[2*MAX_EXTENSION + 1];
+    int res = check_path(path, dirname, fname, fext);
+    if(res < 0){
+        return res;//-2路径中有名字过长, -1路径有误
+    }
+    if(res == 0){
+        strcpy(f_dir->fname, "root");
+        strcpy(f_dir->fext, "");
+        f_dir->fsize = NUM_TOTAL_BLOCK * BLOCK_SIZE;
+        f_dir->nStartBlock = ROOT_DIR_BLOCK;
+        f_dir->flag = 2;
+        if(dir != NULL){
+            *dir = -1;
+        }
+        return 0; //返回超级块所在位置
+	}
+	if(res == 1){
+		//根目录下的文件或目录 
+        if(dir != NULL){
+            *dir = ROOT_DIR_BLOCK;
+        }
+        return read_stat_in_rootdir(fname, fext, f_dir);
+	}
+	if(res == 2){
+		//子目录下的文件
+        long d = dir_lock(dirname, 0); //查完目录到拿上锁之间目录可能被删掉，dir_lock()会再确认一次
+        if(d < 0){
+			printf("read_stat_from_path(): subdirectory doesn't existed!\n");
+            return -1;
+        }
+        if(dir != NULL){
+            *dir = d;
+        }
+        long dres = dir_lookup(fname, fext, d, f_dir);
+        obj_unlock(d);
+        return dres;
+	}
+    return -1;
+}
+
+static long enlarge_a_block(const long n_blk){
+    long new_block = -1;
+    if(chain_grow(n_blk, 1, &new_block) != 1){
+        printf("enlarge_a_block(): get a free block failed!\n");
+        return -1;
+    }
+    return new_block;
+}
+
+static long file_write_blocks(const long *blks, const long n_cnt, const int old_head, const int old_tail,
+                              off_t offset, const char *buf, const size_t size){
+    struct iovec *iov = malloc(n_cnt * sizeof(struct iovec));
+    char *tmp[2] = { NULL, NULL }; //只有第一块和最后一块可能不满
+    int n_tmp = 0;
+    if(iov == NULL){
+        return -1;
+    }
+    size_t w_size = 0; //已经准备好的字节
+    size_t done = 0;   //已经写下去的字节
+    long run = 0;      //当前这一段连续块从第几块开始
+    long i;
+    for(i = 0; i < n_cnt; i++){
+        size_t len = BLOCK_SIZE - offset;
+        if(len > size - w_size){
+            len = size - w_size;
+        }
+        char *data = (char *)buf + w_size;
+        if(len < (size_t)BLOCK_SIZE){ //不满一块，原有的块要先读出来再改
+            data = tmp[n_tmp++] = malloc(BLOCK_SIZE);
+            if(data == NULL){
+                break;
+            }
+            if(!(i == 0 ? old_head : old_tail)){ //新块没写到的地方补0
+                memset(data, 0, BLOCK_SIZE);
+            }
+            else if(blkdev_read(blks[i], 1, data) == -1){
+                break;
+            }
+            memcpy(data + offset, buf + w_size, len);
+        }
+        iov[i].iov_base = data;
+        iov[i].iov_len = BLOCK_SIZE;
+        w_size += len;
+        offset = 0;
+        if(i + 1 == n_cnt || blks[i + 1] != blks[i] + 1){ //这一段到头了，一次写下去
+            if(blkdev_writev(blks[run], iov + run, i + 1 - run) == -1){
+                break;
+            }
+            run = i + 1;
+            done = w_size;
+        }
+    }
+    while(n_tmp > 0){
+        free(tmp[--n_tmp]);
+    }
+    free(iov);
+    return done > 0 || size == 0 ? (long)done : -1;
+}
+
+static long chain_grow(const long tail, const long num, long *blks){
+    pthread_mutex_lock(&alloc_lock);
+    struct u_fs_chain ch;
+    long last = tail;
+    long n = 0;
+    while(n < num){
+        long need = num - n;
+        long start = last + 1; //先试着紧接在链尾后面
+        long got = bitmap_alloc_at(start, need);
+        if(got <= 0){
+            //另起一段，最长的空闲段都不够的话先拿最长的那一段
+            got = need < bitmap.tree[1].max ? need : bitmap.tree[1].max;
+            if(got == 0 || get_consecutive_free_blocks(got, &start) != -1){
+                break;
+            }
+        }
+        //新块还没有内容，块本身的数据不用动，只在块链表里串起来
+        long i;
+        for(i = 0; i < got; i++){
+            ch.next = i + 1 < got ? start + i + 1 : -1;
+            ch.used = 0;
+            chain_set(start + i, &ch);
+            blks[n + i] = start + i;
+        }
+        //原来的链尾指向这一段；接不上的话这一段没有文件用，要还回去，不然就漏掉了
+        if(chain_get(last, &ch) == -1){
+            ch.next = -1;
+            ch.used = 0;
+            for(i = 0; i < got; i++){
+                chain_set(start + i, &ch);
+            }
+            bitmap_set_range(start, got, 0);
+            break;
+        }
+        ch.next = start;
+        chain_set(last, &ch);
+        last = start + got - 1;
+        n += got;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    return n;
+}
+
+static long file_map(const long start, const long idx, const long n_cnt, long *blks, const int alloc){
+    long n = 0;
+    if(FS_VERSION == U_FS_VERSION_EXTENT){
+        struct u_fs_extmap m;
+        if(ext_load(start, &m) == -1){
+            return -1;
+        }
+        if(alloc){ //空洞和文件尾后面还差的块一次都分配好
+            long n_alloc = m.n;
+            long got = ext_fill(&m, idx, idx + n_cnt);
+            if(got == -1){
+                printf("file_map(): no more space\n");
+            }
+            if((got != 0 || m.n != n_alloc) && ext_store(start, &m) == -1){
+                ext_release(&m);
+                return -1;
+            }
+        }
+        while(n < n_cnt){
+            long k = ext_lookup(&m, idx + n);
+            if(k == -1){
+                //空洞：后面还有块的话记为-1，否则文件在这里就没有块了
+                long next = ext_after(&m, idx + n);
+                if(next == m.n){
+                    break;
+                }
+                while(n < n_cnt && idx + n < m.ext[next].lblk){
+                    blks[n++] = -1;
+                }
+                continue;
+            }
+            struct u_fs_extent *e = &m.ext[k];
+            long b;
+            for(b = idx + n - e->lblk; b < e->len && n < n_cnt; b++){
+                blks[n++] = e->start + b;
+            }
+        }
+        ext_release(&m);
+        return n;
+    }
+    //块链表：块链表在缓存里，跳过的块不用读出来
+    long curr_blk = start;
+    long next_blk;
+    long i;
+    for(i = 0; i < idx; i++){
+        next_blk = chain_next(curr_blk);
+        if(next_blk == -1){ //这种情况只会在文件尾，且刚好块被填满的情况
+            if(!alloc || (next_blk = enlarge_a_block(curr_blk)) == -1){
+                return 0;
+            }
+        }
+        curr_blk = next_blk;
+    }
+    while(n < n_cnt){
+        blks[n++] = curr_blk;
+        if(n == n_cnt){
+            break;
+        }
+        next_blk = chain_next(curr_blk);
+        if(next_blk == -1){
+            if(alloc){ //还差的块一次接上
+                n += chain_grow(curr_blk, n_cnt - n, blks + n);
+            }
+            break;
+        }
+        curr_blk = next_blk;
+    }
+    return n;
+}
+
+static void fh_init(struct u_fs_fh *fh, const long start){
+    pthread_mutex_init(&fh->lock, NULL);
+    pthread_cond_init(&fh->idle, NULL);
+    fh->ra_next_off = 0; //从头开始读也算顺序读
+    fh->ra_window = RA_MIN_WINDOW;
+    fh->ra_idx = -1;
+    fh->ra_blk = -1;
+    fh->ra_pending = 0;
+    fh->start = start;
+    fh->dir = -1;
+    fh->ent_blk = -1;
+    fh->ent_slot = 0;
+    fh->fname[0] = '\0';
+    fh->fext[0] = '\0';
+    fh->bmap = NULL;
+    fh->bmap_base = 0;
+    fh->n_bmap = 0;
+    fh->cap_bmap = 0;
+    fh->bmap_gen = BMAP_GEN();
+    fh->cur_idx = -1;
+    fh->cur_blk = -1;
+    fh->cur_gen = 0;
+    fh->path = NULL;
+    fh->dbuf = NULL;
+    fh->d_off = 0;
+    fh->d_len = 0;
+    fh->d_cap = 0;
+    fh->d_time = 0;
+    fh->d_next = NULL;
+}
+
+static void fh_destroy(struct u_fs_fh *fh){
+    pthread_cond_destroy(&fh->idle);
+    pthread_mutex_destroy(&fh->lock);
+    free(fh->bmap);
+    fh->bmap = NULL;
+    free(fh->dbuf);
+    fh->dbuf = NULL;
+    free(fh->path);
+    fh->path = NULL;
+}
+
+static int dalloc_write(struct u_fs_fh *fh, const char *path, const char *buf, size_t size, off_t offset){
+    if(size == 0){
+        return 0;
+    }
+    pthread_mutex_lock(&dalloc.lock);
+    if(fh->d_len > 0 && offset == fh->d_off + (off_t)fh->d_len && fh->d_len + size <= (size_t)dalloc.max){
+        memcpy(fh->dbuf + fh->d_len, buf, size); //接着攒
+        fh->d_len += size;
+        dalloc.total += size;
+        pthread_mutex_unlock(&dalloc.lock);
+    }
+    else{
+        pthread_mutex_unlock(&dalloc.lock);
+        //接不上或者攒满了，先把攒着的提交掉，再看这次能不能重新开始攒
+        if(fh->d_len > 0 && dalloc_commit_fh(fh) == -1){
+            return -EIO;
+        }
+        struct u_fs_file_directory f_dir;
+        long found = fh->dir != -1 ? fh_entry(fh, &f_dir) : read_stat_from_path(path, &f_dir);
+        if(size >= (size_t)dalloc.max || fh->path == NULL || found < 0 || f_dir.flag != 1
+        || f_dir.nStartBlock != fh->start || offset != (off_t)f_dir.fsize || dalloc_end(fh->start) > 0){
+            return 0; //只攒从文件尾开始的写，别的fh也在攒的话直接写
+        }
+        if(fh->d_cap < (size_t)dalloc.max){
+            char *dbuf = realloc(fh->dbuf, dalloc.max);
+            if(dbuf == NULL){
+                return 0;
+            }
+            fh->dbuf = dbuf;
+            fh->d_cap = dalloc.max;
+        }
+        memcpy(fh->dbuf, buf, size);
+        pthread_mutex_lock(&dalloc.lock);
+        fh->d_off = offset;
+        fh->d_len = size;
+        fh->d_time = time(NULL);
+        //挂到链表尾
+        struct u_fs_fh **pp = &dalloc.head;
+        while(*pp != NULL){
+            pp = &(*pp)->d_next;
+        }
+        fh->d_next = NULL;
+        *pp = fh;
+        dalloc.total += size;
+        pthread_mutex_unlock(&dalloc.lock);
+    }
+    //所有文件攒的加起来太多了，从最早的开始提交，最早的那个文件正忙就下次再说
+    while(1){
+        pthread_mutex_lock(&dalloc.lock);
+        long start = dalloc.total > dalloc.max && dalloc.head != NULL ? dalloc.head->start : -1;
+        pthread_mutex_unlock(&dalloc.lock);
+        if(start == -1){
+            break;
+        }
+        int res = dalloc_commit_try(start, fh->start);
+        if(res == -1){
+            return -EIO;
+        }
+        if(res == 0){
+            break;
+        }
+    }
+    return size;
+}
+
+static int dalloc_commit_fh(struct u_fs_fh *fh){
+    pthread_mutex_lock(&dalloc.lock);
+    if(fh->d_len == 0){
+        pthread_mutex_unlock(&dalloc.lock);
+        return 0;
+    }
+    //先从链表上摘下来，write_file()里就不会再提交它了
+    struct u_fs_fh **pp = &dalloc.head;
+    while(*pp != NULL && *pp != fh){
+        pp = &(*pp)->d_next;
+    }
+    if(*pp == fh){
+        *pp = fh->d_next;
+    }
+    fh->d_next = NULL;
+    size_t len = fh->d_len;
+    dalloc.total -= len;
+    fh->d_len = 0;
+    pthread_mutex_unlock(&dalloc.lock);
+    if(write_file(fh->path, fh->dbuf, len, fh->d_off, fh) != (int)len){
+        printf("dalloc_commit_fh(): write %s failed, %zu bytes kept for retry\n", fh->path, len);
+        //写了一部分也没关系，下次从d_off整段重写。按开始攒的时间挂回链表
+        pthread_mutex_lock(&dalloc.lock);
+        pp = &dalloc.head;
+        while(*pp != NULL && (*pp)->d_time <= fh->d_time){
+            pp = &(*pp)->d_next;
+        }
+        fh->d_next = *pp;
+        *pp = fh;
+        fh->d_len = len;
+        dalloc.total += len;
+        pthread_mutex_unlock(&dalloc.lock);
+        return -1;
+    }
+    return 0;
+}
+
+static int dalloc_commit(const long start){
+    int res = 0;
+    while(1){
+        //拿着文件的写锁，这个文件的fh不会被别人摘下来或者关掉；链表变了，每次从头找
+        pthread_mutex_lock(&dalloc.lock);
+        struct u_fs_fh *fh = dalloc.head;
+        while(fh != NULL && fh->start != start){
+            fh = fh->d_next;
+        }
+        pthread_mutex_unlock(&dalloc.lock);
+        if(fh == NULL){
+            return res;
+        }
+        if(dalloc_commit_fh(fh) == -1){
+            return -1;
+        }
+        res = 1;
+    }
+}
+
+static int dalloc_commit_try(const long start, const long held){
+    if(start == held){
+        return dalloc_commit(start) == -1 ? -1 : 1;
+    }
+    if(obj_trylock(start, 1) == -1){
+        return 0;
+    }
+    int res = dalloc_commit(start);
+    obj_unlock(start);
+    return res == -1 ? -1 : 1;
+}
+
+static int fh_commit(struct u_fs_fh *fh){
+    //拿不到锁（内存不够）也要提交，fh马上就要释放了
+    int locked = obj_lock(fh->start, 1) == 0;
+    int res = dalloc_commit_fh(fh);
+    if(locked){
+        obj_unlock(fh->start);
+    }
+    return res;
+}
+
+static int dalloc_commit_all(const int expired){
+    time_t now = time(NULL);
+    long n_skip = 0; //表头有几个正忙的跳过了
+    while(1){
+        //链表按开始攒的时间排好了，只看跳过的后面那一个
+        pthread_mutex_lock(&dalloc.lock);
+        struct u_fs_fh *fh = dalloc.head;
+        long i;
+        for(i = 0; i < n_skip && fh != NULL; i++){
+            fh = fh->d_next;
+        }
+        long start = fh != NULL && (!expired || now - fh->d_time >= DALLOC_TIMEOUT) ? fh->start : -1;
+        pthread_mutex_unlock(&dalloc.lock);
+        if(start == -1){
+            return 0;
+        }
+        int res = dalloc_commit_try(start, -1);
+        if(res == -1){
+            return -1;
+        }
+        if(res == 0){
+            n_skip++;
+        }
+    }
+}
+
+static void dalloc_drop(const long start){
+    pthread_mutex_lock(&dalloc.lock);
+    struct u_fs_fh **pp = &dalloc.head;
+    while(*pp != NULL){
+        struct u_fs_fh *fh = *pp;
+        if(fh->start == start){
+            *pp = fh->d_next;
+            fh->d_next = NULL;
+            dalloc.total -= fh->d_len;
+            fh->d_len = 0;
+        }
+        else{
+            pp = &fh->d_next;
+        }
+    }
+    pthread_mutex_unlock(&dalloc.lock);
+}
+
+static off_t dalloc_end(const long start){
+    off_t end = 0;
+    struct u_fs_fh *fh;
+    pthread_mutex_lock(&dalloc.lock);
+    for(fh = dalloc.head; fh != NULL; fh = fh->d_next){
+        if(fh->start == start && fh->d_off + (off_t)fh->d_len > end){
+            end = fh->d_off + fh->d_len;
+        }
+    }
+    pthread_mutex_unlock(&dalloc.lock);
+    return end;
+}
+
+static void *dalloc_worker(void *arg){
+    (void) arg;
+    pthread_mutex_lock(&dalloc.lock);
+    while(!dalloc.stop){
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += 1;
+        pthread_cond_timedwait(&dalloc.cond, &dalloc.lock, &ts);
+        if(dalloc.stop){
+            break;
+        }
+        int expired = dalloc.head != NULL && time(NULL) - dalloc.head->d_time >= DALLOC_TIMEOUT;
+        pthread_mutex_unlock(&dalloc.lock);
+        if(expired){ //不拿着任何锁提交，正忙的文件跳过，下一秒再看
+            dalloc_commit_all(1);
+        }
+        pthread_mutex_lock(&dalloc.lock);
+    }
+    pthread_mutex_unlock(&dalloc.lock);
+    return NULL;
+}
+
+static int dalloc_init(void){
+    if(dalloc.max <= 0){
+        return 0;
+    }
+    dalloc.stop = 0;
+    if(pthread_create(&dalloc.thread, NULL, dalloc_worker, NULL) != 0){
+        printf("dalloc_init(): create commit thread failed\n");
+        return -1;
+    }
+    dalloc.running = 1;
+    return 0;
+}
+
+static void dalloc_exit(void){
+    if(!dalloc.running){
+        return;
+    }
+    pthread_mutex_lock(&dalloc.lock);
+    dalloc.stop = 1;
+    pthread_cond_signal(&dalloc.cond);
+    pthread_mutex_unlock(&dalloc.lock);
+    pthread_join(dalloc.thread, NULL);
+    dalloc.running = 0;
+}
+
+static long fh_map(struct u_fs_fh *fh, const long idx, const long end, const int alloc, long **blks){
+    //别的文件也会用同一个tails项，拷一份出来再用
+    struct u_fs_tail *t = &tails[fh->start % TAIL_HINTS];
+    pthread_mutex_lock(&alloc_lock);
+    struct u_fs_tail hint = *t;
+    pthread_mutex_unlock(&alloc_lock);
+    unsigned long gen = BMAP_GEN();
+    if(fh->bmap_gen != gen || idx < fh->bmap_base
+    || (FS_VERSION == U_FS_VERSION_EXTENT && idx >= fh->bmap_base + fh->n_bmap)){
+        //有块被释放过，或者要的块在表前面，重新建表；extent可以直接查，要的块不在表里就从idx开始建
+        fh->n_bmap = 0;
+        fh->bmap_gen = gen;
+    }
+    if(FS_VERSION == U_FS_VERSION_CHAIN && fh->n_bmap > 0 && idx > fh->bmap_base && end - fh->bmap_base > FH_MAP_MAX){
+        //块链表：表太长了，前面的扔掉，游标挪到表里离idx最近的一块，从那里接着建
+        long i = idx < fh->bmap_base + fh->n_bmap ? idx - fh->bmap_base : fh->n_bmap - 1;
+        fh->cur_idx = fh->bmap_base + i;
+        fh->cur_blk = fh->bmap[i];
+        fh->cur_gen = gen;
+        fh->n_bmap = 0;
+    }
+    long base_blk = fh->start; //表里第一块的块号，块链表建表时用
+    if(fh->n_bmap == 0){
+        fh->bmap_base = FS_VERSION == U_FS_VERSION_EXTENT ? idx : 0;
+        //块链表：tails里记下的位置和游标，不在idx后面的话从离idx近的那个开始建表
+        if(FS_VERSION == U_FS_VERSION_CHAIN && hint.start == fh->start && hint.gen == gen && hint.idx <= idx){
+            fh->bmap_base = hint.idx;
+            base_blk = hint.blk;
+        }
+        if(FS_VERSION == U_FS_VERSION_CHAIN && fh->cur_gen == gen && fh->cur_idx > fh->bmap_base && fh->cur_idx <= idx){
+            fh->bmap_base = fh->cur_idx;
+            base_blk = fh->cur_blk;
+        }
+    }
+    long n_end = end - fh->bmap_base; //表里要有多少块
+    if(alloc && FS_VERSION == U_FS_VERSION_EXTENT){ //要填的空洞从表里去掉，重新查
+        long i;
+        for(i = idx - fh->bmap_base; i < fh->n_bmap && i < n_end; i++){
+            if(fh->bmap[i] == -1){
+                fh->n_bmap = i;
+                break;
+            }
+        }
+    }
+    if(fh->n_bmap < n_end){
+        if(n_end > fh->cap_bmap){
+            long cap = fh->cap_bmap > 0 ? fh->cap_bmap * 2 : 64;
+            while(cap < n_end){
+                cap *= 2;
+            }
+            long *bmap = realloc(fh->bmap, cap * sizeof(long));
+            if(bmap == NULL){
+                return -1;
+            }
+            fh->bmap = bmap;
+            fh->cap_bmap = cap;
+        }
+        if(FS_VERSION == U_FS_VERSION_EXTENT){
+            long got = file_map(fh->start, fh->bmap_base + fh->n_bmap, n_end - fh->n_bmap, fh->bmap + fh->n_bmap, alloc);
+            if(got == -1){
+                return -1;
+            }
+            fh->n_bmap += got;
+            fh->bmap_gen = BMAP_GEN(); //填空洞时别的表作废了，这张表是刚查的
+        }
+        else{
+            //块链表：从表里最后一块接着往后走，不用从头走
+            if(fh->n_bmap == 0){
+                fh->bmap[fh->n_bmap++] = base_blk; //从头建时第一块就是nStartBlock
+            }
+            long curr_blk = fh->bmap[fh->n_bmap - 1];
+            while(fh->n_bmap < n_end){
+                long next_blk = chain_next(curr_blk);
+                if(next_blk == -1){
+                    if(alloc){ //到链尾了，还差的块一次接上
+                        fh->n_bmap += chain_grow(curr_blk, n_end - fh->n_bmap, fh->bmap + fh->n_bmap);
+                    }
+                    break;
+                }
+                fh->bmap[fh->n_bmap++] = next_blk;
+                curr_blk = next_blk;
+            }
+            //记下走到的最后一块，下次打开这个文件追加时从这里开始
+            long last_idx = fh->bmap_base + fh->n_bmap - 1;
+            pthread_mutex_lock(&alloc_lock);
+            if(t->start != fh->start || t->gen != gen || t->idx < last_idx){
+                t->start = fh->start;
+                t->idx = last_idx;
+                t->blk = fh->bmap[fh->n_bmap - 1];
+                t->gen = gen;
+            }
+            pthread_mutex_unlock(&alloc_lock);
+        }
+    }
+    long n = fh->bmap_base + fh->n_bmap - idx;
+    *blks = n > 0 ? fh->bmap + (idx - fh->bmap_base) : NULL;
+    if(FS_VERSION == U_FS_VERSION_CHAIN && n > 0){ //记下游标，表扔掉以后从这里接着走
+        fh->cur_idx = idx;
+        fh->cur_blk = fh->bmap[idx - fh->bmap_base];
+        fh->cur_gen = fh->bmap_gen;
+    }
+    return n;
+}
+
+static int clear_blocks(const long start_blk){
+    if(start_blk == -1){
+        return -1;
+    }
+    BMAP_GEN_BUMP(); //打开的文件的块号表可能过时了
+    //只需要改块链表和位图，块里的数据不用动；块号连续的一段在位图里一次清掉
+    struct u_fs_chain ch;
+    long curr_blk = start_blk;
+    long run = start_blk; //当前这一段连续块的第一块
+    long n_run = 0;
+    while(curr_blk != -1){
+        if(chain_get(curr_blk, &ch) == -1){
+            break;
+        }
+        if(n_run > 0 && curr_blk != run + n_run){
+            bitmap_set_range(run, n_run, 0);
+            run = curr_blk;
+            n_run = 0;
+        }
+        n_run++;
+        long next_blk = ch.next;
+        ch.next = -1;
+        ch.used = 0;
+        chain_set(curr_blk, &ch);
+        curr_blk = next_blk;
+    }
+    if(n_run > 0){
+        bitmap_set_range(run, n_run, 0);
+    }
+    return curr_blk == -1 ? 0 : -1;
+}
+
+static uint64_t bitmap_word(const long w){
+    uint64_t x;
+    memcpy(&x, bitmap.map + w * 8, 8);
+    return be64toh(x); //第0块在最高位
+}
+
+static void bitmap_mark_dirty(const long first, const long last){
+    long i;
+    for(i = (first/8) / BLOCK_SIZE; i <= (last/8) / BLOCK_SIZE; i++){
+        if(!bitmap.dirty[i]){
+            bitmap.dirty[i] = 1;
+            bitmap.n_dirty++;
+        }
+    }
+}
+
+static void bitmap_group_calc(const long g){
+    long limit = NUM_TOTAL_BLOCK - 1;
+    long lo = g * BITMAP_GROUP;
+    long hi = lo + BITMAP_GROUP < limit ? lo + BITMAP_GROUP : limit;
+    struct u_fs_bnode *n = &bitmap.tree[bitmap.n_leaf + g];
+    n->len = hi - lo;
+    n->head = 0;
+    n->tail = 0;
+    n->max = 0;
+    long pos = lo > ROOT_DIR_BLOCK ? lo : ROOT_DIR_BLOCK + 1; //根目录和它前面的块不算
+    while(pos < hi){
+        long start = bitmap_next(pos, 0, hi);
+        if(start >= hi){
+            break;
+        }
+        long end = bitmap_next(start, 1, hi);
+        if(start == lo){
+            n->head = end - lo;
+        }
+        if(end == hi){
+            n->tail = hi - start;
+        }
+        if(end - start > n->max){
+            n->max = end - start;
+        }
+        pos = end;
+    }
+}
+
+static void bitmap_node_merge(const long i){
+    struct u_fs_bnode *n = &bitmap.tree[i];
+    struct u_fs_bnode *l = &bitmap.tree[2 * i];
+    struct u_fs_bnode *r = &bitmap.tree[2 * i + 1];
+    n->len = l->len + r->len;
+    n->head = l->head == l->len ? l->len + r->head : l->head;
+    n->tail = r->tail == r->len ? r->len + l->tail : r->tail;
+    n->max = l->max > r->max ? l->max : r->max;
+    if(l->tail + r->head > n->max){ //跨过两半中间的那一段
+        n->max = l->tail + r->head;
+    }
+}
+
+static void bitmap_group_update(const long g){
+    bitmap_group_calc(g);
+    long i;
+    for(i = (bitmap.n_leaf + g) / 2; i >= 1; i /= 2){
+        bitmap_node_merge(i);
+    }
+}
+
+static long bitmap_find_run(const long num){
+    if(bitmap.tree[1].max < num){
+        return -1;
+    }
+    long i = 1;
+    long lo = 0; //结点i这一段的第一块
+    while(i < bitmap.n_leaf){
+        struct u_fs_bnode *l = &bitmap.tree[2 * i];
+        struct u_fs_bnode *r = &bitmap.tree[2 * i + 1];
+        if(l->max >= num){ //左半边里就有，往左走
+            i = 2 * i;
+        }
+        else if(l->tail + r->head >= num){ //跨在中间，从左半边结尾的空闲块开始
+            return lo + l->len - l->tail;
+        }
+        else{
+            lo += l->len;
+            i = 2 * i + 1;
+        }
+    }
+    //落到一组里面了，这一组里一定有够长的一段，在组里扫一遍
+    long hi = lo + bitmap.tree[i].len;
+    long pos = lo > ROOT_DIR_BLOCK ? lo : ROOT_DIR_BLOCK + 1;
+    while(pos < hi){
+        long start = bitmap_next(pos, 0, hi);
+        long end = bitmap_next(start, 1, hi);
+        if(end - start >= num){
+            return start;
+        }
+        pos = end;
+    }
+    return -1; //不会走到这里
+}
+
+static int bitmap_load(void){
+    bitmap.map = malloc(NUM_BITMAP_BLOCK * BLOCK_SIZE);
+    bitmap.dirty = calloc(NUM_BITMAP_BLOCK, 1);
+    if(bitmap.map == NULL || bitmap.dirty == NULL){
+        free(bitmap.map);
+        free(bitmap.dirty);
+        bitmap.map = NULL;
+        bitmap.dirty = NULL;
+        return -1;
+    }
+    //还没有别人写过位图块，直接整段从diskimg读
+    if(blkdev_read(1, NUM_BITMAP_BLOCK, bitmap.map) == -1){
+        printf("bitmap_load(): read bitmap failed\n");
+        free(bitmap.map);
+        free(bitmap.dirty);
+        bitmap.map = NULL;
+        bitmap.dirty = NULL;
+        return -1;
+    }
+    bitmap.n_dirty = 0;
+    bitmap.avx2 = 0;
+#ifdef U_FS_AVX2
+    bitmap.avx2 = __builtin_cpu_supports("avx2");
+#endif
+    //数据块从根目录后面开始，最后一块不分配（和原来的扫描范围一样）
+    bitmap.n_free = 0;
+    long limit = NUM_TOTAL_BLOCK - 1;
+    long pos = bitmap_next(ROOT_DIR_BLOCK + 1, 0, limit);
+    while(pos < limit){
+        long end = bitmap_next(pos, 1, limit);
+        bitmap.n_free += end - pos;
+        pos = bitmap_next(end, 0, limit);
+    }
+    //建线段树，先算好每一组，再从下往上合并
+    long n_group = (limit + BITMAP_GROUP - 1) / BITMAP_GROUP;
+    bitmap.n_leaf = 1;
+    while(bitmap.n_leaf < n_group){
+        bitmap.n_leaf <<= 1;
+    }
+    bitmap.tree = calloc(2 * bitmap.n_leaf, sizeof(struct u_fs_bnode));
+    if(bitmap.tree == NULL){
+        free(bitmap.map);
+        free(bitmap.dirty);
+        bitmap.map = NULL;
+        bitmap.dirty = NULL;
+        return -1;
+    }
+    long g;
+    for(g = 0; g < n_group; g++){
+        bitmap_group_calc(g);
+    }
+    long i;
+    for(i = bitmap.n_leaf - 1; i >= 1; i--){
+        bitmap_node_merge(i);
+    }
+    return 0;
+}
+
+static int bitmap_sync(void){
+    int res = 0;
+    pthread_mutex_lock(&alloc_lock);
+    long i;
+    for(i = 0; i < NUM_BITMAP_BLOCK && bitmap.n_dirty > 0; i++){
+        if(!bitmap.dirty[i]){
+            continue;
+        }
+        if(cache_write_block(1 + i, bitmap.map + i * BLOCK_SIZE) == -1){ //位图从第1块开始
+            res = -1;
+            break;
+        }
+        bitmap.dirty[i] = 0;
+        bitmap.n_dirty--;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    return res;
+}
+
+static void bitmap_destroy(void){
+    if(bitmap.map == NULL){
+        return;
+    }
+    bitmap_sync();
+    free(bitmap.map);
+    free(bitmap.dirty);
+    free(bitmap.tree);
+    bitmap.map = NULL;
+    bitmap.dirty = NULL;
+    bitmap.tree = NULL;
+}
+
+#ifdef U_FS_AVX2
+/**
+ * 从第w个字开始，每次看4个字（256位），跳过全部是skip的字，
+ * 返回第一组不全是skip的字的下标，或者w_end
+ */
+__attribute__((target("avx2")))
+static long bitmap_skip_avx2(long w, const long w_end, const int used){
+    const __m256i ones = _mm256_set1_epi8((char)0xff);
+    while(w + 4 <= w_end){
+        __m256i v = _mm256_loadu_si256((const __m256i *)(bitmap.map + w * 8));
+        if(used){ //找占用的块，跳过全0
+            if(!_mm256_testz_si256(v, v)){
+                break;
+            }
+        }
+        else if(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, ones)) != -1){ //找空闲的块，跳过全1
+            break;
+        }
+        w += 4;
+    }
+    return w;
+}
+#endif
+
+static long bitmap_next(const long pos, const int used, const long limit){
+    if(pos >= limit){
+        return limit;
+    }
+    long w = pos >> 6;
+    long w_end = (limit + 63) >> 6;
+    uint64_t x = bitmap_word(w);
+    if(!used){
+        x = ~x; //要找的位都变成1
+    }
+    x &= ~0ULL >> (pos & 63); //pos之前的位不要
+    while(x == 0){
+        w++;
+#ifdef U_FS_AVX2
+        if(bitmap.avx2){
+            w = bitmap_skip_avx2(w, w_end, used);
+        }
+#endif
+        if(w >= w_end){
+            return limit;
+        }
+        x = bitmap_word(w);
+        if(!used){
+            x = ~x;
+        }
+    }
+    long res = (w << 6) + __builtin_clzll(x);
+    return res < limit ? res : limit;
+}
+
+static int set_single_bit_in_bitmap(const long num, const int flag) {
+	if (num == -1){
+		return -1;
+    }
+    if(num < 0 || num >= NUM_TOTAL_BLOCK){
+        printf("set_single_bit_in_bitmap(): block %ld out of range\n", num);
+        return -1;
+    }
+    pthread_mutex_lock(&alloc_lock);
+    BYTE *byte = &bitmap.map[num/8];
+    BYTE mask = (1<<7);
+    mask >>= (num%8);
+    if(((*byte & mask) != 0) == (flag != 0)){
+        pthread_mutex_unlock(&alloc_lock);
+        return 0; //本来就是这样
+    }
+	if (flag){
+		*byte |= mask;
+    }
+	else{
+        *byte &= ~mask;
+    }
+    if(num > ROOT_DIR_BLOCK && num < NUM_TOTAL_BLOCK - 1){
+        bitmap.n_free += flag ? -1 : 1;
+        bitmap_group_update(num / BITMAP_GROUP);
+    }
+    bitmap_mark_dirty(num, num);
+    pthread_mutex_unlock(&alloc_lock);
+    return 0;
+}
+
+static void bitmap_set_range(const long start, const long num, const int flag){
+    pthread_mutex_lock(&alloc_lock);
+    long j;
+    long changed = 0;
+    for(j = start; j < start + num; j++){
+        BYTE mask = (BYTE)((1<<7) >> (j%8));
+        if(((bitmap.map[j/8] & mask) != 0) != (flag != 0)){
+            bitmap.map[j/8] ^= mask;
+            changed++;
+        }
+    }
+    bitmap.n_free += flag ? -changed : changed;
+    for(j = start / BITMAP_GROUP; j <= (start + num - 1) / BITMAP_GROUP; j++){
+        bitmap_group_update(j);
+    }
+    bitmap_mark_dirty(start, start + num - 1);
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+static long bitmap_alloc_at(const long start, const long num){
+    long limit = NUM_TOTAL_BLOCK - 1;
+    if(start <= ROOT_DIR_BLOCK || start >= limit){
+        return 0;
+    }
+    long end = start + num < limit ? start + num : limit;
+    pthread_mutex_lock(&alloc_lock);
+    long got = bitmap_next(start, 1, end) - start;
+    if(got > 0){
+        bitmap_set_range(start, got, 1);
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    return got;
+}
+
+static int get_consecutive_free_blocks(const long num, long* start_blk){
+    //线段树直接给出第一段够长的空闲块
+    pthread_mutex_lock(&alloc_lock);
+    long pos = bitmap_find_run(num);
+    if(pos == -1){ //没找到足够大的连续的空闲块
+        long n_free = bitmap.n_free;
+        pthread_mutex_unlock(&alloc_lock);
+        return n_free;
+    }
+    //这一段连续块对应的位置1，再更新涉及到的组
+    bitmap_set_range(pos, num, 1);
+    pthread_mutex_unlock(&alloc_lock);
+    *start_blk = pos;
+    return -1; //success
+}
+
+static void dirent_load(const char *de, struct u_fs_file_directory * const item){
+    if(DIR_VERSION != U_FS_DIRENT_PACKED){
+        memcpy(item, de, sizeof(struct u_fs_file_directory));
+        return;
+    }
+    const struct u_fs_dirent *d = (const struct u_fs_dirent *)de;
+    memset(item, 0, sizeof(struct u_fs_file_directory));
+    memcpy(item->fname, d->fname, MAX_FILENAME);
+    memcpy(item->fext, d->fext, MAX_EXTENSION);
+    item->fsize = le64toh(d->fsize);
+    item->nStartBlock = (long)le64toh((uint64_t)d->start);
+    item->flag = d->flag;
+}
+
+static void dirent_store(char *de, struct u_fs_file_directory const * const item){
+    if(DIR_VERSION != U_FS_DIRENT_PACKED){
+        memcpy(de, item, sizeof(struct u_fs_file_directory));
+        return;
+    }
+    struct u_fs_dirent *d = (struct u_fs_dirent *)de;
+    memset(d, 0, sizeof(struct u_fs_dirent));
+    d->hash = htole32(dir_hash(item->fname, item->fext));
+    d->flag = item->flag;
+    memcpy(d->fname, item->fname, strnlen(item->fname, MAX_FILENAME));
+    memcpy(d->fext, item->fext, strnlen(item->fext, MAX_EXTENSION));
+    d->fsize = htole64(item->fsize);
+    d->start = (int64_t)htole64((uint64_t)item->nStartBlock);
+}
+
+static int dirent_match(const char *de, const char *fname, const char *fext, const uint32_t hash){
+    if(DIR_VERSION != U_FS_DIRENT_PACKED){
+        const struct u_fs_file_directory *d = (const struct u_fs_file_directory *)de;
+        return strcmp(d->fname, fname) == 0 && strcmp(d->fext, fext) == 0;
+    }
+    const struct u_fs_dirent *d = (const struct u_fs_dirent *)de;
+    //名字不满8个字符时strncmp也比到了后面补的0
+    return le32toh(d->hash) == hash
+        && strncmp(d->fname, fname, MAX_FILENAME) == 0
+        && strncmp(d->fext, fext, MAX_EXTENSION) == 0;
+}
+
+static int rm_item(const long dir, const long i_blk, struct u_fs_file_directory const * const f_dir){
+    dalloc_drop(f_dir->nStartBlock); //文件删了，攒着的数据不用写了
+    char* disk_blk;
+    disk_blk = malloc(BLOCK_SIZE);
+    struct u_fs_chain ch;
+    if(read_disk_block(i_blk, disk_blk) == -1 || chain_get(i_blk, &ch) == -1){
+        free(disk_blk);
+        return -1;
+    }
+    //删除项目所在的目录块中对应的一项
+    const uint32_t hash = dir_hash(f_dir->fname, f_dir->fext);
+    struct u_fs_file_directory it;
+    long offset = 0;
+    while(offset < ch.used && !dirent_match(disk_blk + offset, f_dir->fname, f_dir->fext, hash)){ 
+        offset += DIRENT_SIZE;
+    }
+    if(offset >= ch.used){
+        printf("rm_item(): target item is not found!\n");
+        free(disk_blk);
+        return -1;
+    }
+    //首先删除其内容所在后续块
+    dirent_load(disk_blk + offset, &it);
+    if(it.flag == 1 && FS_VERSION == U_FS_VERSION_EXTENT){
+        ext_free(it.nStartBlock);
+    }
+    else if(it.flag == 2){
+        dir_free(it.nStartBlock);
+    }
+    else{
+        clear_blocks(it.nStartBlock);
+    }
+    //把块里最后一项覆盖到删掉的项上，并且清空最后一项
+    ch.used -= DIRENT_SIZE;
+    if(offset != ch.used){
+        memcpy(disk_blk + offset, disk_blk + ch.used, DIRENT_SIZE);
+        dirent_load(disk_blk + offset, &it);
+        dcache_set(dir, it.fname, it.fext, i_blk, offset / DIRENT_SIZE);
+    }
+    memset(disk_blk + ch.used, 0, DIRENT_SIZE);
+    dcache_set(dir, f_dir->fname, f_dir->fext, -1, 0);
+    dir_index_count(dir, -1);
+    write_disk_block(i_blk, disk_blk);
+    chain_set(i_blk, &ch);
+    //上面的步骤把i_blk最后的项目覆盖到想要删除的项上，并已经项目清空了后续块
+    
+    long curr_blk = i_blk;
+    long next_blk = ch.next;
+    char* next_disk_blk;
+    next_disk_blk = malloc(BLOCK_SIZE);
+    struct u_fs_chain next_ch;
+    while(next_blk != -1){
+        //读下一块的内容
+        read_disk_block(curr_blk, disk_blk); 
+        chain_get(curr_blk, &ch);
+        read_disk_block(next_blk, next_disk_blk);
+        chain_get(next_blk, &next_ch);
+        if(next_ch.used == 0){ //下一块在之前的删除中已经被删空了，直接释放
+            clear_blocks(next_blk);
+            ch.next = -1;
+            chain_set(curr_blk, &ch);
+            break;
+        }
+        //前面的块接在已有的项后面，后面的块取最后一项
+        next_ch.used -= DIRENT_SIZE;
+        memcpy(disk_blk + ch.used, next_disk_blk + next_ch.used, DIRENT_SIZE);
+        memset(next_disk_blk + next_ch.used, 0, DIRENT_SIZE);
+        dirent_load(disk_blk + ch.used, &it);
+        dcache_set(dir, it.fname, it.fext, curr_blk, ch.used / DIRENT_SIZE);
+        ch.used += DIRENT_SIZE;
+        if(next_ch.used == 0){
+            clear_blocks(next_blk);
+            next_blk = -1;
+            ch.next = -1;
+            write_disk_block(curr_blk, disk_blk);
+            chain_set(curr_blk, &ch);
+        }
+        else{
+            write_disk_block(curr_blk, disk_blk);
+            chain_set(curr_blk, &ch);
+            write_disk_block(next_blk, next_disk_blk);
+            chain_set(next_blk, &next_ch);
+            curr_blk = next_blk;
+            next_blk = next_ch.next;
+        }
+    } 
+    free(next_disk_blk);
+    free(disk_blk);
+    return 0;
+}
+
+static long dir_chain(const long dir, const char *fname, const char *fext){
+    struct u_fs_chain ch;
+    if(chain_get(dir, &ch) == -1){
+        return -1;
+    }
+    if(ch.used != DIR_INDEXED){
+        return dir;
+    }
+    char *disk_blk = get_block(dir, 1);
+    if(disk_blk == NULL){
+        return -1;
+    }
+    struct u_fs_dir_index *idx = (struct u_fs_dir_index *)disk_blk;
+    long head = idx->bucket[dir_hash(fname, fext) & (idx->n_bucket - 1)];
+    put_block(dir, disk_blk, 0);
+    return head;
+}
+
+static long dir_add(const long dir, struct u_fs_file_directory const * const item){
+    const long item_size = DIRENT_SIZE;
+    struct u_fs_chain ch;
+    if(chain_get(dir, &ch) == -1){
+        return -1;
+    }
+    const int indexed = ch.used == DIR_INDEXED;
+    long tail = dir;
+    if(indexed){
+        char *disk_blk = get_block(dir, 1);
+        if(disk_blk == NULL){
+            return -1;
+        }
+        struct u_fs_dir_index *idx = (struct u_fs_dir_index *)disk_blk;
+        long b = dir_hash(item->fname, item->fext) & (idx->n_bucket - 1);
+        if(idx->bucket[b] == -1){ //空桶，先给它一块
+            long free_blk = -1;
+            if(get_consecutive_free_blocks(1, &free_blk) != -1){
+                put_block(dir, disk_blk, 0);
+                return -1;
+            }
+            ch.next = -1;
+            ch.used = 0;
+            chain_set(free_blk, &ch);
+            idx->bucket[b] = free_blk;
+            tail = free_blk;
+            put_block(dir, disk_blk, 1);
+        }
+        else{
+            tail = idx->bucket[b];
+            put_block(dir, disk_blk, 0);
+        }
+    }
+    //链尾只要查块链表，不用读目录块
+    long next_blk;
+    while((next_blk = chain_next(tail)) != -1){
+        tail = next_blk;
+    }
+    if(chain_get(tail, &ch) == -1){
+        return -1;
+    }
+    if(ch.used + item_size > BLOCK_SIZE){ //最后一块满了
+        if(!indexed && (FS_FEATURES & U_FS_FEATURE_DIR_INDEX) && dir_rebuild(dir) == 0){
+            return dir_add(dir, item);
+        }
+        tail = enlarge_a_block(tail);
+        if(tail == -1 || chain_get(tail, &ch) == -1){
+            return -1;
+        }
+    }
+    char *disk_blk = get_block(tail, 1);
+    if(disk_blk == NULL){
+        return -1;
+    }
+    long slot = ch.used / item_size;
+    dirent_store(disk_blk + ch.used, item);
+    put_block(tail, disk_blk, 1);
+    ch.used += item_size;
+    chain_set(tail, &ch);
+    dcache_set(dir, item->fname, item->fext, tail, slot);
+    if(indexed){
+        long n_item = dir_index_count(dir, 1);
+        char *idx_blk = get_block(dir, 1);
+        if(idx_blk != NULL){
+            long n_bucket = ((struct u_fs_dir_index *)idx_blk)->n_bucket;
+            put_block(dir, idx_blk, 0);
+            if(n_bucket < DIR_MAX_BUCKETS && n_item > n_bucket * (BLOCK_SIZE / item_size) * 3 / 4){
+                dir_rebuild(dir); //失败了也不要紧，只是桶里长一点
+            }
+        }
+    }
+    return tail;
+}
+
+//把一个桶的项写成一串新的目录块
+static long dir_fill_bucket(const long dir, struct u_fs_file_directory const *items, const long n_item){
+    const long per_blk = BLOCK_SIZE / DIRENT_SIZE;
+    const long n_blk = (n_item + per_blk - 1) / per_blk;
+    long *blks = malloc(n_blk * sizeof(long));
+    if(blks == NULL || get_consecutive_free_blocks(1, &blks[0]) != -1){
+        free(blks);
+        return -1;
+    }
+    struct u_fs_chain ch = { -1, 0 };
+    chain_set(blks[0], &ch);
+    if(n_blk > 1 && chain_grow(blks[0], n_blk - 1, blks + 1) != n_blk - 1){
+        clear_blocks(blks[0]);
+        free(blks);
+        return -1;
+    }
+    long i;
+    for(i = 0; i < n_blk; i++){
+        long n = n_item - i * per_blk < per_blk ? n_item - i * per_blk : per_blk;
+        char *disk_blk = get_block(blks[i], 0);
+        if(disk_blk == NULL){
+            clear_blocks(blks[0]);
+            free(blks);
+            return -1;
+        }
+        memset(disk_blk, 0, BLOCK_SIZE);
+        long j;
+        for(j = 0; j < n; j++){ //项都挪了地方，重新记进目录项缓存
+            dirent_store(disk_blk + j * DIRENT_SIZE, &items[i * per_blk + j]);
+            dcache_set(dir, items[i * per_blk + j].fname, items[i * per_blk + j].fext, blks[i], j);
+        }
+        put_block(blks[i], disk_blk, 1);
+        chain_get(blks[i], &ch);
+        ch.used = n * DIRENT_SIZE;
+        chain_set(blks[i], &ch);
+    }
+    long head = blks[0];
+    free(blks);
+    return head;
+}
+
+static int dir_rebuild(const long dir){
+    const long item_size = sizeof(struct u_fs_file_directory);
+    const long per_blk = BLOCK_SIZE / DIRENT_SIZE;
+    struct u_fs_chain ch;
+    if(chain_get(dir, &ch) == -1){
+        return -1;
+    }
+    //原来的目录块：没有索引时是dir开始的一串，有索引时是每个桶一串
+    long n_old = 1;
+    long *old = malloc(sizeof(long));
+    if(old == NULL){
+        return -1;
+    }
+    old[0] = dir;
+    if(ch.used == DIR_INDEXED){
+        char *disk_blk = get_block(dir, 1);
+        if(disk_blk == NULL){
+            free(old);
+            return -1;
+        }
+        struct u_fs_dir_index *idx = (struct u_fs_dir_index *)disk_blk;
+        n_old = idx->n_bucket;
+        free(old);
+        old = malloc(n_old * sizeof(long));
+        if(old != NULL){
+            memcpy(old, idx->bucket, n_old * sizeof(long));
+        }
+        put_block(dir, disk_blk, 0);
+        if(old == NULL){
+            return -1;
+        }
+    }
+    //所有项读出来
+    long n_item = 0;
+    long cap = per_blk;
+    struct u_fs_file_directory *items = malloc(cap * item_size);
+    long i;
+    for(i = 0; i < n_old && items != NULL; i++){
+        long blk;
+        for(blk = old[i]; blk != -1 && items != NULL; blk = ch.next){
+            char *disk_blk;
+            if(chain_get(blk, &ch) == -1 || (disk_blk = get_block(blk, 1)) == NULL){
+                free(items);
+                items = NULL;
+                break;
+            }
+            long n = ch.used / DIRENT_SIZE;
+            if(n_item + n > cap){
+                while(n_item + n > cap){
+                    cap *= 2;
+                }
+                struct u_fs_file_directory *tmp = realloc(items, cap * item_size);
+                if(tmp == NULL){
+                    free(items);
+                }
+                items = tmp;
+            }
+            long j;
+            for(j = 0; items != NULL && j < n; j++){
+                dirent_load(disk_blk + j * DIRENT_SIZE, &items[n_item++]);
+            }
+            put_block(blk, disk_blk, 0);
+        }
+    }
+    if(items == NULL){
+        free(old);
+        return -1;
+    }
+    //桶数取够装下两倍项数的2的幂
+    long n_bucket = 2;
+    while(n_bucket < DIR_MAX_BUCKETS && n_item > n_bucket * per_blk / 2){
+        n_bucket *= 2;
+    }
+    //按桶排好（计数排序），每个桶写成一串新的目录块
+    long *start = calloc(n_bucket + 1, sizeof(long));
+    long *heads = malloc(n_bucket * sizeof(long));
+    struct u_fs_file_directory *sorted = malloc((n_item > 0 ? n_item : 1) * item_size);
+    int res = start != NULL && heads != NULL && sorted != NULL ? 0 : -1;
+    if(res == 0){
+        for(i = 0; i < n_item; i++){
+            start[(dir_hash(items[i].fname, items[i].fext) & (n_bucket - 1)) + 1]++;
+        }
+        for(i = 0; i < n_bucket; i++){
+            start[i + 1] += start[i];
+            heads[i] = -1;
+        }
+        for(i = 0; i < n_item; i++){
+            long b = dir_hash(items[i].fname, items[i].fext) & (n_bucket - 1);
+            sorted[start[b]++] = items[i]; //做完后start[b]是第b+1个桶的开头
+        }
+        for(i = 0; i < n_bucket && res == 0; i++){
+            long from = i == 0 ? 0 : start[i - 1];
+            if(start[i] > from && (heads[i] = dir_fill_bucket(dir, sorted + from, start[i] - from)) == -1){
+                res = -1;
+            }
+        }
+        if(res == -1){ //块不够，新写的都放掉，目录保持原样
+            for(i = 0; i < n_bucket; i++){
+                if(heads[i] != -1){
+                    clear_blocks(heads[i]);
+                }
+            }
+        }
+    }
+    if(res == 0){
+        //新的都写好了，再放掉原来的块，dir这一块留着做索引块
+        for(i = 0; i < n_old; i++){
+            if(old[i] == dir){
+                long next_blk = chain_next(dir);
+                if(next_blk != -1){
+                    clear_blocks(next_blk);
+                }
+            }
+            else if(old[i] != -1){
+                clear_blocks(old[i]);
+            }
+        }
+        char *disk_blk = get_block(dir, 0);
+        if(disk_blk == NULL){
+            res = -1;
+        }
+        else{
+            memset(disk_blk, 0, BLOCK_SIZE);
+            struct u_fs_dir_index *idx = (struct u_fs_dir_index *)disk_blk;
+            idx->n_bucket = n_bucket;
+            idx->n_item = n_item;
+            memcpy(idx->bucket, heads, n_bucket * sizeof(long));
+            put_block(dir, disk_blk, 1);
+            ch.next = -1;
+            ch.used = DIR_INDEXED;
+            chain_set(dir, &ch);
+        }
+    }
+    if(res == -1){
+        dcache_clear(); //dir_fill_bucket()记下的位置不算数了
+    }
+    free(sorted);
+    free(heads);
+    free(start);
+    free(items);
+    free(old);
+    return res;
+}
+
+static long dir_index_count(const long dir, const long delta){
+    struct u_fs_chain ch;
+    if(chain_get(dir, &ch) == -1 || ch.used != DIR_INDEXED){
+        return -1;
+    }
+    char *disk_blk = get_block(dir, 1);
+    if(disk_blk == NULL){
+        return -1;
+    }
+    struct u_fs_dir_index *idx = (struct u_fs_dir_index *)disk_blk;
+    idx->n_item += delta;
+    long n_item = idx->n_item;
+    put_block(dir, disk_blk, delta != 0);
+    return n_item;
+}
+
+static int dir_free(const long dir){
+    struct u_fs_chain ch;
+    if(chain_get(dir, &ch) == -1){
+        return -1;
+    }
+    if(ch.used == DIR_INDEXED){
+        char *disk_blk = get_block(dir, 1);
+        if(disk_blk == NULL){
+            return -1;
+        }
+        struct u_fs_dir_index *idx = (struct u_fs_dir_index *)disk_blk;
+        long i;
+        for(i = 0; i < idx->n_bucket; i++){
+            if(idx->bucket[i] != -1){
+                clear_blocks(idx->bucket[i]);
+            }
+        }
+        put_block(dir, disk_blk, 0);
+    }
+    return clear_blocks(dir);
+}
+
+static void fill_stat(struct u_fs_file_directory const * const item, struct stat *stbuf){
+	memset(stbuf, 0, sizeof(struct stat));
+	if(item->flag == 2){
+		stbuf->st_mode = S_IFDIR | 0666;
+        stbuf->st_size = item->fsize;
+	}
+	else if(item->flag == 1){
+		stbuf->st_mode = S_IFREG | 0666;
+		stbuf->st_size = item->fsize;
+		off_t end = dalloc_end(item->nStartBlock); //攒着没写下去的也算
+		if(end > stbuf->st_size){
+			stbuf->st_size = end;
+		}
+	}
+	//低层接口的inode号，路径接口不用
+	stbuf->st_ino = item->nStartBlock == ROOT_DIR_BLOCK ? FUSE_ROOT_ID : item->nStartBlock;
+}
+
+static int u_fs_getattr(const char *path, struct stat *stbuf,
+		       struct fuse_file_info *fi)
+{
+	(void) fi;
+
+	struct u_fs_file_directory* attr;
+	attr = malloc(sizeof(struct u_fs_file_directory));
+	long res = read_stat_from_path(path, attr);
+	if(res < 0){
+		free(attr);
+		return res == -2 ? -ENAMETOOLONG : -ENOENT;
+	}
+	fill_stat(attr, stbuf);
+	free(attr);
+    attr = NULL;
+	return 0;
+}
+
+static int u_fs_mkdir(const char *path, mode_t mode){
+    (void) mode;
+
+	if(strcmp(path, "/") == 0 || strcnt(path, '/') > 1
+    || strcnt(path, '.') != 0){
+		return -EPERM;
+	}
+    if(strlen(path) > (MAX_FILENAME - 1)){ //目录名过长
+        return -ENAMETOOLONG;
+    }
+    char dirname[MAX_FILENAME + 1];
+    sscanf(path, "/%s", dirname);
+
+    struct u_fs_file_directory item;
+    if(obj_lock(ROOT_DIR_BLOCK, 1) == -1){
+        return -ENOMEM;
+    }
+    if(dir_lookup(dirname, "", ROOT_DIR_BLOCK, &item) != -1){
+        obj_unlock(ROOT_DIR_BLOCK);
+        return -EEXIST; //存在同名的文件或目录
+    }
+	//没有重名，分配新目录的第一块，再给根目录添加一项
+	long free_blk = -1;
+	if(get_consecutive_free_blocks(1, &free_blk) != -1){
+		printf("No more space to mk or something error!");
+        obj_unlock(ROOT_DIR_BLOCK);
+		return -EPERM;
+	}
+    //新目录是空的，只需要重置它的块链表项
+    struct u_fs_chain ch = { -1, 0 };
+    chain_set(free_blk, &ch);
+    memset(&item, 0, sizeof(item));
+	strcpy(item.fname, dirname);
+	strcpy(item.fext, "");
+	item.fsize = BLOCK_SIZE;
+	item.nStartBlock = free_blk;
+	item.flag = 2; //for directory
+    if(dir_add(ROOT_DIR_BLOCK, &item) == -1){
+        printf("u_fs_mkdir(): dir_add failed!\n");
+        clear_blocks(free_blk);
+        obj_unlock(ROOT_DIR_BLOCK);
+        return -ENOSPC;
+    }
+    obj_unlock(ROOT_DIR_BLOCK);
+	return 0;
+}
+
+static int u_fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+			 off_t offset, struct fuse_file_info *fi,
+			 enum fuse_readdir_flags flags)
+{
+    (void) offset;
+	(void) fi;
+	(void) flags;
+    long next_blk = ROOT_DIR_BLOCK; //下一步想读的目录块
+    if(strcmp(path, "/") != 0){
+        if(strcnt(path, '/') > 1 || strlen(path) > (MAX_FILENAME + 1)
+        || strcnt(path, '.') != 0)
+        {
+            return -ENOENT;
+        }
+        char dirname[MAX_FILENAME + 1];
+        sscanf(path, "/%s", dirname);
+        next_blk = dir_lock(dirname, 0);
+        if(next_blk < 0){ //找不到或找到的不是目录
+            return next_blk == -2 ? -ENOMEM : -ENOENT;
+        }
+    }
+    else if(obj_lock(ROOT_DIR_BLOCK, 0) == -1){
+        return -ENOMEM;
+    }
+    filler(buf, ".", NULL, 0, 0); //printf(".\n");
+    filler(buf, "..", NULL, 0, 0); //printf("..\n");
+    //遍历目录，扫过的项记进目录项缓存，ls -l接着对每一项getattr时不用再扫目录
+    //属性也交给filler，低层接口就不用再查一次；整个过程拿着目录的读锁
+    const long dir_blk = next_blk;
+    char *disk_blk = malloc(BLOCK_SIZE);
+    struct u_fs_chain ch;
+    struct stat st;
+    struct u_fs_file_directory item;
+    struct u_fs_file_directory *dir = &item;
+    int offs = 0;
+    //没有索引的目录是一串目录块，有索引的目录一个桶一串
+    long n_chain = 1;
+    long *chains = malloc(sizeof(long));
+    if(chains == NULL || disk_blk == NULL){
+        free(chains);
+        free(disk_blk);
+        obj_unlock(dir_blk);
+        return -ENOMEM;
+    }
+    chains[0] = dir_blk;
+    if(chain_get(dir_blk, &ch) == 0 && ch.used == DIR_INDEXED && read_disk_block(dir_blk, disk_blk) == 0){
+        struct u_fs_dir_index *idx = (struct u_fs_dir_index *)disk_blk;
+        n_chain = idx->n_bucket;
+        free(chains);
+        chains = malloc(n_chain * sizeof(long));
+        if(chains == NULL){
+            free(disk_blk);
+            obj_unlock(dir_blk);
+            return -ENOMEM;
+        }
+        memcpy(chains, idx->bucket, n_chain * sizeof(long));
+    }
+    long i;
+    for(i = 0; i < n_chain; i++){
+        next_blk = chains[i];
+        while(next_blk != -1){
+            if(read_disk_block(next_blk, disk_blk) == -1 || chain_get(next_blk, &ch) == -1){
+                printf("u_fs_readdir(): read_disk_block failed\n");
+                free(chains);
+                free(disk_blk);
+                obj_unlock(dir_blk);
+                return -EIO;
+            }
+            long curr_blk = next_blk;
+            next_blk = ch.next;
+            offs = 0;
+            while(offs < ch.used){
+                dirent_load(disk_blk + offs, dir);
+                dcache_set(dir_blk, dir->fname, dir->fext, curr_blk, offs / DIRENT_SIZE);
+                fill_stat(dir, &st);
+                if(strcmp(dir->fext, "") ==0){
+                    filler(buf, dir->fname, &st, 0, 0);
+                }
+                else{
+                    char fdname[MAX_FILENAME + MAX_EXTENSION + 2];
+                    strcpy(fdname, dir->fname);
+                    strcat(fdname, ".");
+                    strcat(fdname, dir->fext);
+                    filler(buf, fdname, &st, 0, 0);
+                }
+                offs += DIRENT_SIZE;
+            }
+        }
+    }
+    free(chains);
+    free(disk_blk);
+    obj_unlock(dir_blk);
+    return 0;
+}
+
+static void *u_fs_init(struct fuse_conn_info *conn, struct fuse_config *cfg){
+	(void) cfg;
+
+	//mmap本身就走页缓存，和O_DIRECT同时开没有意义
+	//init NUM_TOTAL_BLOCK, BLOCK_SIZE ... !!!
+	if (load_superblock(DISKIMG_PATH) == -1) {
+		fprintf(stderr, "u_fs init unsuccessful!\n");
+		return NULL;
+	}
+	if (blkdev_open(DISKIMG_PATH, BLOCK_SIZE, options.direct && !options.mmap) == -1) {
+		fprintf(stderr, "u_fs init unsuccessful!\n");
+		return NULL;
+	}
+
+	long budget = CACHE_DEFAULT_SIZE;
+	if (options.cache_size != NULL) {
+		budget = parse_size(options.cache_size);
+	}
+	if (options.mmap) {
+		//映射区本身就在页缓存里，再开块缓存就缓存两份了
+		if (blkdev_mmap() == 0) {
+			budget = 0;
+		}
+		else {
+			fprintf(stderr, "u_fs: mmap failed, falling back to pread/pwrite\n");
+		}
+	}
+	if (cache_init(budget) == -1) {
+		fprintf(stderr, "u_fs: block cache disabled\n");
+	}
+	//低层接口的read给出diskimg的fd，让libfuse用splice回复；O_DIRECT模式下给的是内存
+	if (conn != NULL && !blkdev.direct) {
+		conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+	}
+	if (bitmap_load() == -1 || chain_load() == -1) {
+		fprintf(stderr, "u_fs init unsuccessful!\n");
+		return NULL;
+	}
+	if (options.io_uring && uring_init() == -1) {
+		fprintf(stderr, "u_fs: io_uring unavailable, using preadv/pwritev\n");
+	}
+	long ra_max = RA_DEFAULT_SIZE;
+	if (options.readahead != NULL) {
+		ra_max = parse_size(options.readahead);
+	}
+	if (ra_init(ra_max) == -1) {
+		fprintf(stderr, "u_fs: readahead disabled\n");
+	}
+	dalloc.max = DALLOC_DEFAULT_SIZE;
+	if (options.delalloc != NULL) {
+		dalloc.max = parse_size(options.delalloc);
+	}
+	if (dalloc_init() == -1) {
+		fprintf(stderr, "u_fs: delayed allocation disabled\n");
+		dalloc.max = 0;
 	}
-	fseek(fp, 0, SEEK_SET);
-	struct sb *sblk = malloc(sizeof(struct sb));
-	fread(sblk, sizeof(struct sb), 1, fp);
-
-	//init NUM_TOTAL_BLOCK!!!
-	NUM_TOTAL_BLOCK = sblk->fs_size;
-	fclose(fp);
-	free(sblk);
-	sblk = NULL;
 	printf("u_fs init success!\n");
 	return NULL;
 }
 
+static void u_fs_destroy(void *private_data){
+	(void) private_data;
+	dalloc_exit();
+	dalloc_commit_all(0); //还没提交的数据先写下去
+	char stat[256];
+	cache_stat(stat, sizeof(stat));
+	printf("u_fs cache: %s", stat);
+	printf("u_fs readahead: issued=%lu dropped=%lu\n", ra.issued, ra.dropped);
+	printf("u_fs dcache: entries=%ld hits=%lu misses=%lu\n", dcache.n, dcache.hits, dcache.misses);
+	ra_exit();
+	dcache_clear();
+	chain_destroy();
+	bitmap_destroy();
+	cache_destroy();
+	uring_exit();
+	blkdev_close();
+}
+
 static int u_fs_open(const char *path, struct fuse_file_info *fi){
-    (void) path;
-    (void) fi;
+    struct u_fs_file_directory f_dir;
+    long dir;
+    long res = lookup_path(path, &f_dir, &dir);
+    if(res < 0){
+        return res == -2 ? -ENAMETOOLONG : -ENOENT;
+    }
+    struct u_fs_fh *fh = malloc(sizeof(struct u_fs_fh));
+    if(fh == NULL){
+        return -ENOMEM;
+    }
+    fh_init(fh, f_dir.nStartBlock);
+    fh->path = strdup(path);
+    //目录项的位置在这里找好，以后读写都不用再解析路径
+    if(dir != -1){
+        fh->dir = dir;
+        strcpy(fh->fname, f_dir.fname);
+        strcpy(fh->fext, f_dir.fext);
+        if(fh_entry(fh, &f_dir) == -1){ //刚找到就被删掉了
+            fh_destroy(fh);
+            free(fh);
+            return -ENOENT;
+        }
+    }
+    fi->fh = (uintptr_t)fh;
     return 0;
 }
 
+static int u_fs_release(const char *path, struct fuse_file_info *fi){
+    (void) path;
+    struct u_fs_fh *fh = (struct u_fs_fh *)(uintptr_t)fi->fh;
+    if(fh == NULL){
+        return 0;
+    }
+    pthread_mutex_lock(&fh->lock);
+    while(fh->ra_pending){ //后台预读还拿着这个fh
+        pthread_cond_wait(&fh->idle, &fh->lock);
+    }
+    pthread_mutex_unlock(&fh->lock);
+    int res = fh_commit(fh); //一般flush时已经提交过了
+    if(res == -1){ //fh马上要释放，不能再挂在链表上
+        printf("u_fs_release(): %s: uncommitted data lost\n", fh->path);
+        dalloc_drop(fh->start);
+    }
+    fh_destroy(fh);
+    free(fh);
+    fi->fh = 0;
+    return res == -1 ? -EIO : 0;
+}
+
 static int u_fs_truncate(const char *path, off_t size, struct fuse_file_info *fi){
+    if(size < 0){
+        return -EINVAL;
+    }
+    struct u_fs_file_directory f_dir;
+    long dir;
+    struct u_fs_fh *ofh = fi != NULL ? (struct u_fs_fh *)(uintptr_t)fi->fh : NULL;
+    long file_addr = file_lock(path, ofh, &f_dir, &dir, OLOCK_SYNC); //攒着的数据先写下去
+    if(file_addr < 0){
+        return file_addr;
+    }
+    if(f_dir.flag == 2){
+        obj_unlock(f_dir.nStartBlock);
+        return -EISDIR;
+    }
+    int res = 0;
+    if((size_t)size > f_dir.fsize){ //变长：多出来的部分要读成0
+        struct u_fs_fh tmp_fh;
+        struct u_fs_fh *fh = ofh;
+        if(fh == NULL || fh->start != f_dir.nStartBlock){
+            fh_init(&tmp_fh, f_dir.nStartBlock);
+            fh = &tmp_fh;
+        }
+        if(file_zero(fh, f_dir.fsize, size) == -1){
+            res = -ENOSPC;
+        }
+        if(fh == &tmp_fh){
+            fh_destroy(&tmp_fh);
+        }
+    }
+    else if(file_free_from(f_dir.nStartBlock, (size + BLOCK_SIZE - 1) >> BLOCK_SHIFT) == -1){
+        res = -EIO; //变短：新文件尾后面的块一次释放
+    }
+    if(res == 0 && (size_t)size != f_dir.fsize){
+        f_dir.fsize = size;
+        if(ofh != NULL && ofh->dir != -1){
+            fh_store(ofh, &f_dir);
+        }
+        else{
+            write_stat_from_block(dir, &f_dir);
+        }
+    }
+    obj_unlock(f_dir.nStartBlock);
+    return res;
+}
+
+static int u_fs_flush(const char *path, struct fuse_file_info *fi){
     (void) path;
-    (void) size;
-    (void) fi;
+    //close()时提交攒着的数据，把脏块写回diskimg，mmap模式下msync映射区
+    struct u_fs_fh *fh = (struct u_fs_fh *)(uintptr_t)fi->fh;
+    if(fh != NULL && fh_commit(fh) == -1){
+        return -EIO;
+    }
+    if(bitmap_sync() == -1 || chain_sync() == -1 || cache_sync() == -1 || blkdev_msync() == -1){
+        return -EIO;
+    }
     return 0;
 }
 
-static int u_fs_flush(const char *path, struct fuse_file_info *fi){
+static int u_fs_fsync(const char *path, int datasync, struct fuse_file_info *fi){
     (void) path;
-    (void) fi;
+    (void) datasync;
+    struct u_fs_fh *fh = (struct u_fs_fh *)(uintptr_t)fi->fh;
+    if(fh != NULL && fh_commit(fh) == -1){
+        return -EIO;
+    }
+    if(bitmap_sync() == -1 || chain_sync() == -1 || cache_sync() == -1 || blkdev_sync() == -1){
+        return -EIO;
+    }
     return 0;
 }
 
+static int u_fs_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi){
+    if(mode & ~FALLOC_FL_KEEP_SIZE){ //打洞、清零这些还不支持
+        return -EOPNOTSUPP;
+    }
+    if(offset < 0 || length <= 0){
+        return -EINVAL;
+    }
+    struct u_fs_file_directory f_dir;
+    long dir;
+    struct u_fs_fh *fh = fi != NULL ? (struct u_fs_fh *)(uintptr_t)fi->fh : NULL;
+    long file_addr = file_lock(path, fh, &f_dir, &dir, OLOCK_SYNC); //攒着的数据先写下去
+    if(file_addr < 0){
+        return file_addr;
+    }
+    if(f_dir.flag == 2){
+        obj_unlock(f_dir.nStartBlock);
+        return -EISDIR;
+    }
+    struct u_fs_fh tmp_fh;
+    if(fh == NULL || fh->start != f_dir.nStartBlock){
+        fh_init(&tmp_fh, f_dir.nStartBlock);
+        fh = &tmp_fh;
+    }
+    //先记下文件里面哪些块是空洞，分配之后这些块要清零；文件尾后面的块等文件变长时再清零
+    long first = offset >> BLOCK_SHIFT;
+    long end = (offset + length + BLOCK_SIZE - 1) >> BLOCK_SHIFT;
+    long n_file = (f_dir.fsize + BLOCK_SIZE - 1) >> BLOCK_SHIFT;
+    long n_in = (end < n_file ? end : n_file) - first; //范围里在文件里面的块
+    char *hole = n_in > 0 ? calloc(n_in, 1) : NULL;
+    long *blks;
+    long i;
+    int res = 0;
+    if(n_in > 0){
+        long n = fh_map(fh, first, first + n_in, 0, &blks);
+        for(i = 0; i < n_in; i++){
+            hole[i] = i >= n || blks[i] == -1;
+        }
+    }
+    //整段一次分配，尽量是一段连续的块
+    long n_got = fh_map(fh, first, end, 1, &blks);
+    if(n_got < end - first){
+        res = n_got == -1 ? -EIO : -ENOSPC;
+    }
+    for(i = 0; i < n_got && i < end - first && blks[i] != -1; i++){
+    }
+    if(i < end - first && res == 0){
+        res = -ENOSPC;
+    }
+    long n_ok = i;
+    for(i = 0; i < n_in && i < n_ok; i++){
+        if(hole[i]){
+            char *disk_blk = get_block(blks[i], 0);
+            if(disk_blk == NULL){
+                res = -EIO;
+                break;
+            }
+            memset(disk_blk, 0, BLOCK_SIZE);
+            put_block(blks[i], disk_blk, 1);
+        }
+    }
+    free(hole);
+    //文件变长的话，原来文件尾后面的字节都要读成0
+    if(res == 0 && !(mode & FALLOC_FL_KEEP_SIZE) && (size_t)(offset + length) > f_dir.fsize){
+        if(file_zero(fh, f_dir.fsize, offset + length) == -1){
+            res = -ENOSPC;
+        }
+        else if(fh != &tmp_fh && fh->dir != -1){
+            f_dir.fsize = offset + length;
+            fh_store(fh, &f_dir);
+        }
+        else{
+            f_dir.fsize = offset + length;
+            write_stat_from_block(dir, &f_dir);
+        }
+    }
+    if(fh == &tmp_fh){
+        fh_destroy(&tmp_fh);
+    }
+    obj_unlock(f_dir.nStartBlock);
+    return res;
+}
+
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 8)
+static off_t u_fs_lseek(const char *path, off_t off, int whence, struct fuse_file_info *fi){
+    if(whence != SEEK_DATA && whence != SEEK_HOLE){ //别的whence内核自己处理
+        return -EINVAL;
+    }
+    struct u_fs_file_directory f_dir;
+    struct u_fs_fh *fh = fi != NULL ? (struct u_fs_fh *)(uintptr_t)fi->fh : NULL;
+    long file_addr = file_lock(path, fh, &f_dir, NULL, OLOCK_READ);
+    if(file_addr < 0){
+        return file_addr;
+    }
+    //extent拷一份出来就可以放锁了
+    struct u_fs_extmap m;
+    int loaded = -1;
+    if(f_dir.flag == 1 && FS_VERSION == U_FS_VERSION_EXTENT){
+        loaded = ext_load(f_dir.nStartBlock, &m);
+    }
+    obj_unlock(f_dir.nStartBlock);
+    if(f_dir.flag == 2){
+        return -EISDIR;
+    }
+    off_t fsize = f_dir.fsize;
+    if(off < 0 || off >= fsize){
+        if(loaded == 0){
+            ext_release(&m);
+        }
+        return -ENXIO;
+    }
+    if(FS_VERSION == U_FS_VERSION_CHAIN){ //块链表没有空洞，只有文件尾一个
+        return whence == SEEK_DATA ? off : fsize;
+    }
+    if(loaded == -1){
+        return -EIO;
+    }
+    long lblk = off >> BLOCK_SHIFT;
+    long k = ext_lookup(&m, lblk);
+    off_t res;
+    if(whence == SEEK_DATA){
+        if(k != -1){
+            res = off;
+        }
+        else{ //在空洞里，下一段有块的地方就是数据
+            k = ext_after(&m, lblk);
+            res = k < m.n ? (off_t)m.ext[k].lblk << BLOCK_SHIFT : fsize;
+            if(res >= fsize){
+                res = -ENXIO;
+            }
+        }
+    }
+    else{
+        if(k == -1){
+            res = off;
+        }
+        else{ //沿着首尾相接的extent往后走，第一个接不上的地方就是空洞
+            long e = m.ext[k].lblk + m.ext[k].len;
+            while(k + 1 < m.n && m.ext[k + 1].lblk == e){
+                k++;
+                e += m.ext[k].len;
+            }
+            res = (off_t)e << BLOCK_SHIFT;
+            if(res > fsize){
+                res = fsize;
+            }
+        }
+    }
+    ext_release(&m);
+    return res;
+}
+#endif
+
+static int u_fs_getxattr(const char *path, const char *name, char *value, size_t size){
+    if(strcmp(path, "/") != 0 || strcmp(name, XATTR_CACHE_STAT) != 0){
+        return -ENODATA;
+    }
+    char stat[256];
+    int len = cache_stat(stat, sizeof(stat));
+    if(size == 0){ //只是问属性有多长
+        return len;
+    }
+    if(size < len){
+        return -ERANGE;
+    }
+    memcpy(value, stat, len);
+    return len;
+}
+
+static int u_fs_listxattr(const char *path, char *list, size_t size){
+    if(strcmp(path, "/") != 0){
+        return 0;
+    }
+    int len = sizeof(XATTR_CACHE_STAT); //包括结尾的\0
+    if(size == 0){
+        return len;
+    }
+    if(size < len){
+        return -ERANGE;
+    }
+    memcpy(list, XATTR_CACHE_STAT, len);
+    return len;
+}
+
 static int u_fs_rmdir(const char *path){
 	if(strcmp(path, "/") == 0 || strcnt(path, '/') > 1
     || strcnt(path, '.') != 0){ //目录名中不能包含‘.’
@@ -979,18 +5757,39 @@ static int u_fs_rmdir(const char *path){
         free(tmp_dir);
         return -ENOTDIR;
     }
+    //先拿目录自己的写锁，里面不会再有新建的文件，再拿根目录的写锁重新找一次这一项
+    long dir = dir_lock(dirname, 1);
+    if(dir < 0){
+        free(tmp_dir);
+        return dir == -2 ? -ENOMEM : -ENOENT;
+    }
+    if(obj_lock(ROOT_DIR_BLOCK, 1) == -1){
+        obj_unlock(dir);
+        free(tmp_dir);
+        return -ENOMEM;
+    }
+    res = dir_lookup(dirname, "", ROOT_DIR_BLOCK, tmp_dir);
     //判断是不是空目录
-	struct u_fs_disk_block* disk_blk;	
-    disk_blk = malloc(sizeof(struct u_fs_disk_block));
-	read_disk_block(tmp_dir->nStartBlock, disk_blk);
-	if(disk_blk->size > 0){
+	struct u_fs_chain ch;
+	if(res == -1 || chain_get(dir, &ch) == -1){
+        obj_unlock(ROOT_DIR_BLOCK);
+        obj_unlock(dir);
+		free(tmp_dir);
+		return res == -1 ? -ENOENT : -EIO;
+	}
+	if(ch.used > 0 || dir_index_count(dir, 0) > 0){
 		printf("u_fs_rmdir(): it is not a empty dir!\n");
+        obj_unlock(ROOT_DIR_BLOCK);
+        obj_unlock(dir);
 		free(tmp_dir);
-		free(disk_blk);
 		return -ENOTEMPTY;
 	}
 	//是空目录，开始删除目录(res)
-	if(rm_item(res, tmp_dir) == -1){
+    int rm = rm_item(ROOT_DIR_BLOCK, res, tmp_dir);
+    obj_unlock(ROOT_DIR_BLOCK);
+    obj_unlock(dir);
+    free(tmp_dir);
+	if(rm == -1){
 		printf("u_fs_rmdir(): rm_item() failed!\n");
 		return -ENOENT;
 	}
@@ -1013,242 +5812,525 @@ static int u_fs_mknod(const char *path, mode_t mode, dev_t rdev){
         return -EPERM;
     }
     
-    struct u_fs_file_directory *tmp;
-    tmp = malloc(sizeof(struct u_fs_file_directory));
-    long curr_blk = read_stat_in_rootdir(dirname, "", tmp);
-    if(curr_blk == -1 || tmp->flag != 2){ //提供的文件夹没找到
-        return -EPERM;
+    struct u_fs_file_directory item;
+    long dir_blk = dir_lock(dirname, 1); //查重名到添加一项都拿着目录的写锁
+    if(dir_blk < 0){ //提供的文件夹没找到
+        return dir_blk == -2 ? -ENOMEM : -EPERM;
     }
-    
-    //遍历二级目录
-    struct u_fs_disk_block *disk_blk = malloc(sizeof(struct u_fs_disk_block));
-    struct u_fs_file_directory *dir = (struct u_fs_file_directory *)disk_blk->data;
-    //long curr_blk = 0; //目前在sb块
-    long next_blk = tmp->nStartBlock;; //下一步想读的二级目录块
-    free(tmp);
-    int offset = 0;
-    while(next_blk != -1){
-        read_disk_block(next_blk, disk_blk);
-        curr_blk = next_blk; //读完了，当前块移动到next_blk
-        next_blk = disk_blk->nNextBlock;
-        offset = 0;
-        dir = (struct u_fs_file_directory *)disk_blk->data;
-        while(offset < disk_blk->size){
-            if(strcmp(dir->fname, fname) == 0
-            && strcmp(dir->fext, fext) == 0){
-                free(disk_blk);
-                return -EEXIST; //存在同名的文件
-            }
-            dir++;
-            offset += sizeof(struct u_fs_file_directory);
-        }
+    if(dir_lookup(fname, fext, dir_blk, &item) != -1){
+        obj_unlock(dir_blk);
+        return -EEXIST; //存在同名的文件
     }
 
-	/**
-	 * 遍历结束(此时没有重名)，添加新目录项给根目录，同时分配新文件空间
-	 */
-	if((offset + sizeof(struct u_fs_file_directory)) > MAX_DATA_IN_BLOCK)
-	{ //二级目录的这个块刚好满了
-        long free_blk = enlarge_a_block(curr_blk, disk_blk);
-		if(free_blk == -1){
-            printf("u_fs_mknod(): enlarge wrong!\n");
-            free(disk_blk);
-            return -errno;
-        }
-        read_disk_block(free_blk, disk_blk);
-        curr_blk = free_blk;
-        next_blk = -1;
-	}
-	//添加新目录项，并写回
+	//没有重名，分配新文件的第一块，再给二级目录添加一项
 	long free_blk = -1;
 	if(get_consecutive_free_blocks(1, &free_blk) != -1){
 		printf("No more space to mk or something error!");
+        obj_unlock(dir_blk);
 		return -EPERM;
 	}
-    //在根目录添加一条新纪录
-	strcpy(dir->fname, fname);
-	strcpy(dir->fext, fext);
-	dir->fsize = 0;
-	dir->nStartBlock = free_blk;
-	dir->flag = 1; //for file
-	disk_blk->size += sizeof(struct u_fs_file_directory);
-	write_disk_block(curr_blk, disk_blk);
-    //分配新文件空间，写回
-	read_disk_block(free_blk, disk_blk);
-	disk_blk->size = 0;
-	disk_blk->nNextBlock = -1;
-    disk_blk->data[0] = '\0';
-	write_disk_block(free_blk, disk_blk);
-	free(disk_blk);
+    //新文件还没有内容，只需要重置它的块链表项
+    struct u_fs_chain ch = { -1, 0 };
+    chain_set(free_blk, &ch);
+    if(FS_VERSION == U_FS_VERSION_EXTENT){ //这一块是文件的extent索引块，还没有extent
+        char *disk_blk = calloc(1, BLOCK_SIZE);
+        ((struct u_fs_ext_head *)disk_blk)->next = -1;
+        write_disk_block(free_blk, disk_blk);
+        free(disk_blk);
+    }
+    memset(&item, 0, sizeof(item));
+	strcpy(item.fname, fname);
+	strcpy(item.fext, fext);
+	item.fsize = 0;
+	item.nStartBlock = free_blk;
+	item.flag = 1; //for file
+    if(dir_add(dir_blk, &item) == -1){
+        printf("u_fs_mknod(): dir_add failed!\n");
+        clear_blocks(free_blk);
+        obj_unlock(dir_blk);
+        return -ENOSPC;
+    }
+    obj_unlock(dir_blk);
     return 0;
 }
 
 static int u_fs_read(const char *path, char *buf, size_t size, off_t offset,
 		    struct fuse_file_info *fi)
 {
-    (void) fi;
-
 	struct u_fs_file_directory* f_dir;
     f_dir = malloc(sizeof(struct u_fs_file_directory));
-    //读取文件所在位置
-    long curr_blk = read_stat_from_path(path, f_dir);
-    if(curr_blk == -1){ //找不到文件
+    //读取文件所在位置，拿着文件的读锁读，攒着没写下去的数据file_lock()会先提交
+    long curr_blk = file_lock(path, (struct u_fs_fh *)(uintptr_t)fi->fh, f_dir, NULL, OLOCK_READ);
+    if(curr_blk < 0){ //找不到文件
 		free(f_dir);
-		return -ENOENT;
+		return curr_blk;
 	}
+    long start = f_dir->nStartBlock;
     if(f_dir->flag == 2){ //找到的是tmd目录
+        obj_unlock(start);
         free(f_dir);
 		return -EISDIR;
     }
 
-    if(offset > f_dir->fsize){
-        free(f_dir);
-        return 0; //offset跑出文件大小了，肯定读不对
+    if(offset >= f_dir->fsize){
+        obj_unlock(start);
+        free(f_dir);
+        return 0; //offset跑出文件大小了，肯定读不对
+    }
+    if(offset + size > f_dir->fsize){ //最多读到文件尾
+        size = f_dir->fsize - offset;
+    }
+    
+    long n_file = (f_dir->fsize + BLOCK_SIZE - 1) >> BLOCK_SHIFT;
+    free(f_dir);
+    f_dir = NULL;
+
+    //没有经过u_fs_open()的话用一个临时的，用完就扔；同一个fh可能有几个线程同时在读，块号表要拿fh->lock
+    struct u_fs_fh tmp_fh;
+    struct u_fs_fh *fh = (struct u_fs_fh *)(uintptr_t)fi->fh;
+    if(fh == NULL || fh->start != start){
+        fh_init(&tmp_fh, start);
+        fh = &tmp_fh;
+    }
+    else{
+        pthread_mutex_lock(&fh->lock);
+    }
+    //这次要用的块直接查块号表，一批提交；表往后多建一些，顺序读的时候不用每次都查
+    off_t curr_offset = offset & (BLOCK_SIZE - 1);
+    long first_idx = offset >> BLOCK_SHIFT;
+    long n_need = (curr_offset + size + BLOCK_SIZE - 1) >> BLOCK_SHIFT;
+    long end = first_idx + n_need + FH_MAP_AHEAD < n_file ? first_idx + n_need + FH_MAP_AHEAD : n_file;
+    long *blks;
+    long n_got = fh_map(fh, first_idx, end > first_idx + n_need ? end : first_idx + n_need, 0, &blks);
+    if(n_got == -1){
+        if(fh == &tmp_fh){
+            fh_destroy(&tmp_fh);
+        }
+        else{
+            pthread_mutex_unlock(&fh->lock);
+        }
+        obj_unlock(start);
+        return -EIO;
+    }
+    long next_blk = -1; //预读从下一块接着读
+    if(n_got > n_need){
+        next_blk = blks[n_need];
+        n_got = n_need;
+    }
+    if(n_got > 0){
+        cache_prefetch_blocks(blks, n_got); //空洞（-1）会被跳过
+    }
+
+    //可以开始读啦！块直接用get_block()拿指针，数据从块里直接拷进FUSE的buf
+    //每次执行memcpy后，要将目标数组地址增加到下一次读出数据存放的地址
+    char *disk_blk;
+    size_t r_size = 0; //已经读了的内容
+    long i;
+    for(i = 0; i < n_need; i++){
+        size_t need_read = BLOCK_SIZE - curr_offset;
+        if(need_read > size - r_size){ //这个块读的完
+            need_read = size - r_size;
+        }
+        if(i >= n_got || blks[i] == -1){ //空洞，或者文件尾没有块的部分，读成0
+            memset(buf + r_size, 0, need_read);
+        }
+        else{
+            if((disk_blk = get_block(blks[i], 1)) == NULL){
+                break;
+            }
+            memcpy(buf + r_size, disk_blk + curr_offset, need_read);
+            put_block(blks[i], disk_blk, 0);
+        }
+        r_size += need_read;
+        curr_offset = 0; //后面的块肯定都是从块头开始读的
+    }
+    if(fh == &tmp_fh){
+        fh_destroy(&tmp_fh);
+    }
+    else{
+        pthread_mutex_unlock(&fh->lock);
+    }
+    obj_unlock(start);
+    if(fh != &tmp_fh && i == n_need){ //读完了，或者没有下一个块可以读了
+        ra_update(fh, offset, r_size, next_blk);
+    }
+    return r_size; //退出，读成功
+}
+
+static int u_fs_write(const char *path, const char *buf, size_t size,
+		     off_t offset, struct fuse_file_info *fi)
+{
+    struct u_fs_fh *fh = (struct u_fs_fh *)(uintptr_t)fi->fh;
+    struct u_fs_file_directory f_dir;
+    long file_addr = file_lock(path, fh, &f_dir, NULL, OLOCK_WRITE);
+    if(file_addr < 0){
+        return file_addr;
+    }
+    int res = 0;
+    if(fh != NULL && dalloc.max > 0){ //往文件尾追加的先攒着，不分配块
+        res = dalloc_write(fh, path, buf, size, offset);
+    }
+    if(res == 0){
+        res = write_file(path, buf, size, offset, fh);
+    }
+    obj_unlock(f_dir.nStartBlock);
+    return res;
+}
+
+static int file_bufvec(const char *path, struct fuse_file_info *fi, size_t size, off_t offset,
+            struct fuse_bufvec **bufp, long *start){
+    struct u_fs_fh *ofh = fi != NULL ? (struct u_fs_fh *)(uintptr_t)fi->fh : NULL;
+    struct u_fs_file_directory f_dir;
+    long file_addr = file_lock(path, ofh, &f_dir, NULL, OLOCK_READ);
+    if(file_addr < 0){
+        return file_addr;
+    }
+    *start = f_dir.nStartBlock;
+    if(f_dir.flag == 2){
+        obj_unlock(*start);
+        return -EISDIR;
+    }
+    if(offset >= (off_t)f_dir.fsize){
+        size = 0;
+    }
+    else if(offset + size > f_dir.fsize){ //最多读到文件尾
+        size = f_dir.fsize - offset;
+    }
+    long first_idx = offset >> BLOCK_SHIFT;
+    off_t in_blk = offset & (BLOCK_SIZE - 1);
+    long n_need = size > 0 ? (in_blk + size + BLOCK_SIZE - 1) >> BLOCK_SHIFT : 0;
+    long *blks = NULL;
+    long n_got = 0;
+    struct u_fs_fh tmp_fh;
+    struct u_fs_fh *fh = ofh;
+    if(n_need > 0){
+        if(fh == NULL || fh->start != *start){
+            fh_init(&tmp_fh, *start);
+            fh = &tmp_fh;
+        }
+        else{
+            pthread_mutex_lock(&fh->lock);
+        }
+        n_got = fh_map(fh, first_idx, first_idx + n_need, 0, &blks);
+    }
+    //每块看是从diskimg读还是放在内存里：空洞（文件尾的块没分配时n_got < n_need）是全0，
+    //在缓存里的块拷出来，这样不用先写回，也不会把缓存里的块读两遍
+    int res = n_got < 0 ? -EIO : 0;
+    char *in_fd = res == 0 && n_need > 0 ? malloc(n_need) : NULL;
+    if(res == 0 && n_need > 0 && in_fd == NULL){
+        res = -ENOMEM;
+    }
+    long n_run = 0;
+    long i;
+    for(i = 0; res == 0 && i < n_need; i++){
+        in_fd[i] = i < n_got && blks[i] != -1 && !cache_resident(blks[i]);
+        if(i == 0 || in_fd[i] != in_fd[i - 1] || (in_fd[i] && blks[i] != blks[i - 1] + 1)){
+            n_run++; //diskimg上接着的块合成一段，连着的内存块也合成一段
+        }
+    }
+    struct fuse_bufvec *v = NULL;
+    if(res == 0){
+        v = calloc(1, sizeof(struct fuse_bufvec) + (n_run > 1 ? n_run - 1 : 0) * sizeof(struct fuse_buf));
+        res = v == NULL ? -ENOMEM : 0;
+    }
+    if(res == 0){
+        v->count = n_run > 0 ? n_run : 1; //读到文件尾后面时是一段空的
+        long k = -1;
+        for(i = 0; i < n_need; i++){
+            off_t from = i == 0 ? in_blk : 0; //这一块里从哪里读到哪里
+            off_t to = i == n_need - 1 ? in_blk + size - ((off_t)i << BLOCK_SHIFT) : BLOCK_SIZE;
+            if(i == 0 || in_fd[i] != in_fd[i - 1] || (in_fd[i] && blks[i] != blks[i - 1] + 1)){
+                k++;
+                if(in_fd[i]){
+                    v->buf[k].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+                    v->buf[k].fd = blkdev.fd;
+                    v->buf[k].pos = ((off_t)blks[i] << BLOCK_SHIFT) + from;
+                }
+                else{
+                    v->buf[k].fd = -1;
+                }
+            }
+            v->buf[k].size += to - from;
+        }
+        for(k = 0; k < n_run; k++){
+            if(!(v->buf[k].flags & FUSE_BUF_IS_FD) && (v->buf[k].mem = calloc(1, v->buf[k].size)) == NULL){
+                res = -ENOMEM;
+            }
+        }
+        //再把缓存里的块拷进对应的内存段，刚才看的时候在缓存里、现在被淘汰了的，cache_pin()会重新读进来
+        char *dst = NULL;
+        k = -1;
+        for(i = 0; res == 0 && i < n_need; i++){
+            off_t from = i == 0 ? in_blk : 0;
+            off_t to = i == n_need - 1 ? in_blk + size - ((off_t)i << BLOCK_SHIFT) : BLOCK_SIZE;
+            if(i == 0 || in_fd[i] != in_fd[i - 1] || (in_fd[i] && blks[i] != blks[i - 1] + 1)){
+                k++;
+                dst = v->buf[k].mem;
+            }
+            if(in_fd[i]){
+                continue;
+            }
+            if(i < n_got && blks[i] != -1){
+                char *data = cache_pin(blks[i], 1);
+                if(data == NULL){
+                    res = -EIO;
+                    break;
+                }
+                memcpy(dst, data + from, to - from);
+                cache_unpin(blks[i], 0);
+            }
+            dst += to - from;
+        }
+    }
+    free(in_fd);
+    if(fh == &tmp_fh){
+        fh_destroy(&tmp_fh);
+    }
+    else if(n_need > 0){
+        pthread_mutex_unlock(&fh->lock);
+    }
+    if(res != 0){
+        bufvec_free(v);
+        obj_unlock(*start);
+        return res;
+    }
+    *bufp = v;
+    return 0;
+}
+
+static void bufvec_free(struct fuse_bufvec *v){
+    if(v == NULL){
+        return;
     }
-    
-    struct u_fs_disk_block *disk_blk;
-	disk_blk = malloc(sizeof(struct u_fs_disk_block));
-    read_disk_block(f_dir->nStartBlock, disk_blk);
-    curr_blk = f_dir->nStartBlock; //curr_blk在文件的起始块
-    long next_blk = disk_blk->nNextBlock; //next_blk指向文件下一个块，如果没有下一个则为-1
-    free(f_dir);
-    f_dir = NULL;
+    size_t i;
+    for(i = 0; i < v->count; i++){
+        if(!(v->buf[i].flags & FUSE_BUF_IS_FD)){
+            free(v->buf[i].mem);
+        }
+    }
+    free(v);
+}
 
-    //首先根据offset移动到开始块（由于每个块能实际保存MAX_DATA_IN_BLOCK实际为496）
-    long ignore_nblock = offset / MAX_DATA_IN_BLOCK;
-    int i;
-    for(i = 0; i < ignore_nblock; i++){
-        if(next_blk == -1){//说明offset在文件尾，再读都没用了
-            free(disk_blk);
-            disk_blk = NULL;
-            return 0;
+static int u_fs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi){
+    size_t size = fuse_buf_size(buf);
+    //只有一段内存的话直接写，不用再拷一份
+    if(buf->count == 1 && buf->idx == 0 && buf->off == 0 && !(buf->buf[0].flags & FUSE_BUF_IS_FD)){
+        return u_fs_write(path, buf->buf[0].mem, size, offset, fi);
+    }
+    //从/dev/fuse splice进来的数据在管道里，要经过块缓存和延迟分配，不能直接splice进diskimg，先拷进内存
+    char *mem = malloc(size > 0 ? size : 1);
+    if(mem == NULL){
+        return -ENOMEM;
+    }
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    dst.buf[0].mem = mem;
+    ssize_t n = fuse_buf_copy(&dst, buf, 0);
+    int res = n < 0 ? (int)n : u_fs_write(path, mem, n, offset, fi);
+    free(mem);
+    return res;
+}
+
+static int file_zero(struct u_fs_fh *fh, const off_t from, const off_t to){
+    long first = from >> BLOCK_SHIFT;
+    long end = (to + BLOCK_SIZE - 1) >> BLOCK_SHIFT;
+    long *blks;
+    long n = fh_map(fh, first, end, FS_VERSION == U_FS_VERSION_CHAIN, &blks);
+    if(n == -1 || (FS_VERSION == U_FS_VERSION_CHAIN && n < end - first)){
+        return -1;
+    }
+    long i;
+    for(i = 0; i < n && first + i < end; i++){
+        if(blks[i] == -1){ //空洞本来就读成0
+            continue;
         }
-        read_disk_block(next_blk, disk_blk);
-        curr_blk = next_blk;
-        next_blk = disk_blk->nNextBlock;
+        off_t b_from = i == 0 ? from & (BLOCK_SIZE - 1) : 0;
+        off_t b_to = (off_t)(first + i + 1) << BLOCK_SHIFT > to ? to - ((off_t)(first + i) << BLOCK_SHIFT) : BLOCK_SIZE;
+        char *disk_blk = get_block(blks[i], b_from > 0 || b_to < BLOCK_SIZE);
+        if(disk_blk == NULL){
+            return -1;
+        }
+        memset(disk_blk + b_from, 0, b_to - b_from);
+        put_block(blks[i], disk_blk, 1);
     }
+    return 0;
+}
 
-    //可以开始写啦！curr_blk为当前块的位置哦
-    //如果要追加数据，则每次执行memcpy后，要将目标数组地址增加到你要追加数据的地址
-    off_t curr_offset = offset % MAX_DATA_IN_BLOCK;
-    size_t buf_remain_size = size; //剩余要读的内容
-    if(buf_remain_size <= (MAX_DATA_IN_BLOCK - curr_offset)){ //如果刚好这个块能读完
-        memcpy(buf, disk_blk->data + curr_offset, buf_remain_size);
-        free(disk_blk);
-        disk_blk = NULL;
-        return size; //退出，刚好读完所有
-    } 
-    //要读的size很大，得慢慢读了
-    //先读完这个块
-    memcpy(buf, disk_blk->data + curr_offset, (MAX_DATA_IN_BLOCK - curr_offset));
-    //开始读剩下的块，肯定都是从块头开始读的
-    buf_remain_size -= (MAX_DATA_IN_BLOCK - curr_offset);
-    size_t r_size = 0 + (MAX_DATA_IN_BLOCK - curr_offset);
-    size_t need_read = MAX_DATA_IN_BLOCK;
-    while(buf_remain_size > 0){
-        if(next_blk == -1){ //没有下一个块可以读了
-            return r_size;
+static int file_free_from(const long start, const long lblk){
+    if(FS_VERSION == U_FS_VERSION_EXTENT){
+        struct u_fs_extmap m;
+        if(ext_load(start, &m) == -1){
+            return -1;
         }
-        curr_blk = next_blk;
-        next_blk = disk_blk->nNextBlock;
-        read_disk_block(curr_blk, disk_blk);
-        if(buf_remain_size <= MAX_DATA_IN_BLOCK){ //这个块读的完
-            need_read = buf_remain_size;
+        long n = m.n;
+        long i;
+        for(i = m.n - 1; i >= 0 && m.ext[i].lblk + m.ext[i].len > lblk; i--){
+            struct u_fs_extent *e = &m.ext[i];
+            long keep = lblk > e->lblk ? lblk - e->lblk : 0; //这一段留下几块
+            bitmap_set_range(e->start + keep, e->len - keep, 0);
+            e->len = keep;
+            if(keep == 0){
+                n = i;
+            }
         }
-        memcpy(buf + r_size, disk_blk->data, need_read);
-        r_size += need_read;
-        buf_remain_size -= need_read;
+        int res = 0;
+        if(i < m.n - 1){ //有块被释放了
+            BMAP_GEN_BUMP();
+            m.n = n;
+            res = ext_store(start, &m);
+        }
+        ext_release(&m);
+        return res;
     }
-    free(disk_blk);
-    disk_blk = NULL;
-    return r_size; //退出，读成功
+    //块链表：走到要留下的最后一块，从它后面断开
+    long curr_blk = start;
+    long i;
+    for(i = 1; i < lblk; i++){
+        long next_blk = chain_next(curr_blk);
+        if(next_blk == -1){
+            return 0; //文件本来就没这么多块
+        }
+        curr_blk = next_blk;
+    }
+    struct u_fs_chain ch;
+    if(chain_get(curr_blk, &ch) == -1){
+        return -1;
+    }
+    long rest = ch.next;
+    if(rest == -1){
+        return 0;
+    }
+    ch.next = -1;
+    chain_set(curr_blk, &ch);
+    return clear_blocks(rest);
 }
-static int u_fs_write(const char *path, const char *buf, size_t size,
-		     off_t offset, struct fuse_file_info *fi)
-{
-    (void)fi;
 
+static int write_file(const char *path, const char *buf, size_t size, off_t offset, struct u_fs_fh *fh){
 	struct u_fs_file_directory* f_dir;
     f_dir = malloc(sizeof(struct u_fs_file_directory));
-    //读取文件所在位置
-    long file_addr = read_stat_from_path(path, f_dir);
-    long curr_blk = file_addr;
-    if(curr_blk == -1){ //找不到文件
+    //读取文件所在位置，调用的时候拿着文件的写锁；打开过的文件直接按fh记下的目录项找
+    const int by_fh = fh != NULL && fh->dir != -1;
+    long dir = by_fh ? fh->dir : -1;
+    long file_addr = by_fh ? fh_entry(fh, f_dir) : lookup_path(path, f_dir, &dir);
+    if(file_addr < 0){ //找不到文件
 		free(f_dir);
-		return -ENOENT;
+		return file_addr == -2 ? -ENAMETOOLONG : -ENOENT;
 	}
     if(f_dir->flag == 2){ //找到的是tmd目录
         free(f_dir);
 		return -EISDIR;
     }
-    //size_t real_fsize = (f_dir->fsize / BLOCK_SIZE) * MAX_DATA_IN_BLOCK;
-    if(offset > f_dir->fsize){
+    //别的fh攒着的数据先写下去，文件大小也跟着变了
+    int committed = dalloc_commit(f_dir->nStartBlock);
+    if(committed == 1){
+        file_addr = by_fh ? fh_entry(fh, f_dir) : lookup_path(path, f_dir, &dir);
+    }
+    if(committed == -1 || file_addr < 0){
         free(f_dir);
-        return -EFBIG;
+        return -EIO;
+    }
+
+    long start = f_dir->nStartBlock;
+    struct u_fs_fh tmp_fh;
+    if(fh == NULL || fh->start != start){
+        fh_init(&tmp_fh, start);
+        fh = &tmp_fh;
+    }
+    //写到文件尾后面的话，中间这一段要读成0：版本3没写到的块就是空洞，版本2要分配块清零
+    if(offset > f_dir->fsize && file_zero(fh, f_dir->fsize, offset) == -1){
+        free(f_dir);
+        if(fh == &tmp_fh){
+            fh_destroy(&tmp_fh);
+        }
+        return -ENOSPC;
     }
-    
     if((offset + size) > f_dir->fsize){ //如果比原来的文件长，修改原先文件的长度
         f_dir->fsize = offset + size;
-        write_stat_from_block(file_addr, f_dir);
+        if(by_fh){
+            fh_store(fh, f_dir);
+        }
+        else{
+            write_stat_from_block(dir, f_dir);
+        }
     }
-
-    struct u_fs_disk_block *disk_blk;
-	disk_blk = malloc(sizeof(struct u_fs_disk_block));
-    read_disk_block(f_dir->nStartBlock, disk_blk);
-    curr_blk = f_dir->nStartBlock; //curr_blk在文件的起始块
-    long next_blk = disk_blk->nNextBlock; //next_blk指向文件下一个块，如果没有下一个则为-1
     free(f_dir);
     f_dir = NULL;
-    //首先根据offset移动到开始块（由于每个块能实际保存MAX_DATA_IN_BLOCK实际为496）
-    long ignore_nblock = offset / MAX_DATA_IN_BLOCK;
-    int i;
-    for(i = 0; i < ignore_nblock; i++){
-        if(next_blk == -1){ //这种情况只会在文件尾，且刚好块被填满的情况
-            enlarge_a_block(curr_blk, disk_blk);
+    //同u_fs_read()，要写的块直接查块号表，文件不够长就分配新块接在表后面
+    //只有头尾不满一块的已有块要读出来再改；整块覆盖的块和新分配的块直接在内存里拼好，不用读
+    off_t curr_offset = offset & (BLOCK_SIZE - 1);
+    long first_idx = offset >> BLOCK_SHIFT;
+    long n_need = (curr_offset + size + BLOCK_SIZE - 1) >> BLOCK_SHIFT;
+    long end = first_idx + n_need;
+    long *blks;
+    long n_got = fh_map(fh, first_idx, end, 0, &blks);
+    //头尾不满一块的块是文件原有的才要先读出来，新分配的块和空洞不用读
+    int old_head = n_got > 0 && blks[0] != -1;
+    int old_tail = n_got >= n_need && blks[n_need - 1] != -1;
+    long i;
+    for(i = 0; i < n_got && i < n_need && blks[i] != -1; i++){
+    }
+    if(n_got != -1 && i < n_need){ //文件不够长或者写到了空洞里，还差的块一次分配好
+        n_got = fh_map(fh, first_idx, end, 1, &blks);
+        for(i = 0; i < n_got && i < n_need && blks[i] != -1; i++){
         }
-        read_disk_block(next_blk, disk_blk);
-        curr_blk = next_blk;
-        next_blk = disk_blk->nNextBlock;
+    }
+    if(n_got != -1){
+        n_got = i; //空间不够的话只写到第一个没分配到的块前面
+    }
+    if(n_got <= 0){
+        if(fh == &tmp_fh){
+            fh_destroy(&tmp_fh);
+        }
+        return n_got == -1 ? -EIO : -ENOSPC;
+    }
+    long n_tail = (curr_offset + size) & (BLOCK_SIZE - 1); //最后一块写到哪里，0表示写满
+    long partial[2]; //要先读的块
+    long n_partial = 0;
+    if(old_head && (curr_offset != 0 || (n_got == 1 && n_tail != 0))){
+        partial[n_partial++] = blks[0];
+    }
+    if(n_got > 1 && n_got == n_need && old_tail && n_tail != 0){
+        partial[n_partial++] = blks[n_got - 1];
+    }
+    if(n_partial > 0){
+        cache_prefetch_blocks(partial, n_partial);
     }
 
-    //可以开始写啦！curr_blk为当前块的位置哦
-    //如果要追加数据，则每次执行memcpy后，要将目标数组地址增加到你要追加数据的地址
-    off_t curr_offset = offset % MAX_DATA_IN_BLOCK;
-    size_t buf_remain_size = size; //剩余要写的size
-    if(buf_remain_size <= (MAX_DATA_IN_BLOCK - curr_offset)){ //如果刚好这个块能写完
-        memcpy(disk_blk->data + curr_offset, buf, buf_remain_size);
-        write_disk_block(curr_blk, disk_blk);
-        free(disk_blk);
-        disk_blk = NULL;
-        return 0; //退出，写成功
-    } 
-    //一个块写不完
-    //先写完这个块
-    memcpy(disk_blk->data + curr_offset, buf, (MAX_DATA_IN_BLOCK - curr_offset));
-    write_disk_block(curr_blk, disk_blk);
-    //开始写剩下的块，肯定都是从块头开始写的
-    buf_remain_size -= (MAX_DATA_IN_BLOCK - curr_offset);
-    size_t w_size = 0 + (MAX_DATA_IN_BLOCK - curr_offset);
-    size_t need_write = MAX_DATA_IN_BLOCK;
-    while(buf_remain_size > 0){
-        if(next_blk == -1){
-            enlarge_a_block(curr_blk, disk_blk);
+    if(blkdev.map == NULL && cache.capacity == 0){ //没有缓存，块号连续的一段直接一次写下去
+        long res = file_write_blocks(blks, n_got, old_head, old_tail, curr_offset, buf, size);
+        if(fh == &tmp_fh){
+            fh_destroy(&tmp_fh);
         }
-        curr_blk = next_blk;
-        next_blk = disk_blk->nNextBlock;
-        read_disk_block(curr_blk, disk_blk);
-        if(buf_remain_size <= MAX_DATA_IN_BLOCK){ //这个块写的完
-            need_write = buf_remain_size;
+        return res == -1 ? -EIO : res;
+    }
+
+    //可以开始写啦！数据直接写进get_block()拿到的块里
+    //每次执行memcpy后，要将源数组地址增加到下一次要写的数据的地址
+    char *disk_blk;
+    size_t w_size = 0; //已经写了的size
+    for(i = 0; i < n_got; i++){
+        size_t need_write = BLOCK_SIZE - curr_offset;
+        if(need_write > size - w_size){ //这个块写的完
+            need_write = size - w_size;
+        }
+        //只有头尾两块可能写不满；整块覆盖的块和新分配的块不用读，缓存回写时相邻的块会合并成一次pwritev
+        int partial_old = need_write < (size_t)BLOCK_SIZE && (i == 0 ? old_head : old_tail);
+        if((disk_blk = get_block(blks[i], partial_old)) == NULL){
+            break;
+        }
+        if(need_write < (size_t)BLOCK_SIZE && !partial_old){ //新块没写到的地方补0
+            memset(disk_blk, 0, BLOCK_SIZE);
         }
-        memcpy(disk_blk->data, buf + w_size, need_write);
-        write_disk_block(curr_blk, disk_blk);
+        memcpy(disk_blk + curr_offset, buf + w_size, need_write);
+        put_block(blks[i], disk_blk, 1);
         w_size += need_write;
-        buf_remain_size -= need_write;
+        curr_offset = 0; //后面的块肯定都是从块头开始写的
     }
-    free(disk_blk);
-    disk_blk = NULL;
-    return 0; //退出，写成功
+    if(fh == &tmp_fh){
+        fh_destroy(&tmp_fh);
+    }
+    return w_size; //退出，返回写了多少字节
 }
+
 static int u_fs_unlink(const char *path){
 
     char dirname[2*MAX_FILENAME + 1];
@@ -1256,47 +6338,595 @@ static int u_fs_unlink(const char *path){
     char fext[2*MAX_EXTENSION + 1];
     int res = check_path(path, dirname, fname, fext);
 
-    if(res < 1){ //路径有误
+    if(res != 1 && res != 2){ //路径有误
         return -EPERM;
     }
-    if(res == 1){ //根目录下的文件
-        struct u_fs_file_directory *tmp;
-        tmp = malloc(sizeof(struct u_fs_file_directory));
-        long curr_blk = read_stat_in_rootdir(fname, fext, tmp);
-
-        if(curr_blk == -1){ //提供的文件没找到
+    //先拿文件的写锁，再拿所在目录的写锁，重新找一次这一项，中间被换掉了就重来
+    struct u_fs_file_directory tmp;
+    while(1){
+        if(read_stat_from_path(path, &tmp) < 0){ //提供的文件或子目录没找到
             return -ENOENT;
         }
-        if(tmp->flag == 2){ //找到的是目录
+        if(tmp.flag == 2){ //找到的是目录
             return -EISDIR;
         }
-        rm_item(curr_blk, tmp);
-        free(tmp);
-        return 0;
-    }
-    else if(res == 2){ //子目录下的文件
-        struct u_fs_file_directory *tmp;
-        tmp = malloc(sizeof(struct u_fs_file_directory));
-        long curr_blk = read_stat_in_rootdir(dirname, "", tmp);
-        if(curr_blk == -1 || tmp->flag != 2){ //提供的子目录没找到
-            free(tmp);
-            return -ENOENT;
+        long start = tmp.nStartBlock;
+        if(obj_lock(start, 1) == -1){
+            return -ENOMEM;
         }
-        curr_blk = read_stat_from_block(fname, fext, tmp->nStartBlock, tmp);
-        if(curr_blk == -1){ //提供的文件没找到
-            free(tmp);
-            return -ENOENT;
+        long dir_blk = ROOT_DIR_BLOCK; //根目录下的文件
+        if(res == 2){ //子目录下的文件
+            dir_blk = dir_lock(dirname, 1);
         }
-        if(tmp->flag == 2){ //这种情况是不可能出现的，但还是先写上
-            free(tmp);
-            return -EISDIR;
+        else if(obj_lock(ROOT_DIR_BLOCK, 1) == -1){
+            dir_blk = -2;
+        }
+        if(dir_blk == -2){ //拿不到锁，重来也一样
+            obj_unlock(start);
+            return -ENOMEM;
         }
-        if(tmp->flag == 1){ //找到了文件，删除
-            rm_item(curr_blk, tmp);
-            free(tmp);
+        long curr_blk = dir_blk == -1 ? -1 : dir_lookup(fname, fext, dir_blk, &tmp);
+        if(curr_blk != -1 && tmp.nStartBlock == start){ //找到了文件，删除
+            rm_item(dir_blk, curr_blk, &tmp);
+            obj_unlock(dir_blk);
+            obj_unlock(start);
             return 0;
         }
-        return -EPERM;
+        if(dir_blk != -1){
+            obj_unlock(dir_blk);
+        }
+        obj_unlock(start);
+    }
+}
+
+static struct u_fs_inode **itab_bucket(const fuse_ino_t ino){
+    return &itab.bucket[((uint32_t)ino * 2654435761u) & (ITAB_BUCKETS - 1)];
+}
+
+static struct u_fs_inode *itab_find(const fuse_ino_t ino){
+    struct u_fs_inode *in;
+    for(in = *itab_bucket(ino); in != NULL; in = in->next){
+        if(in->ino == ino){
+            return in;
+        }
+    }
+    return NULL;
+}
+
+static int itab_copy(const fuse_ino_t ino, struct u_fs_inode *copy){
+    pthread_mutex_lock(&itab.lock);
+    struct u_fs_inode *in = itab_find(ino);
+    if(in != NULL){
+        *copy = *in;
+    }
+    pthread_mutex_unlock(&itab.lock);
+    return in == NULL ? -1 : 0;
+}
+
+static struct u_fs_inode *itab_get(const fuse_ino_t ino, const long dir, const char *fname,
+                                   const char *fext, const char *path){
+    struct u_fs_inode *in = itab_find(ino);
+    if(in == NULL){
+        in = calloc(1, sizeof(struct u_fs_inode));
+        if(in == NULL){
+            return NULL;
+        }
+        struct u_fs_inode **head = itab_bucket(ino);
+        in->ino = ino;
+        in->next = *head;
+        *head = in;
+        itab.n++;
+    }
+    //块可能已经换了主人，名字以这次查到的为准
+    in->dir = dir;
+    strcpy(in->fname, fname);
+    strcpy(in->fext, fext);
+    strcpy(in->path, path);
+    in->nlookup++;
+    return in;
+}
+
+static void itab_forget(const fuse_ino_t ino, const uint64_t nlookup){
+    pthread_mutex_lock(&itab.lock);
+    struct u_fs_inode **pp = itab_bucket(ino);
+    while(*pp != NULL && (*pp)->ino != ino){
+        pp = &(*pp)->next;
+    }
+    if(*pp == NULL){
+        pthread_mutex_unlock(&itab.lock);
+        return;
+    }
+    struct u_fs_inode *in = *pp;
+    in->nlookup = in->nlookup > nlookup ? in->nlookup - nlookup : 0;
+    if(in->nlookup == 0){
+        *pp = in->next;
+        free(in);
+        itab.n--;
+    }
+    pthread_mutex_unlock(&itab.lock);
+}
+
+static void itab_clear(void){
+    pthread_mutex_lock(&itab.lock);
+    long i;
+    for(i = 0; i < ITAB_BUCKETS; i++){
+        while(itab.bucket[i] != NULL){
+            struct u_fs_inode *in = itab.bucket[i];
+            itab.bucket[i] = in->next;
+            free(in);
+        }
+    }
+    itab.n = 0;
+    pthread_mutex_unlock(&itab.lock);
+}
+
+static const char *ll_path(const fuse_ino_t ino, char *path){
+    if(ino == FUSE_ROOT_ID){
+        strcpy(path, "/");
+        return path;
+    }
+    //别的线程可能正在forget这一项，拷出来用
+    pthread_mutex_lock(&itab.lock);
+    struct u_fs_inode *in = itab_find(ino);
+    if(in != NULL){
+        strcpy(path, in->path);
+    }
+    pthread_mutex_unlock(&itab.lock);
+    return in == NULL ? NULL : path;
+}
+
+static int ll_child(const fuse_ino_t parent, const char *name, long *dir,
+                    char *fname, char *fext, char *path){
+    char ppath[ITAB_PATH];
+    if(ll_path(parent, ppath) == NULL){
+        return -ESTALE;
+    }
+    if(strlen(name) > MAX_FILENAME + MAX_EXTENSION + 1){
+        return -ENAMETOOLONG;
+    }
+    //名字当成根目录下的路径检查一遍，顺便分出文件名和后缀名
+    char dirname[ITAB_PATH];
+    sprintf(path, "/%s", name);
+    int res = check_path(path, dirname, fname, fext);
+    if(res == -2){
+        return -ENAMETOOLONG;
+    }
+    if(res != 1){
+        return -ENOENT;
+    }
+    if(parent == FUSE_ROOT_ID){
+        *dir = ROOT_DIR_BLOCK;
+    }
+    else{
+        *dir = parent; //目录的inode号就是它的第一块
+        if(snprintf(path, ITAB_PATH, "%s/%s", ppath, name) >= ITAB_PATH){
+            return -ENAMETOOLONG;
+        }
+    }
+    return 0;
+}
+
+static int ll_stat(const fuse_ino_t ino, struct stat *stbuf){
+    if(ino == FUSE_ROOT_ID){
+        return u_fs_getattr("/", stbuf, NULL);
+    }
+    struct u_fs_inode in;
+    if(itab_copy(ino, &in) == -1){
+        return -ESTALE;
+    }
+    //一般是目录项缓存命中，只读那一项所在的块
+    struct u_fs_file_directory item;
+    if(read_stat_from_block(in.fname, in.fext, in.dir, &item) == -1 || item.nStartBlock != (long)ino){
+        return -ENOENT;
+    }
+    fill_stat(&item, stbuf);
+    return 0;
+}
+
+static void ll_reply_entry(fuse_req_t req, const long dir, const char *fname,
+                           const char *fext, const char *path){
+    struct u_fs_file_directory item;
+    if(read_stat_from_block(fname, fext, dir, &item) == -1){
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    pthread_mutex_lock(&itab.lock);
+    struct u_fs_inode *in = itab_get(item.nStartBlock, dir, fname, fext, path);
+    if(in != NULL){
+        e.ino = in->ino;
+        e.generation = in->gen;
+    }
+    pthread_mutex_unlock(&itab.lock);
+    if(in == NULL){
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    fill_stat(&item, &e.attr);
+    e.attr_timeout = LL_TIMEOUT;
+    e.entry_timeout = LL_TIMEOUT;
+    fuse_reply_entry(req, &e);
+}
+
+static void u_fs_ll_init(void *userdata, struct fuse_conn_info *conn){
+    (void) userdata;
+    u_fs_init(conn, NULL);
+}
+
+static void u_fs_ll_destroy(void *userdata){
+    u_fs_destroy(userdata);
+    printf("u_fs inodes: %ld\n", itab.n);
+    itab_clear();
+}
+
+static void u_fs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name){
+    long dir;
+    char fname[ITAB_PATH];
+    char fext[ITAB_PATH];
+    char path[ITAB_PATH];
+    int res = ll_child(parent, name, &dir, fname, fext, path);
+    if(res != 0){
+        fuse_reply_err(req, -res);
+        return;
+    }
+    ll_reply_entry(req, dir, fname, fext, path);
+}
+
+static void u_fs_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup){
+    itab_forget(ino, nlookup);
+    fuse_reply_none(req);
+}
+
+static void u_fs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+    (void) fi;
+    struct stat st;
+    int res = ll_stat(ino, &st);
+    if(res != 0){
+        fuse_reply_err(req, -res);
+        return;
+    }
+    fuse_reply_attr(req, &st, LL_TIMEOUT);
+}
+
+static void u_fs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+            int to_set, struct fuse_file_info *fi){
+    char buf[ITAB_PATH];
+    const char *path = ll_path(ino, buf);
+    if(path == NULL){
+        fuse_reply_err(req, ESTALE);
+        return;
+    }
+    //只能改大小，权限、属主、时间目录项里都没地方记，忽略
+    if(to_set & FUSE_SET_ATTR_SIZE){
+        int res = u_fs_truncate(path, attr->st_size, fi);
+        if(res != 0){
+            fuse_reply_err(req, -res);
+            return;
+        }
+    }
+    u_fs_ll_getattr(req, ino, fi);
+}
+
+static void u_fs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev){
+    long dir;
+    char fname[ITAB_PATH];
+    char fext[ITAB_PATH];
+    char path[ITAB_PATH];
+    int res = ll_child(parent, name, &dir, fname, fext, path);
+    if(res == 0){
+        res = u_fs_mknod(path, mode, rdev);
+    }
+    if(res != 0){
+        fuse_reply_err(req, -res);
+        return;
+    }
+    ll_reply_entry(req, dir, fname, fext, path);
+}
+
+static void u_fs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode){
+    long dir;
+    char fname[ITAB_PATH];
+    char fext[ITAB_PATH];
+    char path[ITAB_PATH];
+    int res = ll_child(parent, name, &dir, fname, fext, path);
+    if(res == 0){
+        res = u_fs_mkdir(path, mode);
+    }
+    if(res != 0){
+        fuse_reply_err(req, -res);
+        return;
+    }
+    ll_reply_entry(req, dir, fname, fext, path);
+}
+
+/** ll_remove()
+ * 功能：unlink和rmdir共用，删掉以后inode表里那一项的gen加一
+ * 参数：req：请求; parent：父目录的inode号; name：名字; rm：u_fs_unlink或u_fs_rmdir
+ * 返回：NULL
+ */
+static void ll_remove(fuse_req_t req, const fuse_ino_t parent, const char *name, int (*rm)(const char *)){
+    long dir;
+    char fname[ITAB_PATH];
+    char fext[ITAB_PATH];
+    char path[ITAB_PATH];
+    struct u_fs_file_directory item;
+    int res = ll_child(parent, name, &dir, fname, fext, path);
+    if(res == 0 && read_stat_from_block(fname, fext, dir, &item) == -1){
+        res = -ENOENT;
+    }
+    if(res == 0){
+        res = rm(path);
+    }
+    if(res == 0){
+        pthread_mutex_lock(&itab.lock);
+        struct u_fs_inode *in = itab_find(item.nStartBlock);
+        if(in != NULL){
+            in->gen++; //这个块再分给新文件时是另一个inode
+        }
+        pthread_mutex_unlock(&itab.lock);
+    }
+    fuse_reply_err(req, -res);
+}
+
+static void u_fs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name){
+    ll_remove(req, parent, name, u_fs_unlink);
+}
+
+static void u_fs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name){
+    ll_remove(req, parent, name, u_fs_rmdir);
+}
+
+static void u_fs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+    char buf[ITAB_PATH];
+    const char *path = ll_path(ino, buf);
+    int res = path == NULL ? -ESTALE : u_fs_open(path, fi);
+    if(res != 0){
+        fuse_reply_err(req, -res);
+        return;
+    }
+    fuse_reply_open(req, fi);
+}
+
+static void u_fs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+            struct fuse_file_info *fi){
+    char pbuf[ITAB_PATH];
+    const char *path = ll_path(ino, pbuf);
+    if(path == NULL){
+        fuse_reply_err(req, ESTALE);
+        return;
+    }
+    if(!blkdev.direct){
+        //回复完才放读锁，splice完之前文件的块不会被释放、分给别的文件
+        struct fuse_bufvec *v;
+        long start;
+        int res = file_bufvec(path, fi, size, off, &v, &start);
+        if(res < 0){
+            fuse_reply_err(req, -res);
+            return;
+        }
+        fuse_reply_data(req, v, FUSE_BUF_SPLICE_MOVE);
+        obj_unlock(start);
+        bufvec_free(v);
+        return;
+    }
+    char *buf = malloc(size);
+    if(buf == NULL){
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    int res = u_fs_read(path, buf, size, off, fi);
+    if(res < 0){
+        fuse_reply_err(req, -res);
+    }
+    else{
+        fuse_reply_buf(req, buf, res);
+    }
+    free(buf);
+}
+
+static void u_fs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+            off_t off, struct fuse_file_info *fi){
+    char pbuf[ITAB_PATH];
+    const char *path = ll_path(ino, pbuf);
+    int res = path == NULL ? -ESTALE : u_fs_write(path, buf, size, off, fi);
+    if(res < 0){
+        fuse_reply_err(req, -res);
+        return;
+    }
+    fuse_reply_write(req, res);
+}
+
+static void u_fs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+            off_t off, struct fuse_file_info *fi){
+    char pbuf[ITAB_PATH];
+    const char *path = ll_path(ino, pbuf);
+    int res = path == NULL ? -ESTALE : u_fs_write_buf(path, bufv, off, fi);
+    if(res < 0){
+        fuse_reply_err(req, -res);
+        return;
+    }
+    fuse_reply_write(req, res);
+}
+
+static void u_fs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+    char buf[ITAB_PATH];
+    fuse_reply_err(req, -u_fs_flush(ll_path(ino, buf), fi));
+}
+
+static void u_fs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+    char buf[ITAB_PATH];
+    fuse_reply_err(req, -u_fs_release(ll_path(ino, buf), fi));
+}
+
+static void u_fs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi){
+    char buf[ITAB_PATH];
+    fuse_reply_err(req, -u_fs_fsync(ll_path(ino, buf), datasync, fi));
+}
+
+/** ll_dir_fill()
+ * 功能：u_fs_readdir()的filler，把一项按fuse_add_direntry()的格式接到u_fs_dirbuf后面
+ * 参数：buf：u_fs_dirbuf; name：名字; stbuf：这一项的属性; 其余不用
+ * 返回：1 内存不够; 0 成功
+ */
+static int ll_dir_fill(void *buf, const char *name, const struct stat *stbuf,
+                       off_t off, enum fuse_fill_dir_flags flags){
+    (void) off;
+    (void) flags;
+    struct u_fs_dirbuf *db = buf;
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    if(strcmp(name, ".") == 0){
+        st.st_ino = db->ino;
+        st.st_mode = S_IFDIR;
+    }
+    else if(strcmp(name, "..") == 0){
+        st.st_ino = FUSE_ROOT_ID;
+        st.st_mode = S_IFDIR;
+    }
+    else if(stbuf != NULL){ //u_fs_readdir()拿着目录的锁，这里不能再去查目录
+        st = *stbuf;
+    }
+    size_t len = fuse_add_direntry(db->req, NULL, 0, name, NULL, 0);
+    char *p = realloc(db->p, db->size + len);
+    if(p == NULL){
+        return 1;
+    }
+    db->p = p;
+    fuse_add_direntry(db->req, db->p + db->size, len, name, &st, db->size + len);
+    db->size += len;
+    return 0;
+}
+
+static void u_fs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+    char buf[ITAB_PATH];
+    const char *path = ll_path(ino, buf);
+    if(path == NULL){
+        fuse_reply_err(req, ESTALE);
+        return;
+    }
+    struct u_fs_dirbuf *db = calloc(1, sizeof(struct u_fs_dirbuf));
+    if(db == NULL){
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    db->req = req;
+    db->ino = ino;
+    int res = u_fs_readdir(path, db, ll_dir_fill, 0, NULL, 0);
+    if(res != 0){
+        free(db->p);
+        free(db);
+        fuse_reply_err(req, -res);
+        return;
+    }
+    fi->fh = (uintptr_t)db;
+    fuse_reply_open(req, fi);
+}
+
+static void u_fs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+            struct fuse_file_info *fi){
+    (void) ino;
+    struct u_fs_dirbuf *db = (struct u_fs_dirbuf *)(uintptr_t)fi->fh;
+    if(off >= (off_t)db->size){
+        fuse_reply_buf(req, NULL, 0);
+        return;
+    }
+    fuse_reply_buf(req, db->p + off, db->size - off < size ? db->size - off : size);
+}
+
+static void u_fs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+    (void) ino;
+    struct u_fs_dirbuf *db = (struct u_fs_dirbuf *)(uintptr_t)fi->fh;
+    if(db != NULL){
+        free(db->p);
+        free(db);
+        fi->fh = 0;
+    }
+    fuse_reply_err(req, 0);
+}
+
+static void u_fs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset,
+            off_t length, struct fuse_file_info *fi){
+    char buf[ITAB_PATH];
+    const char *path = ll_path(ino, buf);
+    fuse_reply_err(req, path == NULL ? ESTALE : -u_fs_fallocate(path, mode, offset, length, fi));
+}
+
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 8)
+static void u_fs_ll_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence, struct fuse_file_info *fi){
+    char buf[ITAB_PATH];
+    const char *path = ll_path(ino, buf);
+    off_t res = path == NULL ? -ESTALE : u_fs_lseek(path, off, whence, fi);
+    if(res < 0){
+        fuse_reply_err(req, -res);
+        return;
+    }
+    fuse_reply_lseek(req, res);
+}
+#endif
+
+static void u_fs_ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size){
+    char buf[ITAB_PATH];
+    const char *path = ll_path(ino, buf);
+    char *value = size > 0 ? malloc(size) : NULL;
+    int res = path == NULL ? -ESTALE : u_fs_getxattr(path, name, value, size);
+    if(res < 0){
+        fuse_reply_err(req, -res);
+    }
+    else if(size == 0){ //只是问属性有多长
+        fuse_reply_xattr(req, res);
+    }
+    else{
+        fuse_reply_buf(req, value, res);
+    }
+    free(value);
+}
+
+static void u_fs_ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size){
+    char buf[ITAB_PATH];
+    const char *path = ll_path(ino, buf);
+    char *list = size > 0 ? malloc(size) : NULL;
+    int res = path == NULL ? -ESTALE : u_fs_listxattr(path, list, size);
+    if(res < 0){
+        fuse_reply_err(req, -res);
+    }
+    else if(size == 0){
+        fuse_reply_xattr(req, res);
+    }
+    else{
+        fuse_reply_buf(req, list, res);
+    }
+    free(list);
+}
+
+static int ll_main(struct fuse_args *args){
+    struct fuse_cmdline_opts opts;
+    if(fuse_parse_cmdline(args, &opts) != 0){
+        return 1;
+    }
+    if(opts.mountpoint == NULL){
+        fprintf(stderr, "usage: u_fs --lowlevel [options] <mountpoint>\n");
+        return 1;
+    }
+    int ret = 1;
+    struct fuse_session *se = fuse_session_new(args, &u_fs_ll_oper, sizeof(u_fs_ll_oper), NULL);
+    if(se != NULL){
+        if(fuse_set_signal_handlers(se) == 0){
+            if(fuse_session_mount(se, opts.mountpoint) == 0){
+                fuse_daemonize(opts.foreground);
+                //同fuse_main()，默认多线程处理请求，-s时单线程
+                if(opts.singlethread){
+                    ret = fuse_session_loop(se) == 0 ? 0 : 1;
+                }
+                else{
+                    ret = fuse_session_loop_mt(se, opts.clone_fd) == 0 ? 0 : 1;
+                }
+                fuse_session_unmount(se);
+            }
+            fuse_remove_signal_handlers(se);
+        }
+        fuse_session_destroy(se);
     }
-    return -EPERM;
+    free(opts.mountpoint);
+    return ret;
 }